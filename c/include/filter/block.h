@@ -69,6 +69,9 @@ inline uint64_t libfilter_block_size_in_bytes(const libfilter_block *);
 
 inline void libfilter_block_scalar_add_hash(uint64_t hash, libfilter_block *);
 inline bool libfilter_block_scalar_find_hash(uint64_t hash, const libfilter_block *);
+// Like libfilter_block_add_hash, but sets the bits with atomic OR, so it may run
+// concurrently with libfilter_block_find_hash and with other calls to itself.
+inline void libfilter_block_concurrent_add_hash(uint64_t hash, libfilter_block *);
 #if defined(__AVX2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
 inline void libfilter_block_simd_add_hash(uint64_t hash, libfilter_block *);
 inline bool libfilter_block_simd_find_hash(uint64_t hash, const libfilter_block *);
@@ -151,6 +154,19 @@ __attribute__((always_inline)) inline bool libfilter_block_scalar_find_hash(
   return true;
 }
 
+__attribute__((always_inline)) inline void libfilter_block_concurrent_add_hash(
+    uint64_t hash, libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  const libfilter_block_scalar_bucket mask =
+      libfilter_block_scalar_make_mask(hash);
+  uint32_t *bucket = here->block_.block + 8 * bucket_idx;
+  // Bits only ever go from 0 to 1, so readers using plain (SIMD) loads see each word
+  // either before or after the OR, and never miss a key whose insert has returned.
+  for (unsigned i = 0; i < 8; ++i) {
+    __atomic_fetch_or(&bucket[i], mask.payload[i], __ATOMIC_RELAXED);
+  }
+}
+
 __attribute__((always_inline)) inline uint64_t libfilter_block_size_in_bytes(
     const libfilter_block *here) {
   return (here->num_buckets_) * ((8 * 32 / CHAR_BIT));
@@ -81,12 +81,14 @@ INLINE bool libfilter_minimal_taffy_cuckoo_level_find(
 typedef struct {
   // TODO: can use identity for one side?
   libfilter_feistel hi, lo;
+  // All levels of a side are in one region, in order, starting at levels[0].data. The
+  // other data pointers point into it.
   libfilter_minimal_taffy_cuckoo_level levels[libfilter_minimal_taffy_cuckoo_levels];
   libfilter_minimal_taffy_cuckoo_path * stashes;
   size_t stashes_size, stashes_capacity;
 } libfilter_minimal_taffy_cuckoo_side;
 
-INLINE bool libfilter_minimal_taffy_cuckoo_side_find(
+INLINE bool libfilter_minimal_taffy_cuckoo_stash_find(
     const libfilter_minimal_taffy_cuckoo_side* side,
     libfilter_minimal_taffy_cuckoo_path p) {
   for(size_t i = 0; i < side->stashes_size; ++i) {
@@ -98,7 +100,14 @@ INLINE bool libfilter_minimal_taffy_cuckoo_side_find(
       return true;
     }
   }
-  return libfilter_minimal_taffy_cuckoo_level_find(&side->levels[p.level], p);
+  return false;
+}
+
+INLINE bool libfilter_minimal_taffy_cuckoo_side_find(
+    const libfilter_minimal_taffy_cuckoo_side* side,
+    libfilter_minimal_taffy_cuckoo_path p) {
+  return libfilter_minimal_taffy_cuckoo_stash_find(side, p) ||
+         libfilter_minimal_taffy_cuckoo_level_find(&side->levels[p.level], p);
 }
 
 // Returns an empty path (tail = 0) if insert added a new element. Returns p if insert
@@ -119,6 +128,9 @@ typedef struct {
   uint64_t log_side_size;
   libfilter_pcg_random rng;
   uint64_t occupied;
+  // As in libfilter_taffy_cuckoo
+  libfilter_taffy_cuckoo_policy policy;
+  libfilter_taffy_cuckoo_stats stats;
 } libfilter_minimal_taffy_cuckoo;
 
 void libfilter_minimal_taffy_cuckoo_null_out(libfilter_minimal_taffy_cuckoo*);
@@ -128,6 +140,9 @@ void libfilter_minimal_taffy_cuckoo_destruct(libfilter_minimal_taffy_cuckoo*);
 libfilter_minimal_taffy_cuckoo libfilter_minimal_taffy_cuckoo_create(
     int log_side_size, const uint64_t* entropy);
 
+int libfilter_minimal_taffy_cuckoo_clone(const libfilter_minimal_taffy_cuckoo* that,
+                                         libfilter_minimal_taffy_cuckoo*);
+
 INLINE uint64_t libfilter_minimal_taffy_cuckoo_capacity(
     const libfilter_minimal_taffy_cuckoo* here) {
   return 2 + 2 * libfilter_slots *
@@ -141,6 +156,29 @@ uint64_t libfilter_minimal_taffy_cuckoo_size_in_bytes(
 libfilter_minimal_taffy_cuckoo libfilter_minimal_taffy_cuckoo_create_with_bytes(
     uint64_t bytes);
 
+// The same as libfilter_taffy_cuckoo_default_policy, but with a ttl of 128
+libfilter_taffy_cuckoo_policy libfilter_minimal_taffy_cuckoo_default_policy(void);
+
+// See libfilter_taffy_cuckoo_set_policy
+void libfilter_minimal_taffy_cuckoo_set_policy(libfilter_minimal_taffy_cuckoo* here,
+                                               libfilter_taffy_cuckoo_policy policy);
+
+// Counts a find that matched p on side, in a level or in the stash
+INLINE void libfilter_minimal_taffy_cuckoo_stats_hit(
+    const libfilter_minimal_taffy_cuckoo* here,
+    const libfilter_minimal_taffy_cuckoo_side* side,
+    libfilter_minimal_taffy_cuckoo_path p) {
+#if defined(LIBFILTER_TAFFY_CUCKOO_STATS)
+  if (libfilter_minimal_taffy_cuckoo_level_find(&side->levels[p.level], p)) {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, bucket_hits, 1);
+  } else {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, stash_hits, 1);
+  }
+#else
+  (void)here, (void)side, (void)p;
+#endif
+}
+
 INLINE bool libfilter_minimal_taffy_cuckoo_find_hash(
     const libfilter_minimal_taffy_cuckoo* here, uint64_t k) {
   for (int i = 0; i < 2; ++i) {
@@ -148,83 +186,174 @@ INLINE bool libfilter_minimal_taffy_cuckoo_find_hash(
         k, &here->sides[i].lo, here->cursor, here->log_side_size, true);
     if (p.slot.tail != 0 &&
         libfilter_minimal_taffy_cuckoo_side_find(&here->sides[i], p)) {
+      libfilter_minimal_taffy_cuckoo_stats_hit(here, &here->sides[i], p);
       return true;
     }
     p = libfilter_minimal_taffy_cuckoo_to_path(k, &here->sides[i].hi, here->cursor,
                                                here->log_side_size, false);
     if (p.slot.tail != 0 &&
         libfilter_minimal_taffy_cuckoo_side_find(&here->sides[i], p)) {
+      libfilter_minimal_taffy_cuckoo_stats_hit(here, &here->sides[i], p);
       return true;
     }
   }
   return false;
 }
 
-void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo* here);
+// Sets results[i] to libfilter_minimal_taffy_cuckoo_find_hash(here, hashes[i]) for each
+// i < n. This is faster than calling find_hash n times: all four paths of several keys
+// are computed, and their buckets prefetched, before any of them are read.
+void libfilter_minimal_taffy_cuckoo_find_hash_batch(
+    const libfilter_minimal_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    bool* results);
+
+// Doubles one level of the filter. Returns false, leaving the filter as it was, if memory
+// runs out.
+bool libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo* here);
+// Doubles the capacity of the stashes of side
+void libfilter_minimal_taffy_cuckoo_stash_grow(libfilter_minimal_taffy_cuckoo_side* side);
 void libfilter_minimal_taffy_cuckoo_insert_detail(libfilter_minimal_taffy_cuckoo* here,
                                                   int side,
                                                   libfilter_minimal_taffy_cuckoo_path p,
                                                   int ttl);
 
+// Upsizes until n - 1 more entries would leave the filter within its policy, so that n
+// inserts can go ahead without checking again. Returns false if memory runs out first.
+INLINE bool libfilter_minimal_taffy_cuckoo_reserve(libfilter_minimal_taffy_cuckoo* here,
+                                                   uint64_t n) {
+  const uint64_t later = n - 1;
+  while (here->occupied + later >
+             here->policy.max_load * libfilter_minimal_taffy_cuckoo_capacity(here) ||
+         here->occupied + later + 4 >= libfilter_minimal_taffy_cuckoo_capacity(here) ||
+         here->sides[0].stashes_size + here->sides[1].stashes_size >
+             here->policy.max_stash) {
+    for (int i = 0; i < here->policy.growth_steps; ++i) {
+      if (!libfilter_minimal_taffy_cuckoo_upsize(here)) return false;
+    }
+  }
+  return true;
+}
+
 INLINE bool libfilter_minimal_taffy_cuckoo_add_hash(
     libfilter_minimal_taffy_cuckoo* here, uint64_t k) {
-  while (here->occupied > 0.9 * libfilter_minimal_taffy_cuckoo_capacity(here) ||
-         here->occupied + 4 >= libfilter_minimal_taffy_cuckoo_capacity(here) ||
-         here->sides[0].stashes_size + here->sides[1].stashes_size > 8) {
-    libfilter_minimal_taffy_cuckoo_upsize(here);
-  }
+  if (!libfilter_minimal_taffy_cuckoo_reserve(here, 1)) return false;
   // TODO: only need one path here. Which one to pick?
   libfilter_minimal_taffy_cuckoo_path p = libfilter_minimal_taffy_cuckoo_to_path(
       k, &here->sides[0].hi, here->cursor, here->log_side_size, false);
-  libfilter_minimal_taffy_cuckoo_insert_detail(here, 0, p, 128);
+  libfilter_minimal_taffy_cuckoo_insert_detail(here, 0, p, here->policy.ttl);
   return true;
 }
 
+// Inserts hashes[i] for each i < n. This is faster than calling add_hash n times: the
+// kick chains of several keys are interleaved, and the next bucket of each chain is
+// prefetched before any of them are read. Returns false, with only some of the hashes
+// inserted, if memory runs out.
+bool libfilter_minimal_taffy_cuckoo_add_hash_batch(libfilter_minimal_taffy_cuckoo* here,
+                                                   const uint64_t* hashes, size_t n);
+
+// A path on its way into side, with ttl evictions left before it is stashed
+typedef struct {
+  libfilter_minimal_taffy_cuckoo_path p;
+  int side;
+  int ttl;
+  uint64_t kicks;
+} libfilter_minimal_taffy_cuckoo_chain;
+
+#define libfilter_minimal_taffy_cuckoo_pending_capacity 16
+
+// Entries split in two by moving sides wait here, rather than on the call stack, to
+// start chains of their own. This bounds the stack space an insert uses.
+typedef struct {
+  libfilter_minimal_taffy_cuckoo_chain data[libfilter_minimal_taffy_cuckoo_pending_capacity];
+  int size, peak;
+} libfilter_minimal_taffy_cuckoo_pending;
+
+INLINE void libfilter_minimal_taffy_cuckoo_stash(libfilter_minimal_taffy_cuckoo* here,
+                                                 int side,
+                                                 libfilter_minimal_taffy_cuckoo_path p) {
+  if (here->sides[side].stashes_size == here->sides[side].stashes_capacity) {
+    libfilter_minimal_taffy_cuckoo_stash_grow(&here->sides[side]);
+  }
+  here->sides[side].stashes[here->sides[side].stashes_size++] = p;
+  ++here->occupied;
+  libfilter_taffy_cuckoo_stats_add(&here->stats, stash_inserts, 1);
+}
+
+// Starts a chain for an entry split off by re_path, or stashes it if too many are
+// already waiting
+INLINE void libfilter_minimal_taffy_cuckoo_pending_push(
+    libfilter_minimal_taffy_cuckoo* here, libfilter_minimal_taffy_cuckoo_pending* pending,
+    libfilter_minimal_taffy_cuckoo_chain c) {
+  if (pending->size == libfilter_minimal_taffy_cuckoo_pending_capacity) {
+    libfilter_minimal_taffy_cuckoo_stash(here, c.side, c.p);
+    libfilter_taffy_cuckoo_stats_chain(&here->stats, c.kicks);
+    libfilter_taffy_cuckoo_stats_add(&here->stats, pending_overflows, 1);
+    return;
+  }
+  pending->data[pending->size++] = c;
+  if (pending->size > pending->peak) pending->peak = pending->size;
+}
+
+// Tries to place c->p in side c->side. Returns true if c is done, either placed or
+// stashed. Otherwise, c holds the entry it displaced, which goes on the other side next.
+INLINE bool libfilter_minimal_taffy_cuckoo_chain_step(
+    libfilter_minimal_taffy_cuckoo* here, libfilter_minimal_taffy_cuckoo_chain* c,
+    libfilter_minimal_taffy_cuckoo_pending* pending) {
+  assert(c->p.slot.tail != 0);
+  const int i = c->side;
+  --c->ttl;
+  if (c->ttl < 0) {
+    libfilter_minimal_taffy_cuckoo_stash(here, i, c->p);
+    libfilter_taffy_cuckoo_stats_chain(&here->stats, c->kicks);
+    return true;
+  }
+  libfilter_minimal_taffy_cuckoo_path r =
+      libfilter_minimal_taffy_cuckoo_side_insert(&here->sides[i], c->p, &here->rng);
+  if (r.slot.tail == 0) {
+    // Found an empty slot
+    ++here->occupied;
+    libfilter_taffy_cuckoo_stats_chain(&here->stats, c->kicks);
+    return true;
+  }
+  if (libfilter_minimal_taffy_cuckoo_path_equal(r, c->p)) {
+    // Combined with or already present in a slot. Success, but no increase in filter
+    // size
+    libfilter_taffy_cuckoo_stats_chain(&here->stats, c->kicks);
+    return true;
+  }
+  ++c->kicks;
+  libfilter_minimal_taffy_cuckoo_path extra;
+  libfilter_minimal_taffy_cuckoo_path next = libfilter_minimal_taffy_cuckoo_re_path(
+      r, &here->sides[i].lo, &here->sides[i].hi, &here->sides[1 - i].lo,
+      &here->sides[1 - i].hi, here->log_side_size, here->log_side_size, here->cursor,
+      here->cursor, &extra);
+  if (extra.slot.tail != 0) {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, tail_splits, 1);
+    libfilter_minimal_taffy_cuckoo_chain e = {extra, 1 - i, c->ttl, 0};
+    libfilter_minimal_taffy_cuckoo_pending_push(here, pending, e);
+  } else if (next.slot.tail != r.slot.tail) {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, tail_shortenings, 1);
+  }
+  // TODO: what if insert returns stashed? Do we need multiple states? Maybe green ,
+  // yellow red? Or maybe break at the beginning of this logic if repath returns two
+  // things or retry if there aren't two stashes open at this time.
+  c->p = next;
+  c->side = 1 - i;
+  assert(c->p.slot.tail != 0);
+  return false;
+}
+
 inline void libfilter_minimal_taffy_cuckoo_insert_detail(
     libfilter_minimal_taffy_cuckoo* here, int side, libfilter_minimal_taffy_cuckoo_path p,
     int ttl) {
   assert(p.slot.tail != 0);
+  libfilter_minimal_taffy_cuckoo_pending pending;
+  pending.size = pending.peak = 0;
+  libfilter_minimal_taffy_cuckoo_chain c = {p, side, ttl, 0};
   while (true) {
-    for (int j = 0; j < 2; ++j) {
-      int tmp[2] = {side, 1 - side};
-      int i = tmp[j];
-      --ttl;
-      if (ttl < 0) {
-        if (here->sides[i].stashes_size == here->sides[i].stashes_capacity) {
-          here->sides[i].stashes = (libfilter_minimal_taffy_cuckoo_path*)realloc(
-              here->sides[i].stashes, 2 * here->sides[i].stashes_capacity *
-                                          sizeof(libfilter_minimal_taffy_cuckoo_path));
-          here->sides[i].stashes_capacity *= 2;
-        }
-        here->sides[i].stashes[here->sides[i].stashes_size++] = p;
-        ++here->occupied;
-        return;
-      }
-      libfilter_minimal_taffy_cuckoo_path q = p;
-      libfilter_minimal_taffy_cuckoo_path r =
-          libfilter_minimal_taffy_cuckoo_side_insert(&here->sides[i], p, &here->rng);
-      if (r.slot.tail == 0) {
-        // Found an empty slot
-        ++here->occupied;
-        return;
-      }
-      if (libfilter_minimal_taffy_cuckoo_path_equal(r, q)) {
-        // Combined with or already present in a slot. Success, but no increase in
-        // filter size
-        return;
-      }
-      libfilter_minimal_taffy_cuckoo_path extra;
-      libfilter_minimal_taffy_cuckoo_path next = libfilter_minimal_taffy_cuckoo_re_path(
-          r, &here->sides[i].lo, &here->sides[i].hi, &here->sides[1 - i].lo, &here->sides[1 - i].hi,
-          here->log_side_size, here->log_side_size, here->cursor, here->cursor, &extra);
-      if (extra.slot.tail != 0) {
-        libfilter_minimal_taffy_cuckoo_insert_detail(here, 1 - i, extra, ttl);
-      }
-      // TODO: what if insert returns stashed? Do we need multiple states? Maybe green ,
-      // yellow red? Or maybe break at the beginning of this logic if repath returns two
-      // things or retry if there aren't two stashes open at this time.
-      p = next;
-      assert(p.slot.tail != 0);
-    }
+    while (!libfilter_minimal_taffy_cuckoo_chain_step(here, &c, &pending)) {}
+    if (pending.size == 0) break;
+    c = pending.data[--pending.size];
   }
+  libfilter_taffy_cuckoo_stats_pending(&here->stats, pending.peak);
 }
@@ -103,23 +103,24 @@ cursor.
 //
 // if full_is_short is true and the path is before the cursor, this function retuens an
 // empty path (tail == 0).
-INLINE libfilter_minimal_taffy_cuckoo_path libfilter_minimal_taffy_cuckoo_to_path(
-    uint64_t raw, const libfilter_feistel* f, int cursor, uint64_t low_level_size,
-    bool full_is_short) {
-  const uint64_t pre_hash_level_index_fp_and_tail =
-      raw >> (64 - libfilter_minimal_taffy_cuckoo_log_levels - low_level_size -
-              libfilter_minimal_taffy_cuckoo_head_size + full_is_short -
-              libfilter_minimal_taffy_cuckoo_tail_size);
-  const uint64_t raw_tail = libfilter_mask(libfilter_minimal_taffy_cuckoo_tail_size,
-                                           pre_hash_level_index_fp_and_tail);
-  const uint64_t pre_hash_level_index_and_fp =
-      pre_hash_level_index_fp_and_tail >> libfilter_minimal_taffy_cuckoo_tail_size;
-  const uint64_t hashed_level_index_and_fp = libfilter_feistel_permute_forward(
-      f,
-      libfilter_minimal_taffy_cuckoo_log_levels + low_level_size +
-          libfilter_minimal_taffy_cuckoo_head_size - full_is_short,
-      pre_hash_level_index_and_fp);
+// The number of bits of a raw hash, after the tail, that to_path permutes
+INLINE int libfilter_minimal_taffy_cuckoo_path_width(uint64_t low_level_size,
+                                                     bool full_is_short) {
+  return libfilter_minimal_taffy_cuckoo_log_levels + low_level_size +
+         libfilter_minimal_taffy_cuckoo_head_size - full_is_short;
+}
+
+// The rest of to_path, once the level index and fingerprint have been permuted. Split
+// out so that batched finds can permute several keys at once.
+INLINE libfilter_minimal_taffy_cuckoo_path libfilter_minimal_taffy_cuckoo_to_path_hashed(
+    uint64_t raw_tail, uint64_t hashed_level_index_and_fp, int cursor,
+    uint64_t low_level_size, bool full_is_short) {
   libfilter_minimal_taffy_cuckoo_path result;
+  // Zeroed so that every path returned is fully initialized, including the empty one
+  // below. Setting only the tail bit-field of an uninitialized path lets the compiler
+  // assume any value for it, and callers that test the tail can then read a garbage
+  // bucket.
+  memset(&result, 0, sizeof(result));
   result.level =
       hashed_level_index_and_fp >>
       (low_level_size + libfilter_minimal_taffy_cuckoo_head_size - full_is_short);
@@ -145,6 +146,22 @@ INLINE libfilter_minimal_taffy_cuckoo_path libfilter_minimal_taffy_cuckoo_to_pat
   return result;
 }
 
+INLINE libfilter_minimal_taffy_cuckoo_path libfilter_minimal_taffy_cuckoo_to_path(
+    uint64_t raw, const libfilter_feistel* f, int cursor, uint64_t low_level_size,
+    bool full_is_short) {
+  const int w = libfilter_minimal_taffy_cuckoo_path_width(low_level_size, full_is_short);
+  const uint64_t pre_hash_level_index_fp_and_tail =
+      raw >> (64 - w - libfilter_minimal_taffy_cuckoo_tail_size);
+  const uint64_t raw_tail = libfilter_mask(libfilter_minimal_taffy_cuckoo_tail_size,
+                                           pre_hash_level_index_fp_and_tail);
+  const uint64_t pre_hash_level_index_and_fp =
+      pre_hash_level_index_fp_and_tail >> libfilter_minimal_taffy_cuckoo_tail_size;
+  const uint64_t hashed_level_index_and_fp =
+      libfilter_feistel_permute_forward(f, w, pre_hash_level_index_and_fp);
+  return libfilter_minimal_taffy_cuckoo_to_path_hashed(
+      raw_tail, hashed_level_index_and_fp, cursor, low_level_size, full_is_short);
+}
+
 // Uses reverse permuting to get back the high bits of the original hashed value. Elides
 // the tail, since the tail may have a limited length, and once that's appended to a raw
 // value, one can't tell a short tail from one that just has a lot of zeros at the end.
@@ -46,3 +46,27 @@ INLINE bool libfilter_taffy_block_find_hash(const libfilter_taffy_block* here,
   }
   return false;
 }
+
+// Concurrent variants: any number of threads may call
+// libfilter_taffy_block_concurrent_find_hash while one thread calls
+// libfilter_taffy_block_concurrent_add_hash, with no external locking. Readers never
+// block. libfilter_taffy_block_upsize initializes a new level completely before
+// publishing it by storing the cursor with release semantics; readers load the cursor
+// with acquire semantics, so they never see a half-initialized level.
+
+INLINE bool libfilter_taffy_block_concurrent_add_hash(libfilter_taffy_block* here,
+                                                     uint64_t h) {
+  if (here->ttl <= 0) libfilter_taffy_block_upsize(here);
+  libfilter_block_concurrent_add_hash(h, &here->levels[here->cursor - 1]);
+  --here->ttl;
+  return true;
+}
+
+INLINE bool libfilter_taffy_block_concurrent_find_hash(const libfilter_taffy_block* here,
+                                                      uint64_t h) {
+  const int cursor = __atomic_load_n(&here->cursor, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < cursor; ++i) {
+    if (libfilter_block_find_hash(h, &here->levels[i])) return true;
+  }
+  return false;
+}
@@ -7,8 +7,6 @@
 //
 // See "How to Approximate A Set Without Knowing Its Size In Advance", by
 // Rasmus Pagh, Gil Segev, and Udi Wieder
-//
-// TODO: Intersection, iteration, Freeze/Thaw, serialize/deserialize
 
 #pragma once
 
@@ -19,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "filter/static.h"
 #include "filter/util.h"
 
 typedef struct libfilter_taffy_cuckoo_struct libfilter_taffy_cuckoo;
@@ -155,14 +154,44 @@ typedef struct {
   libfilter_feistel f;
   libfilter_taffy_cuckoo_bucket* data;
 
+  // The stash is an open-addressed hash table with linear probing, indexed by the low
+  // bits of the bucket, which are already hashed. Empty entries have tail 0.
+  // stash_capacity is a power of two and at least twice stash_size.
   size_t stash_capacity;
   size_t stash_size;
   libfilter_taffy_cuckoo_path* stash;
+  // One bit per bucket, set if a path in that bucket was ever stashed. Finds only probe
+  // the stash when it is set. NULL until the first path is stashed.
+  uint64_t* overflow;
 } libfilter_taffy_cuckoo_side;
 
 libfilter_taffy_cuckoo_side libfilter_taffy_cuckoo_side_create(int log_side_size,
                                                                const uint64_t* keys);
 
+// Adds p to the stash, growing it if needed, and sets the overflow bit of its bucket
+void libfilter_taffy_cuckoo_stash_add(libfilter_taffy_cuckoo_side* here,
+                                      libfilter_taffy_cuckoo_path p, int log_side_size);
+
+INLINE bool libfilter_overflow_get(const uint64_t* overflow, uint64_t bucket) {
+  return (overflow[bucket / 64] >> (bucket % 64)) & 1;
+}
+
+INLINE bool libfilter_taffy_cuckoo_stash_find(const libfilter_taffy_cuckoo_side* here,
+                                              libfilter_taffy_cuckoo_path p) {
+  if (here->overflow == NULL || !libfilter_overflow_get(here->overflow, p.bucket)) {
+    return false;
+  }
+  const size_t mask = here->stash_capacity - 1;
+  for (size_t i = p.bucket & mask; here->stash[i].slot.tail != 0; i = (i + 1) & mask) {
+    if (p.bucket == here->stash[i].bucket &&
+        p.slot.fingerprint == here->stash[i].slot.fingerprint &&
+        libfilter_taffy_is_prefix_of(here->stash[i].slot.tail, p.slot.tail)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // Returns an empty path (tail = 0) if insert added a new element. Returns p if insert
 // succeded without anning anything new. Returns something else if that something else
 // was displaced by the insert. That item must be inserted then
@@ -201,25 +230,57 @@ INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_side_insert(
   return result;
 }
 
-INLINE bool libfilter_taffy_cuckoo_side_find(const libfilter_taffy_cuckoo_side* here,
-                                             libfilter_taffy_cuckoo_path p) {
-  assert(p.slot.tail != 0);
-  for (unsigned i = 0; i < here->stash_size; ++i) {
-    if (here->stash[i].slot.tail != 0 && p.bucket == here->stash[i].bucket &&
-        p.slot.fingerprint == here->stash[i].slot.fingerprint &&
-        libfilter_taffy_is_prefix_of(here->stash[i].slot.tail, p.slot.tail)) {
-      return true;
-    }
-  }
-  libfilter_taffy_cuckoo_bucket* b = &here->data[p.bucket];
+// Sets the high bit of each 16-bit lane of the result if and only if that lane of x is
+// zero. Unlike libfilter_cuckoo_has_zero_10, there are no false positives.
+INLINE uint64_t libfilter_zero_lanes_16(uint64_t x) {
+  const uint64_t low = 0x7fff7fff7fff7fffULL;
+  return ~(((x & low) + low) | x | low);
+}
+
+// Returns true if some non-empty slot in b has the fingerprint of s and a tail that is a
+// prefix of the tail of s.
+INLINE bool libfilter_taffy_cuckoo_bucket_find(const libfilter_taffy_cuckoo_bucket* b,
+                                               libfilter_taffy_cuckoo_slot s) {
+  assert(s.tail != 0);
+#if libfilter_slots == 4 && libfilter_taffy_cuckoo_head_size == 10 && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // SWAR: each 16-bit lane of w is one slot, with the fingerprint in the low 10 bits and
+  // the tail in the high 6. All four slots are checked at once, using the same logic as
+  // libfilter_taffy_is_prefix_of, but with no branches.
+  const uint64_t lanes = 0x0001000100010001ULL;
+  const uint64_t fingerprints = 0x3ff * lanes, tails = 0xfc00 * lanes;
+  uint64_t w;
+  memcpy(&w, b, sizeof(w));
+  const uint64_t y = s.tail;
+  const uint64_t q = (y << 10 | s.fingerprint) * lanes;
+  const uint64_t d = w ^ q;
+  const uint64_t t = w & tails;
+  // t ^ (t - 1) is the lowest set bit of each tail and everything below it. The guard
+  // bit in the low bit of each lane stops the borrow from an empty tail at the next
+  // lane's fingerprint.
+  const uint64_t up_to_end = ((t | lanes) - 0x400 * lanes) ^ t;
+  // A stored tail is a prefix of the query tail if it is no longer (it has no bits set
+  // below the lowest set bit of the query tail) and the two agree above its end.
+  const uint64_t shorter = (((y & -y) - 1) << 10) * lanes;
+  const uint64_t bad = (d & fingerprints) | (w & shorter) | (d & ~up_to_end & tails);
+  return 0 != (libfilter_zero_lanes_16(bad) & ~libfilter_zero_lanes_16(t));
+#else
   for (int i = 0; i < libfilter_slots; ++i) {
     if (b->data[i].tail == 0) continue;
-    if (b->data[i].fingerprint == p.slot.fingerprint &&
-        libfilter_taffy_is_prefix_of(b->data[i].tail, p.slot.tail)) {
+    if (b->data[i].fingerprint == s.fingerprint &&
+        libfilter_taffy_is_prefix_of(b->data[i].tail, s.tail)) {
       return true;
     }
   }
   return false;
+#endif
+}
+
+INLINE bool libfilter_taffy_cuckoo_side_find(const libfilter_taffy_cuckoo_side* here,
+                                             libfilter_taffy_cuckoo_path p) {
+  assert(p.slot.tail != 0);
+  return libfilter_taffy_cuckoo_bucket_find(&here->data[p.bucket], p.slot) ||
+         libfilter_taffy_cuckoo_stash_find(here, p);
 }
 
 typedef struct {
@@ -233,17 +294,49 @@ typedef struct {
 //                   libfilter_slots * libfilter_taffy_cuckoo_head_size / CHAR_BIT,
 //               "packed");
 
+// How the buckets of a frozen filter are laid out in memory. Packed buckets are
+// sizeof(libfilter_frozen_taffy_cuckoo_bucket) bytes apart, so one in sixteen straddles
+// two cache lines. Aligned lays out twelve buckets, then four bytes of padding, in each
+// 64-byte cache line, so no bucket does, at the cost of 1/15 more space for buckets.
+typedef enum {
+  libfilter_frozen_taffy_cuckoo_packed = 0,
+  libfilter_frozen_taffy_cuckoo_aligned = 1,
+} libfilter_frozen_taffy_cuckoo_layout;
+
 typedef struct libfilter_frozen_taffy_cuckoo_struct {
   libfilter_feistel hash_[2];
   int log_side_size_;
+  libfilter_frozen_taffy_cuckoo_layout layout_;
   libfilter_frozen_taffy_cuckoo_bucket* data_[2];
+  // Each stash is an open-addressed hash table of permuted values (the bucket and the
+  // fingerprint), indexed by the low bits of the bucket. Empty entries are UINT64_MAX.
+  // stash_capacity_ is 0 or a power of two at least twice stash_size_.
   uint64_t* stash_[2];
   size_t stash_capacity_[2];
   size_t stash_size_[2];
+  // As in libfilter_taffy_cuckoo_side. NULL if the stash is empty.
+  uint64_t* overflow_[2];
+  // True if data_ and stash_ point into a caller-owned buffer, as after
+  // libfilter_frozen_taffy_cuckoo_deserialize_adopt. They are not freed on destruct.
+  bool borrowed_;
 } libfilter_frozen_taffy_cuckoo;
 
 size_t libfilter_frozen_taffy_cuckoo_size_in_bytes(const libfilter_frozen_taffy_cuckoo*);
 
+// The offset in bytes of bucket i of a side from the start of its data_.
+INLINE uint64_t libfilter_frozen_taffy_cuckoo_bucket_offset(
+    libfilter_frozen_taffy_cuckoo_layout layout, uint64_t i) {
+  return sizeof(libfilter_frozen_taffy_cuckoo_bucket) * i +
+         ((layout == libfilter_frozen_taffy_cuckoo_aligned) ? 4 * (i / 12) : 0);
+}
+
+INLINE const libfilter_frozen_taffy_cuckoo_bucket* libfilter_frozen_taffy_cuckoo_bucket_at(
+    const libfilter_frozen_taffy_cuckoo* here, int side, uint64_t i) {
+  const uint64_t offset = libfilter_frozen_taffy_cuckoo_bucket_offset(here->layout_, i);
+  return (const libfilter_frozen_taffy_cuckoo_bucket*)((const char*)here->data_[side] +
+                                                       offset);
+}
+
 INLINE uint64_t libfilter_cuckoo_has_zero_10(uint64_t x) {
   return ((x)-0x40100401ULL) & (~(x)) & 0x8020080200ULL;
 }
@@ -251,35 +344,196 @@ INLINE uint64_t libfilter_cuckoo_has_value_10(uint64_t x, uint64_t n) {
   return libfilter_cuckoo_has_zero_10((x) ^ (0x40100401ULL * (n)));
 }
 
+INLINE bool libfilter_frozen_taffy_cuckoo_stash_find(
+    const libfilter_frozen_taffy_cuckoo* here, int side, uint64_t permuted) {
+  const uint64_t bucket = permuted >> libfilter_taffy_cuckoo_head_size;
+  if (here->stash_size_[side] == 0 ||
+      !libfilter_overflow_get(here->overflow_[side], bucket)) {
+    return false;
+  }
+  const size_t mask = here->stash_capacity_[side] - 1;
+  for (size_t j = bucket & mask; here->stash_[side][j] != UINT64_MAX; j = (j + 1) & mask) {
+    if (here->stash_[side][j] == permuted) return true;
+  }
+  return false;
+}
+
 INLINE bool libfilter_frozen_taffy_cuckoo_find_hash(
     const libfilter_frozen_taffy_cuckoo* here, uint64_t x) {
   for (int i = 0; i < 2; ++i) {
     uint64_t y = x >> (64 - here->log_side_size_ - libfilter_taffy_cuckoo_head_size);
     uint64_t permuted = libfilter_feistel_permute_forward(
         &here->hash_[i], here->log_side_size_ + libfilter_taffy_cuckoo_head_size, y);
-    for (size_t j = 0; j < here->stash_size_[i]; ++j) {
-      if (here->stash_[i][j] == permuted) return true;
-    }
-    libfilter_frozen_taffy_cuckoo_bucket* b =
-        &here->data_[i][permuted >> libfilter_taffy_cuckoo_head_size];
+    const libfilter_frozen_taffy_cuckoo_bucket* b = libfilter_frozen_taffy_cuckoo_bucket_at(
+        here, i, permuted >> libfilter_taffy_cuckoo_head_size);
     uint64_t fingerprint = permuted & ((1 << libfilter_taffy_cuckoo_head_size) - 1);
-    if (0 == fingerprint) return true;
-    // TODO: SWAR
     uint64_t z = 0;
     memcpy(&z, b, sizeof(*b));
-    if (libfilter_cuckoo_has_value_10(z, fingerprint)) return true;
+    // Fingerprint 0 marks an empty slot. Entries with fingerprint 0 are in the stash.
+    if (0 != fingerprint && libfilter_cuckoo_has_value_10(z, fingerprint)) return true;
+    if (libfilter_frozen_taffy_cuckoo_stash_find(here, i, permuted)) return true;
   }
   return false;
 }
 
+// Sets results[i] to libfilter_frozen_taffy_cuckoo_find_hash(here, hashes[i]) for each i
+// < n. The keys are hashed four at a time and their buckets are prefetched before any of
+// them are read, then the fingerprints of four keys are compared at once with AVX2.
+void libfilter_frozen_taffy_cuckoo_find_hash_batch(
+    const libfilter_frozen_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    bool* results);
+
 void libfilter_frozen_taffy_cuckoo_destruct(libfilter_frozen_taffy_cuckoo* here);
 
+// The number of bytes needed by libfilter_frozen_taffy_cuckoo_serialize.
+uint64_t libfilter_frozen_taffy_cuckoo_serialized_size(
+    const libfilter_frozen_taffy_cuckoo* here);
+void libfilter_frozen_taffy_cuckoo_serialize(const libfilter_frozen_taffy_cuckoo* here,
+                                             char* to);
+// Returns < 0 if from is not a serialized frozen filter of this version.
+int libfilter_frozen_taffy_cuckoo_deserialize(uint64_t size_in_bytes, const char* from,
+                                              libfilter_frozen_taffy_cuckoo* to);
+// Like libfilter_frozen_taffy_cuckoo_deserialize, but does not copy the buckets or the
+// stashes: "to" points into "from", which must outlive it. "from" must be 8-byte aligned.
+// Not available on big-endian platforms.
+int libfilter_frozen_taffy_cuckoo_deserialize_adopt(uint64_t size_in_bytes,
+                                                    const char* from,
+                                                    libfilter_frozen_taffy_cuckoo* to);
+
+// Counters of the work done by inserts, finds and upsizes, for tuning. They are only
+// kept if LIBFILTER_TAFFY_CUCKOO_STATS is defined when compiling both the library and the
+// code that calls it, since inserts and finds are inlined. Otherwise they stay zero and
+// cost nothing. The counters are updated with relaxed atomics, so finds on a filter
+// shared between threads may count, but each counter is then a contended cache line.
+#if defined(libfilter_taffy_cuckoo_chain_buckets)
+#error "libfilter_taffy_cuckoo_chain_buckets"
+#endif
+
+#define libfilter_taffy_cuckoo_chain_buckets 8
+
+typedef struct {
+  // The entries displaced from their slots by inserts, including the inserts done by
+  // upsizes to move the entries into the larger filter
+  uint64_t kicks;
+  // kick_chains[0] counts the inserts that displaced nothing, and kick_chains[i], for
+  // i > 0, those that displaced between 2^(i-1) and 2^i - 1 entries in a row. The last
+  // one also counts all longer chains.
+  uint64_t kick_chains[libfilter_taffy_cuckoo_chain_buckets];
+  // The paths that inserts ran out of evictions for and put in a stash
+  uint64_t stash_inserts;
+  // Finds that matched an entry in a stash, and finds that matched one in a bucket
+  uint64_t stash_hits, bucket_hits;
+  uint64_t upsizes, upsize_nanos;
+  // The entries moved to a larger filter, or from one side or level to another, that
+  // gave up a tail bit for their fingerprint and bucket, and those that had no tail bits
+  // left and became two entries
+  uint64_t tail_shortenings, tail_splits;
+  // Minimal filters only. An entry split in two waits in a fixed-size stack until the
+  // insert that split it settles. pending_depths counts the inserts (or batches of
+  // inserts) by the most entries they had waiting at once, bucketed like kick_chains.
+  // pending_overflows counts the split entries stashed because the stack was full.
+  uint64_t pending_depths[libfilter_taffy_cuckoo_chain_buckets];
+  uint64_t pending_overflows;
+} libfilter_taffy_cuckoo_stats;
+
+#if defined(LIBFILTER_TAFFY_CUCKOO_STATS)
+
+#include <time.h>
+
+// Adds n to the field of *stats. stats may point to const, as in finds.
+#define libfilter_taffy_cuckoo_stats_add(stats, field, n)                      \
+  ((void)__atomic_fetch_add(&((libfilter_taffy_cuckoo_stats*)(stats))->field, \
+                            (uint64_t)(n), __ATOMIC_RELAXED))
+
+INLINE uint64_t libfilter_taffy_cuckoo_stats_nanos(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * UINT64_C(1000000000) + t.tv_nsec;
+}
+
+#else
+
+#define libfilter_taffy_cuckoo_stats_add(stats, field, n) ((void)(stats), (void)(n))
+
+INLINE uint64_t libfilter_taffy_cuckoo_stats_nanos(void) { return 0; }
+
+#endif
+
+// The histogram bucket of n in kick_chains or pending_depths
+INLINE int libfilter_taffy_cuckoo_stats_bucket(uint64_t n) {
+  int i = (n == 0) ? 0 : 64 - __builtin_clzll(n);
+  if (i >= libfilter_taffy_cuckoo_chain_buckets) {
+    i = libfilter_taffy_cuckoo_chain_buckets - 1;
+  }
+  return i;
+}
+
+// Counts an insert that displaced "kicks" entries in a row
+INLINE void libfilter_taffy_cuckoo_stats_chain(libfilter_taffy_cuckoo_stats* stats,
+                                               uint64_t kicks) {
+  libfilter_taffy_cuckoo_stats_add(stats, kicks, kicks);
+  libfilter_taffy_cuckoo_stats_add(
+      stats, kick_chains[libfilter_taffy_cuckoo_stats_bucket(kicks)], 1);
+}
+
+// Counts an insert that had at most "depth" split entries waiting at once
+INLINE void libfilter_taffy_cuckoo_stats_pending(libfilter_taffy_cuckoo_stats* stats,
+                                                 uint64_t depth) {
+  const int i = libfilter_taffy_cuckoo_stats_bucket(depth);
+  (void)i;
+  libfilter_taffy_cuckoo_stats_add(stats, pending_depths[i], 1);
+}
+
+// When inserts grow a filter, by how much, and how hard they try to place an entry
+// before stashing it. Fuller filters take less space per entry but make inserts kick
+// more entries and stash more often.
+typedef struct {
+  // Inserts upsize the filter first if more than this fraction of its slots is occupied.
+  // Clamped to [0.01, 1] when set. Loads above about 0.92 are only reached with a
+  // max_stash larger than the default, as the stashes otherwise fill up first and force an
+  // upsize.
+  double max_load;
+  // The most entries an insert evicts in a row before it stashes the last one
+  int ttl;
+  // Inserts upsize the filter first if both stashes together hold more entries than this
+  size_t max_stash;
+  // The number of upsizes an insert does at once when the filter needs to grow. A taffy
+  // cuckoo filter doubles in size with each one, while a minimal taffy cuckoo filter
+  // doubles one of its levels.
+  int growth_steps;
+} libfilter_taffy_cuckoo_policy;
+
+// A load of 0.90, 32 evictions, 8 stashed entries, and 1 step
+libfilter_taffy_cuckoo_policy libfilter_taffy_cuckoo_default_policy(void);
+
 typedef struct libfilter_taffy_cuckoo_struct {
   libfilter_taffy_cuckoo_side sides[2];
   int log_side_size;
   libfilter_pcg_random rng;
-  const uint64_t* entropy;
+  uint64_t entropy[8];
   uint64_t occupied;
+  // True if sides[i].data points into a caller-owned buffer, as after
+  // libfilter_taffy_cuckoo_deserialize_adopt. It is not freed on destruct or upsize.
+  bool borrowed;
+  // If migrate_per_insert is not zero, upsizes are incremental: the old table is kept in
+  // migrating_from and each insert or remove moves migrate_per_insert of its buckets
+  // (counting both sides) into this one, starting at migrate_cursor. Finds check both.
+  uint64_t migrate_per_insert;
+  struct libfilter_taffy_cuckoo_struct* migrating_from;
+  uint64_t migrate_cursor;
+  // The number of threads used by upsizes that are not incremental. 0 and 1 both mean
+  // only the calling thread.
+  int upsize_threads;
+  // If true, inserts search breadth-first for the shortest chain of evictions before
+  // moving anything, rather than doing a random walk.
+  bool bfs_insert;
+  // If true, upsizes that are not incremental grow the buckets of each side in place,
+  // rather than building a new filter. See libfilter_taffy_cuckoo_set_in_place_upsize.
+  bool in_place_upsize;
+  libfilter_taffy_cuckoo_policy policy;
+  // Present whether or not LIBFILTER_TAFFY_CUCKOO_STATS is defined, so the layout doesn't
+  // depend on it. Carried over by upsizes and clones, but not by serialization.
+  libfilter_taffy_cuckoo_stats stats;
 } libfilter_taffy_cuckoo;
 
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y);
@@ -291,25 +545,107 @@ libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
     const libfilter_taffy_cuckoo* here);
 void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo* here,
                                         libfilter_frozen_taffy_cuckoo* result);
+// libfilter_taffy_cuckoo_freeze, but with the given bucket layout rather than packed. The
+// layout only changes how the buckets are laid out in memory; the serialized form is the
+// same, and always deserializes as packed.
+libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze_layout(
+    const libfilter_taffy_cuckoo* here, libfilter_frozen_taffy_cuckoo_layout layout);
+void libfilter_taffy_cuckoo_freeze_layout_init(const libfilter_taffy_cuckoo* here,
+                                               libfilter_frozen_taffy_cuckoo_layout layout,
+                                               libfilter_frozen_taffy_cuckoo* result);
+
+// The reverse of libfilter_taffy_cuckoo_freeze. Freezing drops the tails, so each entry
+// of the result has an empty tail and matches any key with its bucket and fingerprint,
+// just as in the frozen filter: the result has no false negatives and no more false
+// positives than the frozen filter does, until more keys are added.
+//
+// Upsizes split entries with empty tails in two, so the thawed entries stay the same
+// fraction of the filter as it grows. Thawing is best for adding a modest number of keys.
+// Adding many keys to a thawed filter that was nearly full takes much more space than
+// building a new filter would. If the frozen filter was over capacity, which can only
+// happen by inserting without evictions, the thawed entries never fit after an upsize,
+// so no keys should be added to the result.
+libfilter_taffy_cuckoo libfilter_frozen_taffy_cuckoo_thaw(
+    const libfilter_frozen_taffy_cuckoo* here);
+void libfilter_frozen_taffy_cuckoo_thaw_init(const libfilter_frozen_taffy_cuckoo* here,
+                                             libfilter_taffy_cuckoo* result);
 
 uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here);
 
-INLINE bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here,
-                                             uint64_t k) {
+// Serialization. The format is little-endian and versioned: it starts with a magic
+// number and a version, followed by log_side_size, occupied, the entropy keys, the rng
+// state, both stashes, and finally both sides' buckets, 2 bytes per slot.
+//
+// The number of bytes needed by libfilter_taffy_cuckoo_serialize.
+uint64_t libfilter_taffy_cuckoo_serialized_size(const libfilter_taffy_cuckoo* here);
+void libfilter_taffy_cuckoo_serialize(const libfilter_taffy_cuckoo* here, char* to);
+// Returns < 0 if from is not a serialized filter of this version.
+int libfilter_taffy_cuckoo_deserialize(uint64_t size_in_bytes, const char* from,
+                                       libfilter_taffy_cuckoo* to);
+// Like libfilter_taffy_cuckoo_deserialize, but the buckets are not copied: "to" reads
+// and writes them in place in "from", which must outlive it. After the first upsize,
+// "to" no longer refers to "from". "from" must be 8-byte aligned. Not available on
+// big-endian platforms.
+int libfilter_taffy_cuckoo_deserialize_adopt(uint64_t size_in_bytes, char* from,
+                                             libfilter_taffy_cuckoo* to);
+
+// Counts a find that matched p on side, in a bucket or in the stash
+INLINE void libfilter_taffy_cuckoo_stats_hit(const libfilter_taffy_cuckoo_stats* stats,
+                                             const libfilter_taffy_cuckoo_side* side,
+                                             libfilter_taffy_cuckoo_path p) {
+#if defined(LIBFILTER_TAFFY_CUCKOO_STATS)
+  if (libfilter_taffy_cuckoo_bucket_find(&side->data[p.bucket], p.slot)) {
+    libfilter_taffy_cuckoo_stats_add(stats, bucket_hits, 1);
+  } else {
+    libfilter_taffy_cuckoo_stats_add(stats, stash_hits, 1);
+  }
+#else
+  (void)stats, (void)side, (void)p;
+#endif
+}
+
+// Checks only the sides of here, not migrating_from. Hits are counted in stats.
+INLINE bool libfilter_taffy_cuckoo_find_hash_sides_stats(
+    const libfilter_taffy_cuckoo* here, uint64_t k,
+    const libfilter_taffy_cuckoo_stats* stats) {
 #if defined(__clang) || defined(__clang__)
 #pragma unroll
 #else
 #pragma GCC unroll 2
 #endif
   for (int s = 0; s < 2; ++s) {
-    if (libfilter_taffy_cuckoo_side_find(
-            &here->sides[s],
-            libfilter_taffy_cuckoo_to_path(k, &here->sides[s].f, here->log_side_size)))
+    libfilter_taffy_cuckoo_path p =
+        libfilter_taffy_cuckoo_to_path(k, &here->sides[s].f, here->log_side_size);
+    if (libfilter_taffy_cuckoo_side_find(&here->sides[s], p)) {
+      libfilter_taffy_cuckoo_stats_hit(stats, &here->sides[s], p);
       return true;
+    }
   }
   return false;
 }
 
+// Checks only the sides of here, not migrating_from
+INLINE bool libfilter_taffy_cuckoo_find_hash_sides(const libfilter_taffy_cuckoo* here,
+                                                   uint64_t k) {
+  return libfilter_taffy_cuckoo_find_hash_sides_stats(here, k, &here->stats);
+}
+
+INLINE bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here,
+                                             uint64_t k) {
+  if (libfilter_taffy_cuckoo_find_hash_sides(here, k)) return true;
+  // Mid-upsize, the buckets that haven't been migrated yet are in the smaller table
+  return here->migrating_from != NULL &&
+         libfilter_taffy_cuckoo_find_hash_sides_stats(here->migrating_from, k,
+                                                      &here->stats);
+}
+
+// Sets results[i] to libfilter_taffy_cuckoo_find_hash(here, hashes[i]) for each i < n.
+// This is faster than calling find_hash n times: the hashing of several keys is done at
+// once and the buckets are prefetched before any of them are read.
+void libfilter_taffy_cuckoo_find_hash_batch(const libfilter_taffy_cuckoo* here,
+                                            const uint64_t* hashes, size_t n,
+                                            bool* results);
+
 INLINE uint64_t libfilter_taffy_cuckoo_capacity(const libfilter_taffy_cuckoo* here) {
   return 2 * libfilter_slots * (1ul << here->log_side_size);
 }
@@ -324,6 +660,7 @@ INLINE bool libfilter_taffy_cuckoo_insert_side_path_ttl(libfilter_taffy_cuckoo*
   // if (sides[0].stash.tail != 0 && sides[1].stash.tail != 0) return
   // InsertResult::Failed;
   libfilter_taffy_cuckoo_side* both[2] = {&here->sides[s], &here->sides[1 - s]};
+  uint64_t kicks = 0;
   while (true) {
 #if defined(__clang) || defined(__clang__)
 #pragma unroll
@@ -336,30 +673,23 @@ INLINE bool libfilter_taffy_cuckoo_insert_side_path_ttl(libfilter_taffy_cuckoo*
       if (p.slot.tail == 0) {
         // Found an empty slot
         ++here->occupied;
+        libfilter_taffy_cuckoo_stats_chain(&here->stats, kicks);
         return true;
       }
       if (libfilter_taffy_cuckoo_path_equal(p, q)) {
         // Combined with or already present in a slot. Success, but no increase in
         // filter size
+        libfilter_taffy_cuckoo_stats_chain(&here->stats, kicks);
         return true;
       }
+      ++kicks;
       uint64_t tail = p.slot.tail;
       if (ttl <= 0) {
-        // we've run out of room. If there's room in this stash, stash it here. If there
-        // is not room in this stash, there must be room in the other, based on the
-        // pre-condition for this method.
-        if (both[i]->stash_size == both[i]->stash_capacity) {
-          both[i]->stash_capacity *= 2;
-          // std::cerr << both[i]->stash_capacity << std::endl;
-          libfilter_taffy_cuckoo_path* new_stash = (libfilter_taffy_cuckoo_path*)calloc(
-              both[i]->stash_capacity, sizeof(libfilter_taffy_cuckoo_path));
-          memcpy(new_stash, both[i]->stash,
-                 both[i]->stash_size * sizeof(libfilter_taffy_cuckoo_path));
-          free(both[i]->stash);
-          both[i]->stash = new_stash;
-        }
-        both[i]->stash[both[i]->stash_size++] = p;
+        // we've run out of room, so stash it here
+        libfilter_taffy_cuckoo_stash_add(both[i], p, here->log_side_size);
         ++here->occupied;
+        libfilter_taffy_cuckoo_stats_chain(&here->stats, kicks);
+        libfilter_taffy_cuckoo_stats_add(&here->stats, stash_inserts, 1);
         return false;
       }
       --ttl;
@@ -374,30 +704,273 @@ INLINE bool libfilter_taffy_cuckoo_insert_side_path_ttl(libfilter_taffy_cuckoo*
   }
 }
 
+// Like libfilter_taffy_cuckoo_insert_side_path_ttl, but looks for the shortest path of
+// evictions that ends in an empty slot, and only then moves the slots along it. This
+// reads fewer buckets than a random walk at high load and stashes less often. If there
+// is no such path within a few evictions, falls back to the random walk.
+bool libfilter_taffy_cuckoo_insert_side_path_bfs(libfilter_taffy_cuckoo* here, int s,
+                                                 libfilter_taffy_cuckoo_path p);
+
 // This method just increases ttl until insert succeeds.
 // TODO: upsize when insert fails with high enough ttl?
 INLINE bool libfilter_taffy_cuckoo_insert_side_path(libfilter_taffy_cuckoo* here, int s,
                                              libfilter_taffy_cuckoo_path q) {
-  int ttl = 32;
-  return libfilter_taffy_cuckoo_insert_side_path_ttl(here, s, q, ttl);
+  if (here->bfs_insert) return libfilter_taffy_cuckoo_insert_side_path_bfs(here, s, q);
+  return libfilter_taffy_cuckoo_insert_side_path_ttl(here, s, q, here->policy.ttl);
 }
 
 void libfilter_taffy_cuckoo_destruct(libfilter_taffy_cuckoo* t);
 
-// Double the size of the filter
+// Double the size of the filter. In incremental mode, this only starts the upsize.
 void libfilter_taffy_cuckoo_upsize(libfilter_taffy_cuckoo* here);
 
+// Sets the number of buckets moved to the larger table per insert during an upsize. 0,
+// the default, moves them all at once. Any other value bounds the work done in a single
+// insert, at the cost of finds checking two tables until the upsize is done. Not
+// preserved by serialization.
+void libfilter_taffy_cuckoo_set_incremental_upsize(libfilter_taffy_cuckoo* here,
+                                                   uint64_t buckets_per_insert);
+
+// Moves up to n buckets into the larger table, if an incremental upsize is in progress
+void libfilter_taffy_cuckoo_migrate(libfilter_taffy_cuckoo* here, uint64_t n);
+
+// Completes any incremental upsize in progress
+void libfilter_taffy_cuckoo_finish_upsize(libfilter_taffy_cuckoo* here);
+
+// Like libfilter_taffy_cuckoo_upsize without incremental mode, but splits the work over
+// up to "threads" threads.
+void libfilter_taffy_cuckoo_upsize_parallel(libfilter_taffy_cuckoo* here, int threads);
+
+// Sets the number of threads used by the upsizes that inserts cause
+void libfilter_taffy_cuckoo_set_upsize_threads(libfilter_taffy_cuckoo* here, int threads);
+
+// Switches between random-walk inserts (the default) and breadth-first search inserts.
+// Not preserved by serialization.
+void libfilter_taffy_cuckoo_set_bfs_insert(libfilter_taffy_cuckoo* here, bool bfs);
+
+// Switches between upsizes that build a new filter of twice the size and then free the
+// old one (the default), and upsizes that grow the buckets of each side in place with
+// realloc and move the entries within them. At its peak, a default upsize needs 3 times
+// the memory of the old filter, while an in-place upsize needs a little over twice as
+// much: large blocks are grown with mremap, so the old buckets are not copied.
+// In-place upsizes use only one thread. They are not used in incremental mode, which
+// needs both tables, or while the buckets are borrowed. If the larger buckets can't be
+// allocated, the filter is left as it was, and the insert that needed the upsize returns
+// false. Not preserved by serialization.
+void libfilter_taffy_cuckoo_set_in_place_upsize(libfilter_taffy_cuckoo* here,
+                                                bool in_place);
+
+// Sets when and how the filter grows. Best set right after the filter is created: a
+// lower max_load than the current load makes the next insert upsize at once. Carried
+// over by clones, unions and intersections, but not preserved by serialization.
+void libfilter_taffy_cuckoo_set_policy(libfilter_taffy_cuckoo* here,
+                                       libfilter_taffy_cuckoo_policy policy);
+
 INLINE bool libfilter_taffy_cuckoo_add_hash(libfilter_taffy_cuckoo* here, uint64_t k) {
-  // 95% is achievable, generally,but give it some room
-  while (here->occupied > 0.90 * libfilter_taffy_cuckoo_capacity(here) ||
+  if (here->migrating_from != NULL) {
+    libfilter_taffy_cuckoo_migrate(here, here->migrate_per_insert);
+  }
+  // 95% is achievable, generally, so the default max_load of 90% gives it some room
+  while (here->occupied > here->policy.max_load * libfilter_taffy_cuckoo_capacity(here) ||
          here->occupied + 4 >= libfilter_taffy_cuckoo_capacity(here) ||
-         here->sides[0].stash_size + here->sides[1].stash_size > 8) {
-    libfilter_taffy_cuckoo_upsize(here);
+         here->sides[0].stash_size + here->sides[1].stash_size > here->policy.max_stash) {
+    const int log_side_size = here->log_side_size;
+    for (int i = 0; i < here->policy.growth_steps; ++i) {
+      libfilter_taffy_cuckoo_upsize(here);
+    }
+    // An in-place upsize leaves the filter as it was if memory runs out
+    if (here->log_side_size == log_side_size) return false;
   }
   libfilter_taffy_cuckoo_insert_side_path(
       here, 0, libfilter_taffy_cuckoo_to_path(k, &here->sides[0].f, here->log_side_size));
   return true;
 }
 
+// Removes the entry for k, returning false if there is none. If the filter is then less
+// than a quarter full, it is downsized.
+//
+// As in other cuckoo filters, k must have been added: removing a key that wasn't can
+// remove some other key. Also, entries are not duplicated: a key that was already a false
+// positive when it was added shares the entry that matched it, and removing either key
+// removes both. So removes cause false negatives, at about the rate of false positives.
+// Of several matching entries, the one with the longest tail is removed: any key it
+// matches also matches the others.
+//
+// Upsizes shorten tails. When a tail runs out, the entry becomes two in the larger
+// filter, one for each value of the next bit of the hash, and removing k only removes the
+// one that k maps to. The other stays as a false positive.
+bool libfilter_taffy_cuckoo_remove_hash(libfilter_taffy_cuckoo* here, uint64_t k);
+
+// Halves the size of the filter, the reverse of an upsize: the last bit of each bucket
+// index moves back into the tail. A tail with no room for it loses its own last bit, so
+// the fpp can rise, but there are no false negatives. Does nothing if the filter is
+// already as small as possible.
+void libfilter_taffy_cuckoo_downsize(libfilter_taffy_cuckoo* here);
+
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo* x,
                                                     const libfilter_taffy_cuckoo* y);
+// Like libfilter_taffy_cuckoo_union, but splits the work over up to "threads" threads
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_parallel(
+    const libfilter_taffy_cuckoo* x, const libfilter_taffy_cuckoo* y, int threads);
+
+// The union of the n filters. Unlike a chain of calls to libfilter_taffy_cuckoo_union,
+// which clones and upsizes the growing union at each step, this creates the result once,
+// at the size that holds all of the inputs' entries, and then moves each input's entries
+// straight into it. If n is 0, the result is empty.
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_many(
+    const libfilter_taffy_cuckoo* const* filters, size_t n);
+// Like libfilter_taffy_cuckoo_union_many, but splits the work over up to "threads"
+// threads
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_many_parallel(
+    const libfilter_taffy_cuckoo* const* filters, size_t n, int threads);
+// libfilter_taffy_cuckoo_union_many, then libfilter_taffy_cuckoo_freeze_layout. The
+// unfrozen union is freed before this returns.
+libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_union_many_freeze(
+    const libfilter_taffy_cuckoo* const* filters, size_t n,
+    libfilter_frozen_taffy_cuckoo_layout layout);
+
+// A filter that matches every key that both x and y match. The entries of the filter
+// with fewer buckets are translated to the size of the other, as in a union, and each is
+// compared against the entries in its buckets in the other filter: when one entry's tail
+// is a prefix of the other's, the keys both match are those that the longer tail matches,
+// so that entry is kept. This reads each filter once, in bucket order for the smaller,
+// and needs neither the keys nor a table of both filters' entries. The result is
+// downsized while it is less than a quarter full.
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_intersect(const libfilter_taffy_cuckoo* x,
+                                                        const libfilter_taffy_cuckoo* y);
+
+// An entry of a taffy filter, as the hash values it matches: those whose high "bits" bits
+// are the high bits of hash. The rest of the bits of hash are zero. bits is
+// log_side_size + libfilter_taffy_cuckoo_head_size, plus the length of the entry's tail,
+// for the table the entry is in.
+typedef struct {
+  uint64_t hash;
+  int bits;
+} libfilter_taffy_cuckoo_entry;
+
+// Walks the entries of a filter, or of one of a number of chunks of it, without the
+// keys. Each chunk is a range of buckets, on both sides and in the table being migrated
+// from, if any, along with the stashed entries in those buckets. The entries of each side
+// come out in bucket order, then its stashed entries. Chunks of the same filter can be
+// walked at once by different threads, as long as the filter isn't changed.
+typedef struct {
+  // The table being walked: here->migrating_from, then here
+  const libfilter_taffy_cuckoo* table;
+  const libfilter_taffy_cuckoo* here;
+  int chunk, chunks;
+  int side;
+  // The buckets of this chunk of the table are [begin, end). The next slot to read is
+  // slot number "slot" of bucket "bucket", or, once bucket is end, stash[stash_index].
+  uint64_t begin, end, bucket;
+  int slot;
+  size_t stash_index;
+} libfilter_taffy_cuckoo_cursor;
+
+// A cursor for chunk number "chunk" of "chunks" of here. Each entry of here is in exactly
+// one chunk. here must outlive the cursor and not change while it is in use.
+libfilter_taffy_cuckoo_cursor libfilter_taffy_cuckoo_cursor_create(
+    const libfilter_taffy_cuckoo* here, int chunk, int chunks);
+// Writes up to n of the next entries to out and returns how many it wrote. Returns less
+// than n only once the chunk is done.
+size_t libfilter_taffy_cuckoo_cursor_next(libfilter_taffy_cuckoo_cursor* cursor,
+                                          libfilter_taffy_cuckoo_entry* out, size_t n);
+
+// A static filter with the entries of a taffy filter, made by
+// libfilter_taffy_cuckoo_to_static. Keys are looked up by their high prefix_bits bits:
+// each entry is cut down, or copied and extended, to prefix_bits bits, and the static
+// filter holds a hash of each distinct prefix. There are no empty slots, so this is
+// smaller than a frozen filter, but it can't be thawed.
+typedef struct {
+  libfilter_static table;
+  int prefix_bits;
+  // The number of distinct prefixes
+  uint64_t prefixes;
+  // The chance that a key that was never added is found: the fraction of all prefixes
+  // that are in the filter, plus 1/256 for the rest, from the static filter's 8-bit
+  // fingerprints
+  double fpp;
+} libfilter_static_taffy_cuckoo;
+
+// Chooses prefix_bits to make the product of the size and the fpp the smallest. Entries
+// with tails shorter than that are copied once for each prefix they match.
+libfilter_static_taffy_cuckoo libfilter_taffy_cuckoo_to_static(
+    const libfilter_taffy_cuckoo* here);
+void libfilter_static_taffy_cuckoo_destruct(libfilter_static_taffy_cuckoo* here);
+size_t libfilter_static_taffy_cuckoo_size_in_bytes(
+    const libfilter_static_taffy_cuckoo* here);
+
+// Mixes the bits of a prefix, which are all in the low bits, across the whole word for
+// the static filter. This is the finalizer from MurmurHash3, which is a bijection, so
+// distinct prefixes stay distinct.
+static inline uint64_t libfilter_static_taffy_cuckoo_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdul;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ul;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline bool libfilter_static_taffy_cuckoo_find_hash(
+    const libfilter_static_taffy_cuckoo* here, uint64_t k) {
+  // The static filter can't be built with no hashes
+  return here->prefixes > 0 &&
+         libfilter_static_find_hash(
+             here->table, libfilter_static_taffy_cuckoo_mix(k >> (64 - here->prefix_bits)));
+}
+
+// A taffy cuckoo filter that many threads can insert into and look up in at once, with
+// no external locking. The buckets are covered by striped spinlocks, each with a version
+// counter. An insert locks only the stripes of the buckets it changes, so inserts into
+// different parts of the table proceed in parallel. Finds take no locks: as in a seqlock,
+// they read the versions of the stripes of both buckets of a key, then the buckets, and
+// retry if either version changed in the meantime. The stash of a table is never grown
+// once the table is in use, so its entries never move, and finds read them without
+// locks too; an insert that would need to grow it upsizes instead.
+//
+// An upsize takes every stripe lock, so inserts wait for it, but finds do not: they keep
+// reading the old table, which is only freed when the filter is destructed. The old
+// tables take up less space, in total, than the current one.
+typedef struct {
+  uint32_t lock;
+  // Odd while a bucket covered by this stripe is being changed
+  uint32_t version;
+  // The number of entries in the buckets covered by this stripe, on both sides
+  uint64_t occupied;
+  char padding[48];  // so that no two stripes share a cache line
+} libfilter_taffy_cuckoo_stripe;
+
+// The most stripes there can be. Tables with fewer buckets per side than this use only
+// as many stripes as there are buckets per side.
+#if defined(libfilter_taffy_cuckoo_stripes)
+#error "libfilter_taffy_cuckoo_stripes"
+#endif
+
+#define libfilter_taffy_cuckoo_stripes 1024
+
+typedef struct {
+  // The current table. Replaced, but not freed, by upsizes.
+  libfilter_taffy_cuckoo* table;
+  libfilter_taffy_cuckoo_stripe* stripes;
+  // Serializes inserts into the stashes of the current table. Finds don't take it.
+  uint32_t stash_lock;
+  // The tables replaced by upsizes, which finds might still be reading
+  libfilter_taffy_cuckoo** retired;
+  int retired_size;
+} libfilter_concurrent_taffy_cuckoo;
+
+void libfilter_concurrent_taffy_cuckoo_init(uint64_t bytes,
+                                            libfilter_concurrent_taffy_cuckoo* here);
+// Not thread-safe: no other thread may be using here
+void libfilter_concurrent_taffy_cuckoo_destruct(libfilter_concurrent_taffy_cuckoo* here);
+bool libfilter_concurrent_taffy_cuckoo_add_hash(libfilter_concurrent_taffy_cuckoo* here,
+                                                uint64_t k);
+bool libfilter_concurrent_taffy_cuckoo_find_hash(
+    const libfilter_concurrent_taffy_cuckoo* here, uint64_t k);
+// Includes the tables kept for finds that started before an upsize
+uint64_t libfilter_concurrent_taffy_cuckoo_size_in_bytes(
+    const libfilter_concurrent_taffy_cuckoo* here);
+// Sets the number of threads used by upsizes. Not thread-safe: no other thread may be
+// using here
+void libfilter_concurrent_taffy_cuckoo_set_upsize_threads(
+    libfilter_concurrent_taffy_cuckoo* here, int threads);
@@ -43,3 +43,25 @@ libfilter_clear_region(libfilter_region* here);
 // available
 uint64_t __attribute__((visibility("hidden")))
 libfilter_new_alloc_request(uint64_t exact_bytes, uint64_t alignment);
+
+#define LIBFILTER_CACHE_LINE ((uint64_t)64)
+
+// Allocates "bytes" zeroed bytes, aligned to a cache line. Allocations of at least a huge
+// page are rounded up to a whole number of them and mapped with huge pages, aligned to
+// the huge page size, so that random probes into large tables miss in the TLB less
+// often. The result must be freed with libfilter_huge_free, with the same "bytes".
+__attribute__((visibility("hidden"))) void* libfilter_huge_calloc(uint64_t bytes);
+
+void __attribute__((visibility("hidden"))) libfilter_huge_free(void* p, uint64_t bytes);
+
+// Resizes a block from libfilter_huge_calloc, like realloc. p may be NULL. The bytes past
+// old_bytes are not necessarily zero. Large blocks are moved by remapping their pages
+// where possible, rather than by copying.
+__attribute__((visibility("hidden"))) void*
+libfilter_huge_realloc(void* p, uint64_t old_bytes, uint64_t new_bytes);
+
+// Grows both p[0] and p[1], blocks of old_bytes from libfilter_huge_calloc, to new_bytes,
+// as libfilter_huge_realloc would. If memory runs out, neither is grown and false is
+// returned; p[0] might still have moved, but holds the same bytes.
+__attribute__((visibility("hidden"))) bool
+libfilter_huge_grow_both(void* p[2], uint64_t old_bytes, uint64_t new_bytes);
@@ -1,7 +1,11 @@
+// for mremap
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "filter/memory.h"
 #include "memory-internal.h"
@@ -110,13 +114,32 @@ libfilter_do_mmap_alloc(uint64_t exact_bytes) {
   libfilter_region_alloc_result result = {
       .region = {.block = NULL}, .block_bytes = 0, .zero_filled = MMAP_ZERO_FILLED};
   // printf("mmap 0x%016zx\n", exact_bytes);
+  result.block_bytes = exact_bytes;
   result.region.block = mmap(NULL, exact_bytes, PROT_READ | PROT_WRITE,
                              MAP_PRIVATE | MAP_HUGETLB | MAP_ANONYMOUS, -1, 0);
   if (MAP_FAILED == result.region.block) {
-    result.region.block = NULL;
-    result.block_bytes = 0;
+    // No huge pages are reserved, so ask for transparent huge pages instead. Those are
+    // only used for the parts of a mapping that are aligned to HUGE_PAGE_SIZE, so map an
+    // extra huge page and unmap the unaligned ends.
+    char* const mapped = mmap(NULL, exact_bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mapped) {
+      result.region.block = NULL;
+      result.region.to_free = NULL;
+      result.block_bytes = 0;
+      return result;
+    }
+    char* const aligned =
+        (char*)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > mapped) munmap(mapped, aligned - mapped);
+    if (aligned < mapped + HUGE_PAGE_SIZE) {
+      munmap(aligned + exact_bytes, mapped + HUGE_PAGE_SIZE - aligned);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, exact_bytes, MADV_HUGEPAGE);
+#endif
+    result.region.block = (uint32_t*)aligned;
   }
-  result.block_bytes = exact_bytes;
   result.region.to_free = result.region.block;
   return result;
 }
@@ -195,3 +218,124 @@ libfilter_clear_region(libfilter_region* here) {
   here->block = NULL;
   here->to_free = NULL;
 }
+
+// The number of bytes libfilter_huge_calloc actually allocates for a request of "bytes"
+static uint64_t libfilter_huge_round(uint64_t bytes) {
+#ifdef MMAP
+  if (bytes >= HUGE_PAGE_SIZE) {
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - (uint64_t)1);
+  }
+#endif
+  return (bytes + LIBFILTER_CACHE_LINE - 1) & ~(LIBFILTER_CACHE_LINE - (uint64_t)1);
+}
+
+void* libfilter_huge_calloc(uint64_t bytes) {
+  if (bytes == 0) return NULL;
+#ifdef UNALIGNED
+  return calloc(1, bytes);
+#else
+  const uint64_t rounded = libfilter_huge_round(bytes);
+  libfilter_region_alloc_result r = libfilter_alloc_at_most(rounded, LIBFILTER_CACHE_LINE);
+  if (r.block_bytes == 0) return NULL;
+  if (!r.zero_filled) memset(r.region.block, 0, rounded);
+  return r.region.block;
+#endif
+}
+
+void libfilter_huge_free(void* p, uint64_t bytes) {
+  if (p == NULL) return;
+#ifdef UNALIGNED
+  (void)bytes;
+  free(p);
+#else
+  libfilter_region r = {.block = (uint32_t*)p, .to_free = p};
+  libfilter_do_free(r, libfilter_huge_round(bytes), LIBFILTER_CACHE_LINE);
+#endif
+}
+
+void* libfilter_huge_realloc(void* p, uint64_t old_bytes, uint64_t new_bytes) {
+#ifdef UNALIGNED
+  (void)old_bytes;
+  return realloc(p, new_bytes);
+#else
+  const uint64_t old_rounded = libfilter_huge_round(old_bytes),
+                 new_rounded = libfilter_huge_round(new_bytes);
+  if (p != NULL && old_rounded == new_rounded) return p;
+#if defined(MMAP) && defined(__linux__)
+  // Moves the pages rather than copying them, so the old and new blocks are never both
+  // resident
+  if (p != NULL && old_bytes >= HUGE_PAGE_SIZE && new_bytes >= HUGE_PAGE_SIZE) {
+    void* result = mremap(p, old_rounded, new_rounded, MREMAP_MAYMOVE);
+    // If that fails, as it can when p was not mapped by mmap, fall back to copying
+    if (result != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      madvise(result, new_rounded, MADV_HUGEPAGE);
+#endif
+      return result;
+    }
+  }
+#endif
+  void* result = libfilter_huge_calloc(new_bytes);
+  if (result == NULL) return NULL;
+  if (p != NULL) {
+    memcpy(result, p, (old_bytes < new_bytes) ? old_bytes : new_bytes);
+    libfilter_huge_free(p, old_bytes);
+  }
+  return result;
+#endif
+}
+
+bool libfilter_huge_grow_both(void* p[2], uint64_t old_bytes, uint64_t new_bytes) {
+  assert(old_bytes <= new_bytes);
+  void* result[2];
+  // Whether result[i] is p[i] itself, maybe remapped, rather than a copy of it
+  bool kept[2];
+  int i = 0;
+  for (; i < 2; ++i) {
+    kept[i] = false;
+#ifndef UNALIGNED
+    const uint64_t old_rounded = libfilter_huge_round(old_bytes),
+                   new_rounded = libfilter_huge_round(new_bytes);
+    if (old_rounded == new_rounded) {
+      result[i] = p[i];
+      kept[i] = true;
+      continue;
+    }
+#if defined(MMAP) && defined(__linux__)
+    if (old_bytes >= HUGE_PAGE_SIZE) {
+      void* r = mremap(p[i], old_rounded, new_rounded, MREMAP_MAYMOVE);
+      if (r != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+        madvise(r, new_rounded, MADV_HUGEPAGE);
+#endif
+        result[i] = r;
+        kept[i] = true;
+        continue;
+      }
+    }
+#endif
+#endif
+    result[i] = libfilter_huge_calloc(new_bytes);
+    if (result[i] == NULL) break;
+    memcpy(result[i], p[i], old_bytes);
+  }
+  if (i < 2) {
+    // Put the first block back as it was. Shrinking a remapped block never needs memory.
+    if (i == 1 && !kept[0]) libfilter_huge_free(result[0], new_bytes);
+#if !defined(UNALIGNED) && defined(MMAP) && defined(__linux__)
+    const uint64_t old_rounded = libfilter_huge_round(old_bytes),
+                   new_rounded = libfilter_huge_round(new_bytes);
+    // The first block was remapped, whether or not it moved
+    if (i == 1 && kept[0] && old_rounded != new_rounded) {
+      munmap((char*)result[0] + old_rounded, new_rounded - old_rounded);
+      p[0] = result[0];
+    }
+#endif
+    return false;
+  }
+  for (i = 0; i < 2; ++i) {
+    if (!kept[i]) libfilter_huge_free(p[i], old_bytes);
+    p[i] = result[i];
+  }
+  return true;
+}
@@ -1,26 +1,37 @@
 #include "filter/minimal-taffy-cuckoo.h"
 
-void libfilter_minimal_taffy_cuckoo_level_null_out(
-    libfilter_minimal_taffy_cuckoo_level* here) {
-  here->data = NULL;
+#include "memory-internal.h"  // for libfilter_huge_calloc, libfilter_huge_free, ...
+
+// The offset, in buckets, of level "level" from the start of the region of its side.
+// The levels are in order, and the ones before the cursor have already doubled in size.
+// Once the cursor reaches the last level, every level has doubled, and the offsets are
+// those of the next log_side_size with a cursor of 0.
+static uint64_t libfilter_minimal_taffy_cuckoo_level_offset(uint64_t log_side_size,
+                                                            uint64_t cursor,
+                                                            uint64_t level) {
+  return (level + ((level < cursor) ? level : cursor)) << log_side_size;
 }
 
-INLINE libfilter_minimal_taffy_cuckoo_level
-libfilter_minimal_taffy_cuckoo_level_create(int log_level_size) {
-  libfilter_minimal_taffy_cuckoo_level result;
-  result.data = (libfilter_minimal_taffy_cuckoo_bucket*)calloc(
-      1ull << log_level_size, sizeof(libfilter_minimal_taffy_cuckoo_bucket));
-  return result;
+static uint64_t libfilter_minimal_taffy_cuckoo_region_bytes(uint64_t log_side_size,
+                                                            uint64_t cursor) {
+  return sizeof(libfilter_minimal_taffy_cuckoo_bucket) *
+         libfilter_minimal_taffy_cuckoo_level_offset(
+             log_side_size, cursor, libfilter_minimal_taffy_cuckoo_levels);
 }
 
-INLINE void libfilter_minimal_taffy_cuckoo_level_destroy(
-    libfilter_minimal_taffy_cuckoo_level* l) {
-  free(l->data);
+// Points each level at its place in the region, which starts at levels[0].data
+static void libfilter_minimal_taffy_cuckoo_side_point(
+    libfilter_minimal_taffy_cuckoo_side* side, uint64_t log_side_size, uint64_t cursor) {
+  for (uint64_t i = 1; i < libfilter_minimal_taffy_cuckoo_levels; ++i) {
+    side->levels[i].data =
+        side->levels[0].data +
+        libfilter_minimal_taffy_cuckoo_level_offset(log_side_size, cursor, i);
+  }
 }
 
 void libfilter_minimal_taffy_cuckoo_side_null_out(libfilter_minimal_taffy_cuckoo_side * here) {
   for(unsigned i = 0; i < libfilter_minimal_taffy_cuckoo_levels; ++i) {
-    libfilter_minimal_taffy_cuckoo_level_null_out(&here->levels[i]);
+    here->levels[i].data = NULL;
   }
   here->stashes = NULL;
 }
@@ -30,10 +41,10 @@ libfilter_minimal_taffy_cuckoo_side libfilter_minimal_taffy_cuckoo_side_create(
   libfilter_minimal_taffy_cuckoo_side result;
   result.hi = libfilter_feistel_create(&keys[0]);
   result.lo = libfilter_feistel_create(&keys[6]);
-  for (uint64_t i = 0; i < libfilter_minimal_taffy_cuckoo_levels; ++i) {
-    result.levels[i] = libfilter_minimal_taffy_cuckoo_level_create(log_level_size);
-  }
-  result.stashes = (libfilter_minimal_taffy_cuckoo_path*)malloc(
+  result.levels[0].data = (libfilter_minimal_taffy_cuckoo_bucket*)libfilter_huge_calloc(
+      libfilter_minimal_taffy_cuckoo_region_bytes(log_level_size, 0));
+  libfilter_minimal_taffy_cuckoo_side_point(&result, log_level_size, 0);
+  result.stashes = (libfilter_minimal_taffy_cuckoo_path*)libfilter_huge_calloc(
       sizeof(libfilter_minimal_taffy_cuckoo_path) * 4);
   result.stashes_capacity = 4;
   result.stashes_size = 0;
@@ -41,11 +52,37 @@ libfilter_minimal_taffy_cuckoo_side libfilter_minimal_taffy_cuckoo_side_create(
 }
 
 void libfilter_minimal_taffy_cuckoo_side_destroy(
+    libfilter_minimal_taffy_cuckoo_side* side, int log_side_size, uint64_t cursor) {
+  libfilter_huge_free(side->levels[0].data,
+                      libfilter_minimal_taffy_cuckoo_region_bytes(log_side_size, cursor));
+  libfilter_huge_free(
+      side->stashes, side->stashes_capacity * sizeof(libfilter_minimal_taffy_cuckoo_path));
+}
+
+// Doubles level "cursor" of side in place, once its region has grown by one level: moves
+// the levels after it up to make room, and leaves the doubled level empty.
+static void libfilter_minimal_taffy_cuckoo_side_shift(
+    libfilter_minimal_taffy_cuckoo_side* side, uint64_t log_side_size, uint64_t cursor) {
+  const uint64_t level_bytes = sizeof(libfilter_minimal_taffy_cuckoo_bucket)
+                               << log_side_size;
+  const uint64_t old_bytes =
+      libfilter_minimal_taffy_cuckoo_region_bytes(log_side_size, cursor);
+  char* region = (char*)side->levels[0].data;
+  const uint64_t start =
+      sizeof(libfilter_minimal_taffy_cuckoo_bucket) *
+      libfilter_minimal_taffy_cuckoo_level_offset(log_side_size, cursor, cursor);
+  memmove(&region[start + 2 * level_bytes], &region[start + level_bytes],
+          old_bytes - start - level_bytes);
+  memset(&region[start], 0, 2 * level_bytes);
+  libfilter_minimal_taffy_cuckoo_side_point(side, log_side_size, cursor + 1);
+}
+
+void libfilter_minimal_taffy_cuckoo_stash_grow(
     libfilter_minimal_taffy_cuckoo_side* side) {
-  for (unsigned i = 0; i < libfilter_minimal_taffy_cuckoo_levels; ++i) {
-    libfilter_minimal_taffy_cuckoo_level_destroy(&side->levels[i]);
-  }
-  free(side->stashes);
+  side->stashes = (libfilter_minimal_taffy_cuckoo_path*)libfilter_huge_realloc(
+      side->stashes, side->stashes_capacity * sizeof(libfilter_minimal_taffy_cuckoo_path),
+      2 * side->stashes_capacity * sizeof(libfilter_minimal_taffy_cuckoo_path));
+  side->stashes_capacity *= 2;
 }
 
 void libfilter_minimal_taffy_cuckoo_null_out(libfilter_minimal_taffy_cuckoo * here) {
@@ -55,8 +92,10 @@ void libfilter_minimal_taffy_cuckoo_null_out(libfilter_minimal_taffy_cuckoo * he
 }
 
 void libfilter_minimal_taffy_cuckoo_destruct(libfilter_minimal_taffy_cuckoo* here) {
-  libfilter_minimal_taffy_cuckoo_side_destroy(&here->sides[0]);
-  libfilter_minimal_taffy_cuckoo_side_destroy(&here->sides[1]);
+  for (int i = 0; i < 2; ++i) {
+    libfilter_minimal_taffy_cuckoo_side_destroy(&here->sides[i], here->log_side_size,
+                                                here->cursor);
+  }
 }
 
 libfilter_minimal_taffy_cuckoo libfilter_minimal_taffy_cuckoo_create(
@@ -69,9 +108,55 @@ libfilter_minimal_taffy_cuckoo libfilter_minimal_taffy_cuckoo_create(
   result.log_side_size = log_side_size;
   result.rng = libfilter_pcg_random_create(libfilter_log_slots);
   result.occupied = 0;
+  result.policy = libfilter_minimal_taffy_cuckoo_default_policy();
+  memset(&result.stats, 0, sizeof(result.stats));
   return result;
 }
 
+// Each side is one region, so this is one copy per side, plus the stashes
+int libfilter_minimal_taffy_cuckoo_clone(const libfilter_minimal_taffy_cuckoo* that,
+                                         libfilter_minimal_taffy_cuckoo* here) {
+  const uint64_t bytes =
+      libfilter_minimal_taffy_cuckoo_region_bytes(that->log_side_size, that->cursor);
+  for (int i = 0; i < 2; ++i) {
+    here->sides[i].hi = that->sides[i].hi;
+    here->sides[i].lo = that->sides[i].lo;
+    here->sides[i].levels[0].data =
+        (libfilter_minimal_taffy_cuckoo_bucket*)libfilter_huge_calloc(bytes);
+    memcpy(here->sides[i].levels[0].data, that->sides[i].levels[0].data, bytes);
+    libfilter_minimal_taffy_cuckoo_side_point(&here->sides[i], that->log_side_size,
+                                              that->cursor);
+    here->sides[i].stashes = (libfilter_minimal_taffy_cuckoo_path*)libfilter_huge_calloc(
+        that->sides[i].stashes_capacity * sizeof(libfilter_minimal_taffy_cuckoo_path));
+    memcpy(here->sides[i].stashes, that->sides[i].stashes,
+           that->sides[i].stashes_size * sizeof(libfilter_minimal_taffy_cuckoo_path));
+    here->sides[i].stashes_capacity = that->sides[i].stashes_capacity;
+    here->sides[i].stashes_size = that->sides[i].stashes_size;
+  }
+  here->cursor = that->cursor;
+  here->log_side_size = that->log_side_size;
+  here->rng = that->rng;
+  here->occupied = that->occupied;
+  here->policy = that->policy;
+  here->stats = that->stats;
+  return 0;
+}
+
+libfilter_taffy_cuckoo_policy libfilter_minimal_taffy_cuckoo_default_policy(void) {
+  libfilter_taffy_cuckoo_policy result = libfilter_taffy_cuckoo_default_policy();
+  result.ttl = 128;
+  return result;
+}
+
+void libfilter_minimal_taffy_cuckoo_set_policy(libfilter_minimal_taffy_cuckoo* here,
+                                               libfilter_taffy_cuckoo_policy policy) {
+  // As in libfilter_taffy_cuckoo_set_policy
+  if (policy.growth_steps < 1) policy.growth_steps = 1;
+  if (!(policy.max_load >= 0.01)) policy.max_load = 0.01;
+  if (policy.max_load > 1.0) policy.max_load = 1.0;
+  here->policy = policy;
+}
+
 uint64_t libfilter_minimal_taffy_cuckoo_size_in_bytes(
     const libfilter_minimal_taffy_cuckoo* here) {
   return sizeof(libfilter_minimal_taffy_cuckoo_slot) *
@@ -101,29 +186,61 @@ libfilter_minimal_taffy_cuckoo_create_with_bytes(uint64_t bytes) {
       kEntropy);
 }
 
+// Counts the tail bits used by an upsize that moved p to r, and to q if p was split
+static void libfilter_minimal_taffy_cuckoo_stats_tails(
+    libfilter_minimal_taffy_cuckoo* here, libfilter_minimal_taffy_cuckoo_path p,
+    libfilter_minimal_taffy_cuckoo_path q, libfilter_minimal_taffy_cuckoo_path r) {
+  if (q.slot.tail != 0) {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, tail_splits, 1);
+  } else if (r.slot.tail != p.slot.tail) {
+    libfilter_taffy_cuckoo_stats_add(&here->stats, tail_shortenings, 1);
+  }
+}
+
 // Double the size of one level of the filter
-INLINE void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo* here) {
-  libfilter_minimal_taffy_cuckoo_bucket* last_data[2] = {here->sides[0].levels[here->cursor].data,
-                                                         here->sides[1].levels[here->cursor].data};
-  {
-    libfilter_minimal_taffy_cuckoo_bucket* next[2];
+INLINE bool libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo* here) {
+  const uint64_t start = libfilter_taffy_cuckoo_stats_nanos();
+  const uint64_t level_bytes = sizeof(libfilter_minimal_taffy_cuckoo_bucket)
+                               << here->log_side_size;
+  const uint64_t old_bytes =
+      libfilter_minimal_taffy_cuckoo_region_bytes(here->log_side_size, here->cursor);
+  // Everything is allocated before anything is changed, so that if memory runs out, the
+  // filter can be left as it was. last_data gets a copy of the old buckets of the level
+  // being doubled.
+  libfilter_minimal_taffy_cuckoo_bucket* last_data[2];
+  libfilter_minimal_taffy_cuckoo_path* stashes[2];
+  for (int i = 0; i < 2; ++i) {
+    last_data[i] = (libfilter_minimal_taffy_cuckoo_bucket*)malloc(level_bytes);
+    stashes[i] = (libfilter_minimal_taffy_cuckoo_path*)libfilter_huge_calloc(
+        4 * sizeof(libfilter_minimal_taffy_cuckoo_path));
+  }
+  void* regions[2] = {here->sides[0].levels[0].data, here->sides[1].levels[0].data};
+  if (last_data[0] == NULL || last_data[1] == NULL || stashes[0] == NULL ||
+      stashes[1] == NULL ||
+      !libfilter_huge_grow_both(regions, old_bytes, old_bytes + level_bytes)) {
+    here->sides[0].levels[0].data = (libfilter_minimal_taffy_cuckoo_bucket*)regions[0];
+    libfilter_minimal_taffy_cuckoo_side_point(&here->sides[0], here->log_side_size,
+                                              here->cursor);
     for (int i = 0; i < 2; ++i) {
-      next[i] = (libfilter_minimal_taffy_cuckoo_bucket*)calloc(
-          2ull << here->log_side_size, sizeof(libfilter_minimal_taffy_cuckoo_bucket));
+      free(last_data[i]);
+      libfilter_huge_free(stashes[i], 4 * sizeof(libfilter_minimal_taffy_cuckoo_path));
     }
-
-    here->sides[0].levels[here->cursor].data = next[0];
-    here->sides[1].levels[here->cursor].data = next[1];
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    here->sides[i].levels[0].data = (libfilter_minimal_taffy_cuckoo_bucket*)regions[i];
+    libfilter_minimal_taffy_cuckoo_side_point(&here->sides[i], here->log_side_size,
+                                              here->cursor);
+    memcpy(last_data[i], here->sides[i].levels[here->cursor].data, level_bytes);
+    libfilter_minimal_taffy_cuckoo_side_shift(&here->sides[i], here->log_side_size,
+                                              here->cursor);
   }
   here->cursor = here->cursor + 1;
   libfilter_minimal_taffy_cuckoo_path p;
   p.level = here->cursor - 1;
 
-  libfilter_minimal_taffy_cuckoo_path* stashes[2];
   size_t stash_capacities[2] = {4, 4}, stash_sizes[2] = {0, 0};
   for (int i = 0; i < 2; ++i) {
-    stashes[i] = (libfilter_minimal_taffy_cuckoo_path*)malloc(
-        4 * sizeof(libfilter_minimal_taffy_cuckoo_path));
     libfilter_minimal_taffy_cuckoo_path* tmp = stashes[i];
     stashes[i] = here->sides[i].stashes;
     here->sides[i].stashes = tmp;
@@ -137,8 +254,6 @@ INLINE void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo
     here->sides[i].stashes_capacity = stash_capacities[i];
 
     here->occupied = here->occupied - stash_sizes[i];
-    here->sides[i].stashes = (libfilter_minimal_taffy_cuckoo_path*)realloc(
-        here->sides[i].stashes, 4 * sizeof(libfilter_minimal_taffy_cuckoo_path));
     here->sides[i].stashes_capacity = 4;
     here->sides[i].stashes_size = 0;
   }
@@ -149,8 +264,9 @@ INLINE void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo
       r = libfilter_minimal_taffy_cuckoo_re_path_upsize(
           stashes[s][i], &here->sides[s].lo, &here->sides[s].hi, here->log_side_size,
           here->cursor - 1, &q);
-      int ttl = 128;
+      int ttl = here->policy.ttl;
       assert(r.slot.tail != 0);
+      libfilter_minimal_taffy_cuckoo_stats_tails(here, stashes[s][i], q, r);
       if (q.slot.tail != 0) {
         libfilter_minimal_taffy_cuckoo_insert_detail(here, s, q, ttl);
       }
@@ -168,8 +284,9 @@ INLINE void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo
         libfilter_minimal_taffy_cuckoo_path q, r;
         r = libfilter_minimal_taffy_cuckoo_re_path_upsize(p, &here->sides[s].lo, &here->sides[s].hi,
                                                           here->log_side_size, here->cursor - 1, &q);
-        int ttl = 128;
+        int ttl = here->policy.ttl;
         assert(r.slot.tail != 0);
+        libfilter_minimal_taffy_cuckoo_stats_tails(here, p, q, r);
         if (q.slot.tail != 0) {
           libfilter_minimal_taffy_cuckoo_insert_detail(here, s, q, ttl);
         }
@@ -187,8 +304,116 @@ INLINE void libfilter_minimal_taffy_cuckoo_upsize(libfilter_minimal_taffy_cuckoo
       here->sides[i].hi = f;
     }
   }
-  free(stashes[0]);
-  free(stashes[1]);
-  free(last_data[0]);
-  free(last_data[1]);
+  for (int i = 0; i < 2; ++i) {
+    libfilter_huge_free(
+        stashes[i], stash_capacities[i] * sizeof(libfilter_minimal_taffy_cuckoo_path));
+    free(last_data[i]);
+  }
+  libfilter_taffy_cuckoo_stats_add(&here->stats, upsizes, 1);
+  libfilter_taffy_cuckoo_stats_add(&here->stats, upsize_nanos,
+                                   libfilter_taffy_cuckoo_stats_nanos() - start);
+  return true;
+}
+
+bool libfilter_minimal_taffy_cuckoo_add_hash_batch(libfilter_minimal_taffy_cuckoo* here,
+                                                   const uint64_t* hashes, size_t n) {
+  // Enough chains that their bucket loads overlap. Each group of keys is reserved for up
+  // front, since an upsize can't run while chains hold entries that aren't in the table.
+  enum { kLanes = 8 };
+  for (size_t i = 0; i < n; i += kLanes) {
+    const size_t m = (n - i < kLanes) ? (n - i) : kLanes;
+    if (!libfilter_minimal_taffy_cuckoo_reserve(here, m)) return false;
+    libfilter_minimal_taffy_cuckoo_pending pending;
+    pending.size = pending.peak = 0;
+    libfilter_minimal_taffy_cuckoo_chain lanes[kLanes];
+    for (size_t j = 0; j < m; ++j) {
+      // As in libfilter_minimal_taffy_cuckoo_add_hash
+      lanes[j].p = libfilter_minimal_taffy_cuckoo_to_path(
+          hashes[i + j], &here->sides[0].hi, here->cursor, here->log_side_size, false);
+      lanes[j].side = 0;
+      lanes[j].ttl = here->policy.ttl;
+      lanes[j].kicks = 0;
+    }
+    size_t active = m;
+    while (active > 0) {
+      for (size_t j = 0; j < active; ++j) {
+        __builtin_prefetch(&here->sides[lanes[j].side]
+                                .levels[lanes[j].p.level]
+                                .data[lanes[j].p.bucket]);
+      }
+      for (size_t j = 0; j < active;) {
+        if (!libfilter_minimal_taffy_cuckoo_chain_step(here, &lanes[j], &pending)) {
+          ++j;
+        } else if (pending.size > 0) {
+          // Done, so start on an entry that was split off by one of the chains
+          lanes[j++] = pending.data[--pending.size];
+        } else {
+          // Done, and lanes[j] takes the place of the last lane, which hasn't yet taken
+          // its step this round
+          lanes[j] = lanes[--active];
+        }
+      }
+    }
+    libfilter_taffy_cuckoo_stats_pending(&here->stats, pending.peak);
+  }
+  return true;
+}
+
+void libfilter_minimal_taffy_cuckoo_find_hash_batch(
+    const libfilter_minimal_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    bool* results) {
+  // As in libfilter_taffy_cuckoo_find_hash_batch. There are four paths per key here,
+  // rather than two, so there are half as many keys per batch.
+  enum { kBatch = 8 };
+  for (size_t i = 0; i < n; i += kBatch) {
+    const size_t m = (n - i < kBatch) ? (n - i) : kBatch;
+    // paths[2 * s] and paths[2 * s + 1] are the lo and hi paths on side s, in the order
+    // libfilter_minimal_taffy_cuckoo_find_hash tries them
+    libfilter_minimal_taffy_cuckoo_path paths[4][kBatch];
+    for (int k = 0; k < 4; ++k) {
+      const bool full_is_short = (k % 2 == 0);
+      const libfilter_feistel* f =
+          full_is_short ? &here->sides[k / 2].lo : &here->sides[k / 2].hi;
+      const int w =
+          libfilter_minimal_taffy_cuckoo_path_width(here->log_side_size, full_is_short);
+      // As in libfilter_minimal_taffy_cuckoo_to_path
+      uint64_t pre_hash[kBatch] = {0}, hashed[kBatch];
+      for (size_t j = 0; j < m; ++j) pre_hash[j] = hashes[i + j] >> (64 - w);
+      for (size_t j = 0; j < m; j += 4) {
+        libfilter_feistel_permute_forward_4(f, w, &pre_hash[j], &hashed[j]);
+      }
+      for (size_t j = 0; j < m; ++j) {
+        const uint64_t raw_tail = libfilter_mask(
+            libfilter_minimal_taffy_cuckoo_tail_size,
+            hashes[i + j] >> (64 - w - libfilter_minimal_taffy_cuckoo_tail_size));
+        paths[k][j] = libfilter_minimal_taffy_cuckoo_to_path_hashed(
+            raw_tail, hashed[j], here->cursor, here->log_side_size, full_is_short);
+      }
+    }
+    for (int k = 0; k < 4; ++k) {
+      for (size_t j = 0; j < m; ++j) {
+        const libfilter_minimal_taffy_cuckoo_path p = paths[k][j];
+        // The lo path is empty when its level has already been doubled
+        if (p.slot.tail == 0) continue;
+        __builtin_prefetch(&here->sides[k / 2].levels[p.level].data[p.bucket]);
+      }
+    }
+    for (size_t j = 0; j < m; ++j) {
+      // The prefetched buckets first, then the stashes, which rarely match
+      bool found = false;
+      for (int k = 0; k < 4 && !found; ++k) {
+        const libfilter_minimal_taffy_cuckoo_path p = paths[k][j];
+        found = p.slot.tail != 0 && libfilter_minimal_taffy_cuckoo_level_find(
+                                        &here->sides[k / 2].levels[p.level], p);
+        if (found) libfilter_taffy_cuckoo_stats_add(&here->stats, bucket_hits, 1);
+      }
+      for (int k = 0; k < 4 && !found; ++k) {
+        const libfilter_minimal_taffy_cuckoo_path p = paths[k][j];
+        found = p.slot.tail != 0 &&
+                libfilter_minimal_taffy_cuckoo_stash_find(&here->sides[k / 2], p);
+        if (found) libfilter_taffy_cuckoo_stats_add(&here->stats, stash_hits, 1);
+      }
+      results[i + j] = found;
+    }
+  }
 }
@@ -27,7 +27,9 @@ int libfilter_taffy_block_init(uint64_t ndv, double fpp, libfilter_taffy_block *
 void libfilter_taffy_block_upsize(libfilter_taffy_block* here) {
   here->last_ndv *= 2;
   libfilter_block_init(here->sizes[here->cursor], &here->levels[here->cursor]);
-  ++here->cursor;
+  // Publish the new level only once it is fully initialized, for the benefit of
+  // libfilter_taffy_block_concurrent_find_hash.
+  __atomic_store_n(&here->cursor, here->cursor + 1, __ATOMIC_RELEASE);
   here->ttl = here->last_ndv;
 }
 
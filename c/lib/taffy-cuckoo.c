@@ -1,53 +1,257 @@
 #include "filter/taffy-cuckoo.h"
 
+#include <pthread.h>  // for pthread_create, pthread_join
+#include <sched.h>    // for sched_yield
+
+#include "memory-internal.h"  // for libfilter_huge_calloc, libfilter_huge_free
+
 libfilter_taffy_cuckoo_side libfilter_taffy_cuckoo_side_create(int log_side_size,
                                                                const uint64_t* keys) {
   libfilter_taffy_cuckoo_side here;
   here.f = libfilter_feistel_create(&keys[0]);
-  here.data = (libfilter_taffy_cuckoo_bucket*)calloc(
-      1ul << log_side_size, sizeof(libfilter_taffy_cuckoo_bucket));
+  here.data = (libfilter_taffy_cuckoo_bucket*)libfilter_huge_calloc(
+      sizeof(libfilter_taffy_cuckoo_bucket) << log_side_size);
   here.stash_capacity = 4;
   here.stash_size = 0;
-  here.stash = (libfilter_taffy_cuckoo_path*)calloc(here.stash_capacity,
-                                                    sizeof(libfilter_taffy_cuckoo_path));
+  here.stash = (libfilter_taffy_cuckoo_path*)libfilter_huge_calloc(
+      here.stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+  here.overflow = NULL;
 
   return here;
 }
 
+// The number of bytes in an overflow bitmap
+static uint64_t libfilter_overflow_bytes(int log_side_size) {
+  return sizeof(uint64_t) * (((1ul << log_side_size) + 63) / 64);
+}
+
+// Atomic, since readers of libfilter_concurrent_taffy_cuckoo check bits while they are
+// being set
+static void libfilter_overflow_set(uint64_t* overflow, uint64_t bucket) {
+  __atomic_fetch_or(&overflow[bucket / 64], 1ul << (bucket % 64), __ATOMIC_RELAXED);
+}
+
+// Puts p in the first empty entry of its probe sequence. There must be one.
+static void libfilter_taffy_cuckoo_stash_place(libfilter_taffy_cuckoo_side* here,
+                                               libfilter_taffy_cuckoo_path p) {
+  const size_t mask = here->stash_capacity - 1;
+  size_t i = p.bucket & mask;
+  while (here->stash[i].slot.tail != 0) i = (i + 1) & mask;
+  here->stash[i] = p;
+  ++here->stash_size;
+}
+
+void libfilter_taffy_cuckoo_stash_add(libfilter_taffy_cuckoo_side* here,
+                                      libfilter_taffy_cuckoo_path p, int log_side_size) {
+  if (2 * (here->stash_size + 1) > here->stash_capacity) {
+    libfilter_taffy_cuckoo_path* old = here->stash;
+    const size_t old_capacity = here->stash_capacity;
+    here->stash_capacity = (old_capacity == 0) ? 4 : (2 * old_capacity);
+    here->stash = (libfilter_taffy_cuckoo_path*)libfilter_huge_calloc(
+        here->stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    here->stash_size = 0;
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old[i].slot.tail != 0) libfilter_taffy_cuckoo_stash_place(here, old[i]);
+    }
+    libfilter_huge_free(old, old_capacity * sizeof(libfilter_taffy_cuckoo_path));
+  }
+  if (here->overflow == NULL) {
+    here->overflow =
+        (uint64_t*)libfilter_huge_calloc(libfilter_overflow_bytes(log_side_size));
+  }
+  libfilter_overflow_set(here->overflow, p.bucket);
+  libfilter_taffy_cuckoo_stash_place(here, p);
+}
+
+// The size of the data_ of one side
+static uint64_t libfilter_frozen_taffy_cuckoo_data_bytes(
+    libfilter_frozen_taffy_cuckoo_layout layout, int log_side_size) {
+  const uint64_t buckets = 1ul << log_side_size;
+  if (layout == libfilter_frozen_taffy_cuckoo_aligned) return 64 * ((buckets + 11) / 12);
+  return sizeof(libfilter_frozen_taffy_cuckoo_bucket) * buckets;
+}
+
 size_t libfilter_frozen_taffy_cuckoo_size_in_bytes(
     const libfilter_frozen_taffy_cuckoo* b) {
-  return (sizeof(libfilter_frozen_taffy_cuckoo_bucket) * 2ul << b->log_side_size_) +
-         sizeof(uint64_t) * (b->stash_capacity_[0] + b->stash_capacity_[1]);
+  size_t result =
+      2 * libfilter_frozen_taffy_cuckoo_data_bytes(b->layout_, b->log_side_size_) +
+      sizeof(uint64_t) * (b->stash_capacity_[0] + b->stash_capacity_[1]);
+  for (int i = 0; i < 2; ++i) {
+    if (b->overflow_[i] != NULL) result += libfilter_overflow_bytes(b->log_side_size_);
+  }
+  return result;
+}
+
+// Returns a bitmask with bit j set if the fingerprint of permuted[j] is in its bucket of
+// the given side. The fingerprint and bucket are packed into permuted as in
+// libfilter_frozen_taffy_cuckoo_find_hash.
+INLINE unsigned libfilter_frozen_taffy_cuckoo_bucket_find_4(
+    const libfilter_frozen_taffy_cuckoo* here, int side, const uint64_t permuted[4]) {
+#if defined(__AVX2__)
+  const __m256i p = _mm256_loadu_si256((const __m256i*)permuted);
+  const __m256i fingerprint = _mm256_and_si256(
+      p, _mm256_set1_epi64x((1 << libfilter_taffy_cuckoo_head_size) - 1));
+  const __m256i bucket = _mm256_srli_epi64(p, libfilter_taffy_cuckoo_head_size);
+  __m256i offset = _mm256_add_epi64(_mm256_slli_epi64(bucket, 2), bucket);
+  if (here->layout_ == libfilter_frozen_taffy_cuckoo_aligned) {
+    // libfilter_frozen_taffy_cuckoo_bucket_offset, with bucket / 12 done as a multiply
+    // and shift, which is exact for buckets below 2^32
+    const __m256i line =
+        _mm256_srli_epi64(_mm256_mul_epu32(bucket, _mm256_set1_epi64x(0xaaaaaaabULL)), 35);
+    offset = _mm256_add_epi64(offset, _mm256_slli_epi64(line, 2));
+  }
+  // Each bucket is five bytes, so it is gathered as bytes [0, 4) and [1, 5) rather than
+  // as eight bytes, which could read past the end of data_.
+  const char* bytes = (const char*)here->data_[side];
+  const __m256i lo =
+      _mm256_cvtepu32_epi64(_mm256_i64gather_epi32((const int*)bytes, offset, 1));
+  const __m256i hi =
+      _mm256_cvtepu32_epi64(_mm256_i64gather_epi32((const int*)(bytes + 1), offset, 1));
+  const __m256i z =
+      _mm256_or_si256(lo, _mm256_slli_epi64(_mm256_srli_epi64(hi, 24), 32));
+  // libfilter_cuckoo_has_value_10, lane-wise
+  const __m256i broadcast = _mm256_or_si256(
+      _mm256_or_si256(fingerprint, _mm256_slli_epi64(fingerprint, 10)),
+      _mm256_or_si256(_mm256_slli_epi64(fingerprint, 20),
+                      _mm256_slli_epi64(fingerprint, 30)));
+  const __m256i x = _mm256_xor_si256(z, broadcast);
+  const __m256i has_zero = _mm256_and_si256(
+      _mm256_andnot_si256(x, _mm256_sub_epi64(x, _mm256_set1_epi64x(0x40100401ULL))),
+      _mm256_set1_epi64x(0x8020080200ULL));
+  const __m256i zero = _mm256_setzero_si256();
+  // Fingerprint 0 marks an empty slot, as in libfilter_frozen_taffy_cuckoo_find_hash
+  const __m256i miss = _mm256_or_si256(_mm256_cmpeq_epi64(has_zero, zero),
+                                       _mm256_cmpeq_epi64(fingerprint, zero));
+  return ~_mm256_movemask_pd(_mm256_castsi256_pd(miss)) & 0xf;
+#else
+  unsigned result = 0;
+  for (int j = 0; j < 4; ++j) {
+    const uint64_t fingerprint =
+        permuted[j] & ((1 << libfilter_taffy_cuckoo_head_size) - 1);
+    uint64_t z = 0;
+    memcpy(&z,
+           libfilter_frozen_taffy_cuckoo_bucket_at(
+               here, side, permuted[j] >> libfilter_taffy_cuckoo_head_size),
+           sizeof(libfilter_frozen_taffy_cuckoo_bucket));
+    if (0 != fingerprint && libfilter_cuckoo_has_value_10(z, fingerprint)) {
+      result |= 1u << j;
+    }
+  }
+  return result;
+#endif
+}
+
+void libfilter_frozen_taffy_cuckoo_find_hash_batch(
+    const libfilter_frozen_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    bool* results) {
+  // As in libfilter_taffy_cuckoo_find_hash_batch
+  enum { kBatch = 16 };
+  const int w = here->log_side_size_ + libfilter_taffy_cuckoo_head_size;
+  for (size_t i = 0; i < n; i += kBatch) {
+    const size_t m = (n - i < kBatch) ? (n - i) : kBatch;
+    // The unused end of a partial batch is looked up as 0, and the results ignored
+    uint64_t pre_hash[kBatch] = {0}, permuted[2][kBatch];
+    for (size_t j = 0; j < m; ++j) pre_hash[j] = hashes[i + j] >> (64 - w);
+    for (int s = 0; s < 2; ++s) {
+      for (size_t j = 0; j < m; j += 4) {
+        libfilter_feistel_permute_forward_4(&here->hash_[s], w, &pre_hash[j],
+                                            &permuted[s][j]);
+      }
+      for (size_t j = 0; j < m; ++j) {
+        __builtin_prefetch(libfilter_frozen_taffy_cuckoo_bucket_at(
+            here, s, permuted[s][j] >> libfilter_taffy_cuckoo_head_size));
+      }
+    }
+    for (size_t j = 0; j < m; j += 4) {
+      const unsigned found =
+          libfilter_frozen_taffy_cuckoo_bucket_find_4(here, 0, &permuted[0][j]) |
+          libfilter_frozen_taffy_cuckoo_bucket_find_4(here, 1, &permuted[1][j]);
+      for (size_t k = 0; k < 4 && j + k < m; ++k) {
+        results[i + j + k] =
+            ((found >> k) & 1) ||
+            libfilter_frozen_taffy_cuckoo_stash_find(here, 0, permuted[0][j + k]) ||
+            libfilter_frozen_taffy_cuckoo_stash_find(here, 1, permuted[1][j + k]);
+      }
+    }
+  }
 }
 
 void libfilter_frozen_taffy_cuckoo_destruct(libfilter_frozen_taffy_cuckoo* here) {
-  free(here->data_[0]);
-  free(here->data_[1]);
-  free(here->stash_[0]);
-  free(here->stash_[1]);
+  if (here->borrowed_) return;
+  for (int i = 0; i < 2; ++i) {
+    libfilter_huge_free(
+        here->data_[i],
+        libfilter_frozen_taffy_cuckoo_data_bytes(here->layout_, here->log_side_size_));
+    libfilter_huge_free(here->stash_[i], here->stash_capacity_[i] * sizeof(uint64_t));
+    libfilter_huge_free(here->overflow_[i],
+                        libfilter_overflow_bytes(here->log_side_size_));
+  }
 }
 
 void libfilter_frozen_taffy_cuckoo_init(const uint64_t entropy[8], int log_side_size,
+                                        libfilter_frozen_taffy_cuckoo_layout layout,
                                         libfilter_frozen_taffy_cuckoo* here) {
   here->hash_[0] = libfilter_feistel_create(entropy);
   here->hash_[1] = libfilter_feistel_create(&entropy[4]);
   here->log_side_size_ = log_side_size;
+  here->layout_ = layout;
+  here->borrowed_ = false;
+  const uint64_t bytes = libfilter_frozen_taffy_cuckoo_data_bytes(layout, log_side_size);
   for (int i = 0; i < 2; ++i) {
-    here->data_[i] = (libfilter_frozen_taffy_cuckoo_bucket*)calloc(
-        1ul << log_side_size, sizeof(libfilter_frozen_taffy_cuckoo_bucket));
-    here->stash_capacity_[i] = 4;
+    // Cache-line aligned, as the aligned layout needs
+    here->data_[i] = (libfilter_frozen_taffy_cuckoo_bucket*)libfilter_huge_calloc(bytes);
+    here->stash_capacity_[i] = 0;
     here->stash_size_[i] = 0;
-    here->stash_[i] = (uint64_t*)calloc(here->stash_capacity_[i], sizeof(uint64_t));
+    here->stash_[i] = NULL;
+    here->overflow_[i] = NULL;
+  }
+}
+
+// Makes room in the stash of side i for n values, which must be added with
+// libfilter_frozen_taffy_cuckoo_stash_add.
+static void libfilter_frozen_taffy_cuckoo_stash_init(libfilter_frozen_taffy_cuckoo* here,
+                                                     int i, size_t n) {
+  if (n == 0) return;
+  size_t capacity = 2;
+  while (capacity < 2 * n) capacity *= 2;
+  here->stash_capacity_[i] = capacity;
+  here->stash_[i] = (uint64_t*)libfilter_huge_calloc(capacity * sizeof(uint64_t));
+  memset(here->stash_[i], 0xff, capacity * sizeof(uint64_t));
+  here->overflow_[i] =
+      (uint64_t*)libfilter_huge_calloc(libfilter_overflow_bytes(here->log_side_size_));
+}
+
+static void libfilter_frozen_taffy_cuckoo_stash_add(libfilter_frozen_taffy_cuckoo* here,
+                                                    int i, uint64_t permuted) {
+  const uint64_t bucket = permuted >> libfilter_taffy_cuckoo_head_size;
+  const size_t mask = here->stash_capacity_[i] - 1;
+  size_t j = bucket & mask;
+  for (; here->stash_[i][j] != UINT64_MAX; j = (j + 1) & mask) {
+    // Paths that differ only in their tails are the same once frozen
+    if (here->stash_[i][j] == permuted) return;
   }
+  here->stash_[i][j] = permuted;
+  ++here->stash_size_[i];
+  libfilter_overflow_set(here->overflow_[i], bucket);
 }
 
 libfilter_frozen_taffy_cuckoo libfilter_frozen_taffy_cuckoo_create(
     const uint64_t entropy[8], int log_side_size) {
   libfilter_frozen_taffy_cuckoo here;
-  libfilter_frozen_taffy_cuckoo_init(entropy, log_side_size, &here);
+  libfilter_frozen_taffy_cuckoo_init(entropy, log_side_size,
+                                     libfilter_frozen_taffy_cuckoo_packed, &here);
   return here;
 }
 
+libfilter_taffy_cuckoo_policy libfilter_taffy_cuckoo_default_policy(void) {
+  libfilter_taffy_cuckoo_policy result;
+  result.max_load = 0.90;
+  result.ttl = 32;
+  result.max_stash = 8;
+  result.growth_steps = 1;
+  return result;
+}
+
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y) {
   // SideSwap(&x->sides[0], &y->sides[0]);
   // SideSwap(&x->sides[1], &y->sides[1]);
@@ -68,8 +272,17 @@ libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create(int log_side_size,
   here.sides[1] = libfilter_taffy_cuckoo_side_create(log_side_size, entropy + 4);
   here.log_side_size = log_side_size;
   here.rng = libfilter_pcg_random_create(libfilter_log_slots);
-  here.entropy = entropy;
+  memcpy(here.entropy, entropy, sizeof(here.entropy));
   here.occupied = 0;
+  here.borrowed = false;
+  here.migrate_per_insert = 0;
+  here.migrating_from = NULL;
+  here.migrate_cursor = 0;
+  here.upsize_threads = 0;
+  here.bfs_insert = false;
+  here.in_place_upsize = false;
+  here.policy = libfilter_taffy_cuckoo_default_policy();
+  memset(&here.stats, 0, sizeof(here.stats));
   return here;
 }
 
@@ -80,22 +293,49 @@ int libfilter_taffy_cuckoo_clone(const libfilter_taffy_cuckoo* that, libfilter_t
       libfilter_taffy_cuckoo_side_create(that->log_side_size, that->entropy + 4);
   here->log_side_size = that->log_side_size;
   here->rng = that->rng;
-  here->entropy = that->entropy;
+  memcpy(here->entropy, that->entropy, sizeof(here->entropy));
   here->occupied = that->occupied;
+  here->borrowed = false;
   for (int i = 0; i < 2; ++i) {
-    free(here->sides[i].stash);
-    here->sides[i].stash = (libfilter_taffy_cuckoo_path*)calloc(
-        that->sides[i].stash_capacity, sizeof(libfilter_taffy_cuckoo_path));
+    libfilter_huge_free(here->sides[i].stash,
+                        here->sides[i].stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    here->sides[i].stash = (libfilter_taffy_cuckoo_path*)libfilter_huge_calloc(
+        that->sides[i].stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
     here->sides[i].stash_capacity = that->sides[i].stash_capacity;
     here->sides[i].stash_size = that->sides[i].stash_size;
     memcpy(&here->sides[i].stash[0], &that->sides[i].stash[0],
-           that->sides[i].stash_size * sizeof(libfilter_taffy_cuckoo_path));
+           that->sides[i].stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    if (that->sides[i].overflow != NULL) {
+      const uint64_t bytes = libfilter_overflow_bytes(that->log_side_size);
+      here->sides[i].overflow = (uint64_t*)libfilter_huge_calloc(bytes);
+      memcpy(here->sides[i].overflow, that->sides[i].overflow, bytes);
+    }
     memcpy(&here->sides[i].data[0], &that->sides[i].data[0],
            sizeof(libfilter_taffy_cuckoo_bucket) << that->log_side_size);
   }
+  here->migrate_per_insert = that->migrate_per_insert;
+  here->upsize_threads = that->upsize_threads;
+  here->bfs_insert = that->bfs_insert;
+  here->in_place_upsize = that->in_place_upsize;
+  here->policy = that->policy;
+  here->stats = that->stats;
+  here->migrating_from = NULL;
+  here->migrate_cursor = that->migrate_cursor;
+  if (that->migrating_from != NULL) {
+    here->migrating_from =
+        (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+    libfilter_taffy_cuckoo_clone(that->migrating_from, here->migrating_from);
+  }
   return 0;
 }
 
+// Clones here and completes any upsize in progress in the clone
+static void libfilter_taffy_cuckoo_clone_finished(const libfilter_taffy_cuckoo* here,
+                                                  libfilter_taffy_cuckoo* result) {
+  libfilter_taffy_cuckoo_clone(here, result);
+  libfilter_taffy_cuckoo_finish_upsize(result);
+}
+
 void libfilter_taffy_cuckoo_init(uint64_t bytes, libfilter_taffy_cuckoo* here) {
   static const uint64_t kEntropy[8] = {
       0x2ba7538ee1234073, 0xfcc3777539b147d6, 0x6086c563576347e7, 0x52eff34ee1764465,
@@ -109,8 +349,17 @@ void libfilter_taffy_cuckoo_init(uint64_t bytes, libfilter_taffy_cuckoo* here) {
   here->sides[1] = libfilter_taffy_cuckoo_side_create(log_side_size, &kEntropy[4]);
   here->log_side_size = log_side_size;
   here->rng = libfilter_pcg_random_create(libfilter_log_slots);
-  here->entropy = kEntropy;
+  memcpy(here->entropy, kEntropy, sizeof(here->entropy));
   here->occupied = 0;
+  here->borrowed = false;
+  here->migrate_per_insert = 0;
+  here->migrating_from = NULL;
+  here->migrate_cursor = 0;
+  here->upsize_threads = 0;
+  here->bfs_insert = false;
+  here->in_place_upsize = false;
+  here->policy = libfilter_taffy_cuckoo_default_policy();
+  memset(&here->stats, 0, sizeof(here->stats));
 }
 
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create_with_bytes(uint64_t bytes) {
@@ -124,34 +373,66 @@ libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create_with_bytes(uint64_t bytes)
   return libfilter_taffy_cuckoo_create(f, kEntropy);
 }
 
-void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo* here,
-                                        libfilter_frozen_taffy_cuckoo* result) {
-  libfilter_frozen_taffy_cuckoo_init(here->entropy, here->log_side_size, result);
+void libfilter_taffy_cuckoo_freeze_layout_init(const libfilter_taffy_cuckoo* here,
+                                               libfilter_frozen_taffy_cuckoo_layout layout,
+                                               libfilter_frozen_taffy_cuckoo* result) {
+  if (here->migrating_from != NULL) {
+    // Freeze a copy that has finished upsizing, so there is only one table to freeze
+    libfilter_taffy_cuckoo finished;
+    libfilter_taffy_cuckoo_clone_finished(here, &finished);
+    libfilter_taffy_cuckoo_freeze_layout_init(&finished, layout, result);
+    libfilter_taffy_cuckoo_destruct(&finished);
+    return;
+  }
+  libfilter_frozen_taffy_cuckoo_init(here->entropy, here->log_side_size, layout, result);
   for (int i = 0; i < 2; ++i) {
-    for (size_t j = 0; j < here->sides[i].stash_size; ++j) {
-      uint64_t topush = libfilter_taffy_cuckoo_from_path_no_tail(
-          here->sides[i].stash[j], &here->sides[i].f, here->log_side_size);
-      if (result->stash_size_[i] == result->stash_capacity_[i]) {
-        result->stash_capacity_[i] *= 2;
-        uint64_t* new_stash =
-            (uint64_t*)calloc(result->stash_capacity_[i], sizeof(uint64_t));
-        memcpy(new_stash, result->stash_[i], result->stash_size_[i]);
-        free(result->stash_[i]);
-        result->stash_[i] = new_stash;
-      }
-      result->stash_[i][result->stash_size_[i]++] = topush;
+    const libfilter_taffy_cuckoo_side* side = &here->sides[i];
+    // A frozen slot with fingerprint 0 is empty, so entries with fingerprint 0 go in the
+    // stash instead
+    size_t zeros = 0;
+    for (size_t j = 0; j < (1ul << here->log_side_size); ++j) {
+      for (int k = 0; k < libfilter_slots; ++k) {
+        const libfilter_taffy_cuckoo_slot sl = side->data[j].data[k];
+        zeros += (sl.tail != 0 && sl.fingerprint == 0);
+      }
+    }
+    libfilter_frozen_taffy_cuckoo_stash_init(result, i, side->stash_size + zeros);
+    for (size_t j = 0; j < side->stash_capacity; ++j) {
+      if (side->stash[j].slot.tail == 0) continue;
+      // This is the permuted value that libfilter_frozen_taffy_cuckoo_find_hash looks for
+      libfilter_frozen_taffy_cuckoo_stash_add(
+          result, i,
+          (side->stash[j].bucket << libfilter_taffy_cuckoo_head_size) |
+              side->stash[j].slot.fingerprint);
     }
     for (size_t j = 0; j < (1ul << here->log_side_size); ++j) {
-      libfilter_frozen_taffy_cuckoo_bucket* out = &result->data_[i][j];
-      const libfilter_taffy_cuckoo_bucket* in = &here->sides[i].data[j];
-      out->zero = in->data[0].fingerprint;
-      out->one = in->data[1].fingerprint;
-      out->two = in->data[2].fingerprint;
-      out->three = in->data[3].fingerprint;
+      uint64_t fingerprints[libfilter_slots];
+      for (int k = 0; k < libfilter_slots; ++k) {
+        const libfilter_taffy_cuckoo_slot sl = side->data[j].data[k];
+        // Empty slots are frozen as 0, whatever is left in their fingerprint bits
+        fingerprints[k] = (sl.tail == 0) ? 0 : sl.fingerprint;
+        if (sl.tail != 0 && sl.fingerprint == 0) {
+          libfilter_frozen_taffy_cuckoo_stash_add(result, i,
+                                                  j << libfilter_taffy_cuckoo_head_size);
+        }
+      }
+      const uint64_t offset = libfilter_frozen_taffy_cuckoo_bucket_offset(layout, j);
+      libfilter_frozen_taffy_cuckoo_bucket* out =
+          (libfilter_frozen_taffy_cuckoo_bucket*)((char*)result->data_[i] + offset);
+      out->zero = fingerprints[0];
+      out->one = fingerprints[1];
+      out->two = fingerprints[2];
+      out->three = fingerprints[3];
     }
   }
 }
 
+void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo* here,
+                                        libfilter_frozen_taffy_cuckoo* result) {
+  libfilter_taffy_cuckoo_freeze_layout_init(here, libfilter_frozen_taffy_cuckoo_packed,
+                                            result);
+}
+
 libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
     const libfilter_taffy_cuckoo* here) {
   libfilter_frozen_taffy_cuckoo result;
@@ -159,13 +440,113 @@ libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
   return result;
 }
 
+libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze_layout(
+    const libfilter_taffy_cuckoo* here, libfilter_frozen_taffy_cuckoo_layout layout) {
+  libfilter_frozen_taffy_cuckoo result;
+  libfilter_taffy_cuckoo_freeze_layout_init(here, layout, &result);
+  return result;
+}
+
+void libfilter_frozen_taffy_cuckoo_thaw_init(const libfilter_frozen_taffy_cuckoo* here,
+                                             libfilter_taffy_cuckoo* result) {
+  uint64_t entropy[8];
+  // The keys of each Feistel permutation are the entropy it was created from
+  for (int i = 0; i < 2; ++i) {
+    memcpy(&entropy[4 * i], here->hash_[i].keys, sizeof(here->hash_[i].keys));
+  }
+  *result = libfilter_taffy_cuckoo_create(here->log_side_size_, entropy);
+  // An empty tail: just the end marker
+  const uint64_t tail = 1ul << libfilter_taffy_cuckoo_tail_size;
+  for (int i = 0; i < 2; ++i) {
+    libfilter_taffy_cuckoo_side* side = &result->sides[i];
+    for (size_t j = 0; j < here->stash_capacity_[i]; ++j) {
+      const uint64_t permuted = here->stash_[i][j];
+      if (permuted == UINT64_MAX) continue;
+      libfilter_taffy_cuckoo_path p;
+      p.bucket = permuted >> libfilter_taffy_cuckoo_head_size;
+      p.slot.fingerprint = permuted;
+      p.slot.tail = tail;
+      libfilter_taffy_cuckoo_stash_add(side, p, result->log_side_size);
+      ++result->occupied;
+    }
+    // Each entry goes back in the slot it was frozen from
+    for (size_t j = 0; j < (1ul << here->log_side_size_); ++j) {
+      const libfilter_frozen_taffy_cuckoo_bucket* in =
+          libfilter_frozen_taffy_cuckoo_bucket_at(here, i, j);
+      const uint64_t fingerprints[libfilter_slots] = {in->zero, in->one, in->two,
+                                                      in->three};
+      for (int k = 0; k < libfilter_slots; ++k) {
+        if (fingerprints[k] == 0) continue;
+        side->data[j].data[k].fingerprint = fingerprints[k];
+        side->data[j].data[k].tail = tail;
+        ++result->occupied;
+      }
+    }
+  }
+}
+
+libfilter_taffy_cuckoo libfilter_frozen_taffy_cuckoo_thaw(
+    const libfilter_frozen_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo result;
+  libfilter_frozen_taffy_cuckoo_thaw_init(here, &result);
+  return result;
+}
+
 uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here) {
-  return sizeof(libfilter_taffy_cuckoo_path) *
+  return ((here->migrating_from == NULL)
+              ? 0
+              : libfilter_taffy_cuckoo_size_in_bytes(here->migrating_from)) +
+         sizeof(libfilter_taffy_cuckoo_path) *
              (here->sides[0].stash_capacity + here->sides[1].stash_capacity) +
+         ((here->sides[0].overflow == NULL) ? 0 : libfilter_overflow_bytes(here->log_side_size)) +
+         ((here->sides[1].overflow == NULL) ? 0 : libfilter_overflow_bytes(here->log_side_size)) +
          2 * sizeof(libfilter_taffy_cuckoo_slot) * (1 << here->log_side_size) *
              libfilter_slots;
 }
 
+void libfilter_taffy_cuckoo_find_hash_batch(const libfilter_taffy_cuckoo* here,
+                                            const uint64_t* hashes, size_t n,
+                                            bool* results) {
+  // Enough keys that the bucket loads overlap, but few enough that the prefetched buckets
+  // are still in L1 when they are read.
+  enum { kBatch = 16 };
+  const int w = here->log_side_size + libfilter_taffy_cuckoo_head_size;
+  for (size_t i = 0; i < n; i += kBatch) {
+    const size_t m = (n - i < kBatch) ? (n - i) : kBatch;
+    uint64_t pre_hash[kBatch] = {0}, hashed[2][kBatch];
+    for (size_t j = 0; j < m; ++j) pre_hash[j] = hashes[i + j] >> (64 - w);
+    for (int s = 0; s < 2; ++s) {
+      for (size_t j = 0; j < m; j += 4) {
+        libfilter_feistel_permute_forward_4(&here->sides[s].f, w, &pre_hash[j],
+                                            &hashed[s][j]);
+      }
+      for (size_t j = 0; j < m; ++j) {
+        __builtin_prefetch(
+            &here->sides[s].data[hashed[s][j] >> libfilter_taffy_cuckoo_head_size]);
+      }
+    }
+    for (size_t j = 0; j < m; ++j) {
+      // The tail is the same on both sides; see libfilter_taffy_cuckoo_to_path
+      libfilter_taffy_cuckoo_path p;
+      p.slot.tail = 2 * libfilter_mask(libfilter_taffy_cuckoo_tail_size,
+                                       hashes[i + j] >>
+                                           (64 - w - libfilter_taffy_cuckoo_tail_size)) +
+                    1;
+      bool found = false;
+      for (int s = 0; s < 2 && !found; ++s) {
+        p.bucket = hashed[s][j] >> libfilter_taffy_cuckoo_head_size;
+        p.slot.fingerprint = hashed[s][j];
+        found = libfilter_taffy_cuckoo_side_find(&here->sides[s], p);
+        if (found) libfilter_taffy_cuckoo_stats_hit(&here->stats, &here->sides[s], p);
+      }
+      results[i + j] =
+          found || (here->migrating_from != NULL &&
+                    libfilter_taffy_cuckoo_find_hash_sides_stats(
+                        here->migrating_from, hashes[i + j], &here->stats));
+    }
+  }
+}
+
 // // Verifies the occupied field:
 // INLINE uint64_t Count(const TaffyCuckooFilterBase* here) {
 //   uint64_t result = 0;
@@ -196,17 +577,38 @@ uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here
 // }
 
 void libfilter_taffy_cuckoo_destruct(libfilter_taffy_cuckoo* t) {
-  free(t->sides[0].data);
-  free(t->sides[0].stash);
-  free(t->sides[1].data);
-  free(t->sides[1].stash);
+  for (int s = 0; s < 2; ++s) {
+    if (!t->borrowed) {
+      libfilter_huge_free(t->sides[s].data,
+                          sizeof(libfilter_taffy_cuckoo_bucket) << t->log_side_size);
+    }
+    libfilter_huge_free(t->sides[s].stash,
+                        t->sides[s].stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    libfilter_huge_free(t->sides[s].overflow, libfilter_overflow_bytes(t->log_side_size));
+  }
+  if (t->migrating_from != NULL) {
+    libfilter_taffy_cuckoo_destruct(t->migrating_from);
+    free(t->migrating_from);
+  }
+}
+
+// Receives the paths produced while moving entries from one filter to another, for
+// instance by inserting them into the destination.
+typedef void (*libfilter_taffy_cuckoo_emit)(void* context, libfilter_taffy_cuckoo_path p);
+
+// Inserts p into the left side of the filter in context
+static void libfilter_taffy_cuckoo_emit_insert(void* context,
+                                               libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_insert_side_path((libfilter_taffy_cuckoo*)context, 0, p);
 }
 
 // Take an item from slot sl with bucket index i, a filter u that sl is in, a side that
-// sl is in, and a filter to move sl to, does so, potentially inserting TWO items in t,
-// as described in the paper.
-INLINE void UpsizeHelper(libfilter_taffy_cuckoo* here, libfilter_taffy_cuckoo_slot sl,
-                         uint64_t i, int s, libfilter_taffy_cuckoo* t) {
+// sl is in, and a filter t to move sl to, emits the paths on the left side of t that it
+// becomes, potentially TWO items, as described in the paper.
+static INLINE void UpsizeEmit(const libfilter_taffy_cuckoo* here,
+                              libfilter_taffy_cuckoo_slot sl, uint64_t i, int s,
+                              const libfilter_taffy_cuckoo* t,
+                              libfilter_taffy_cuckoo_emit emit, void* context) {
   if (sl.tail == 0) return;
   libfilter_taffy_cuckoo_path p;
   p.slot = sl;
@@ -219,12 +621,13 @@ INLINE void UpsizeHelper(libfilter_taffy_cuckoo* here, libfilter_taffy_cuckoo_sl
     p = libfilter_taffy_cuckoo_to_path(q, &t->sides[0].f, t->log_side_size);
     // Still no tail! :-)
     p.slot.tail = sl.tail;
-    libfilter_taffy_cuckoo_insert_side_path(t, 0, p);
+    emit(context, p);
     // change the raw value by just one bit: its last
     q |= (1ul << (64 - here->log_side_size - libfilter_taffy_cuckoo_head_size - 1));
     p = libfilter_taffy_cuckoo_to_path(q, &t->sides[0].f, t->log_side_size);
     p.slot.tail = sl.tail;
-    libfilter_taffy_cuckoo_insert_side_path(t, 0, p);
+    emit(context, p);
+    libfilter_taffy_cuckoo_stats_add(&t->stats, tail_splits, 1);
   } else {
     // steal a bit from the tail
     q |= ((uint64_t)(sl.tail >> libfilter_taffy_cuckoo_tail_size))
@@ -232,117 +635,2192 @@ INLINE void UpsizeHelper(libfilter_taffy_cuckoo* here, libfilter_taffy_cuckoo_sl
     libfilter_taffy_cuckoo_path r =
         libfilter_taffy_cuckoo_to_path(q, &t->sides[0].f, t->log_side_size);
     r.slot.tail = (sl.tail << 1);
-    libfilter_taffy_cuckoo_insert_side_path(t, 0, r);
+    emit(context, r);
+    libfilter_taffy_cuckoo_stats_add(&t->stats, tail_shortenings, 1);
+  }
+}
+
+static INLINE void UpsizeHelper(const libfilter_taffy_cuckoo* here,
+                                libfilter_taffy_cuckoo_slot sl, uint64_t i, int s,
+                                libfilter_taffy_cuckoo* t) {
+  UpsizeEmit(here, sl, i, s, t, libfilter_taffy_cuckoo_emit_insert, t);
+}
+
+// The reverse of UpsizeEmit: emits the path on the left side of t, which has half as
+// many buckets per side as here, for slot sl with bucket index i on side s of here
+static INLINE void DownsizeEmit(const libfilter_taffy_cuckoo* here,
+                                libfilter_taffy_cuckoo_slot sl, uint64_t i, int s,
+                                const libfilter_taffy_cuckoo* t,
+                                libfilter_taffy_cuckoo_emit emit, void* context) {
+  if (sl.tail == 0) return;
+  libfilter_taffy_cuckoo_path p;
+  p.slot = sl;
+  p.bucket = i;
+  uint64_t q =
+      libfilter_taffy_cuckoo_from_path_no_tail(p, &here->sides[s].f, here->log_side_size);
+  // The bit that t doesn't use for the bucket index becomes the first bit of the tail
+  const uint64_t bit =
+      (q >> (64 - here->log_side_size - libfilter_taffy_cuckoo_head_size)) & 1;
+  uint64_t tail = sl.tail >> 1;
+  // If the tail was full, the end marker was shifted out. Drop the last bit instead.
+  if (sl.tail & 1) tail = (tail & ~1ul) | 1;
+  libfilter_taffy_cuckoo_path r =
+      libfilter_taffy_cuckoo_to_path(q, &t->sides[0].f, t->log_side_size);
+  r.slot.tail = (bit << libfilter_taffy_cuckoo_tail_size) | tail;
+  emit(context, r);
+}
+
+// Counts "upsizes" upsizes, or the part of one that started at "start", in the stats of
+// here
+static void libfilter_taffy_cuckoo_stats_upsize(libfilter_taffy_cuckoo* here,
+                                                uint64_t upsizes, uint64_t start) {
+  libfilter_taffy_cuckoo_stats_add(&here->stats, upsizes, upsizes);
+  libfilter_taffy_cuckoo_stats_add(&here->stats, upsize_nanos,
+                                   libfilter_taffy_cuckoo_stats_nanos() - start);
+}
+
+void libfilter_taffy_cuckoo_set_incremental_upsize(libfilter_taffy_cuckoo* here,
+                                                   uint64_t buckets_per_insert) {
+  here->migrate_per_insert = buckets_per_insert;
+}
+
+void libfilter_taffy_cuckoo_migrate(libfilter_taffy_cuckoo* here, uint64_t n) {
+  libfilter_taffy_cuckoo* old = here->migrating_from;
+  if (old == NULL) return;
+  const uint64_t start = libfilter_taffy_cuckoo_stats_nanos();
+  // The cursor covers side 0, then side 1
+  const uint64_t end = 2ul << old->log_side_size;
+  for (; n > 0 && here->migrate_cursor < end; --n, ++here->migrate_cursor) {
+    const int s = here->migrate_cursor >> old->log_side_size;
+    const uint64_t i = libfilter_mask(old->log_side_size, here->migrate_cursor);
+    for (int j = 0; j < libfilter_slots; ++j) {
+      UpsizeHelper(old, old->sides[s].data[i].data[j], i, s, here);
+    }
+    // Leave only unmigrated entries in old, so each entry lives in exactly one table
+    memset(&old->sides[s].data[i], 0, sizeof(libfilter_taffy_cuckoo_bucket));
+  }
+  if (here->migrate_cursor == end) {
+    libfilter_taffy_cuckoo_destruct(old);
+    free(old);
+    here->migrating_from = NULL;
+    here->migrate_cursor = 0;
+  }
+  libfilter_taffy_cuckoo_stats_upsize(here, 0, start);
+}
+
+void libfilter_taffy_cuckoo_finish_upsize(libfilter_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo_migrate(here, UINT64_MAX);
+}
+
+static void libfilter_taffy_cuckoo_move_parallel(libfilter_taffy_cuckoo* dest,
+                                                 const libfilter_taffy_cuckoo* source,
+                                                 bool upsize, int threads);
+
+// Creates a filter of twice the size of here, which must have no upsize in progress,
+// holding the same entries. here is not changed.
+static libfilter_taffy_cuckoo libfilter_taffy_cuckoo_upsized(
+    const libfilter_taffy_cuckoo* here, int threads) {
+  libfilter_taffy_cuckoo t =
+      libfilter_taffy_cuckoo_create(1 + here->log_side_size, here->entropy);
+  t.migrate_per_insert = here->migrate_per_insert;
+  t.upsize_threads = here->upsize_threads;
+  t.bfs_insert = here->bfs_insert;
+  t.in_place_upsize = here->in_place_upsize;
+  t.policy = here->policy;
+  t.stats = here->stats;
+
+  if (threads > 1) {
+    libfilter_taffy_cuckoo_move_parallel(&t, here, true, threads);
+  } else {
+    for (int s = 0; s < 2; ++s) {
+      for (size_t i = 0; i < here->sides[s].stash_capacity; ++i) {
+        if (here->sides[s].stash[i].slot.tail == 0) continue;
+        UpsizeHelper(here, here->sides[s].stash[i].slot, here->sides[s].stash[i].bucket,
+                     s, &t);
+      }
+      for (unsigned i = 0; i < (1u << here->log_side_size); ++i) {
+        for (int j = 0; j < libfilter_slots; ++j) {
+          libfilter_taffy_cuckoo_slot sl = here->sides[s].data[i].data[j];
+          UpsizeHelper(here, sl, i, s, &t);
+        }
+      }
+    }
+  }
+  return t;
+}
+
+// Upsizes all at once, with no upsize in progress
+static void libfilter_taffy_cuckoo_upsize_now(libfilter_taffy_cuckoo* here, int threads) {
+  const uint64_t start = libfilter_taffy_cuckoo_stats_nanos();
+  libfilter_taffy_cuckoo t = libfilter_taffy_cuckoo_upsized(here, threads);
+  // using std::swap;
+  libfilter_taffy_cuckoo_swap(here, &t);
+  libfilter_taffy_cuckoo_destruct(&t);
+  libfilter_taffy_cuckoo_stats_upsize(here, 1, start);
+}
+
+// The state of an in-place upsize. The sides have already doubled in size, but the
+// entries in the first half of each side that are not yet moved are still where they
+// were in the smaller filter, in the old coordinates. They are marked in "unmoved", one
+// bit per slot. Entries that have been taken out of the first half, but not yet inserted
+// in the new coordinates, wait in "pending".
+typedef struct {
+  // A shallow copy of the filter before the upsize. Only its hash functions and
+  // log_side_size are used.
+  libfilter_taffy_cuckoo old;
+  uint64_t* unmoved[2];
+  libfilter_taffy_cuckoo_path* pending;
+  size_t pending_size;
+  size_t pending_capacity;
+} libfilter_taffy_cuckoo_grower;
+
+// Callers make room first, with libfilter_taffy_cuckoo_grow_reserve, since the upsize
+// can't be undone by then
+static void libfilter_taffy_cuckoo_emit_pending(void* context,
+                                                libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_grower* g = (libfilter_taffy_cuckoo_grower*)context;
+  assert(g->pending_size < g->pending_capacity);
+  g->pending[g->pending_size++] = p;
+}
+
+// Makes room in pending for the two paths one entry can become. Returns false if the
+// memory can't be had.
+static bool libfilter_taffy_cuckoo_grow_reserve(libfilter_taffy_cuckoo_grower* g) {
+  if (g->pending_size + 2 <= g->pending_capacity) return true;
+  libfilter_taffy_cuckoo_path* pending = (libfilter_taffy_cuckoo_path*)realloc(
+      g->pending, 2 * g->pending_capacity * sizeof(libfilter_taffy_cuckoo_path));
+  if (pending == NULL) return false;
+  g->pending = pending;
+  g->pending_capacity *= 2;
+  return true;
+}
+
+INLINE bool libfilter_taffy_cuckoo_grow_unmoved(const libfilter_taffy_cuckoo_grower* g,
+                                                int s, uint64_t i, int j) {
+  if (i >> g->old.log_side_size) return false;
+  const uint64_t bit = i * libfilter_slots + j;
+  return (g->unmoved[s][bit / 64] >> (bit % 64)) & 1;
+}
+
+// Takes the unmoved entry in slot j of bucket i of side s out of the table and adds the
+// paths it becomes to pending
+static void libfilter_taffy_cuckoo_grow_take(libfilter_taffy_cuckoo* here,
+                                             libfilter_taffy_cuckoo_grower* g, int s,
+                                             uint64_t i, int j) {
+  const uint64_t bit = i * libfilter_slots + j;
+  g->unmoved[s][bit / 64] &= ~(1ul << (bit % 64));
+  const libfilter_taffy_cuckoo_slot sl = here->sides[s].data[i].data[j];
+  here->sides[s].data[i].data[j].tail = 0;
+  UpsizeEmit(&g->old, sl, i, s, here, libfilter_taffy_cuckoo_emit_pending, g);
+}
+
+// libfilter_taffy_cuckoo_side_insert, but an unmoved entry is only compared against
+// when there is no empty slot, and then it is taken out to make room, rather than
+// kicking an entry in the new coordinates. Taking out only one entry at a time keeps
+// pending short: taking out whole buckets would add more entries to pending than each
+// insert removes until most of the buckets were empty. If pending can't grow, the entry
+// goes in the stash instead.
+static libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_grow_side_insert(
+    libfilter_taffy_cuckoo* here, libfilter_taffy_cuckoo_grower* g, int s,
+    libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_bucket* b = &here->sides[s].data[p.bucket];
+  int unmoved = -1;
+  for (int j = 0; j < libfilter_slots; ++j) {
+    if (libfilter_taffy_cuckoo_grow_unmoved(g, s, p.bucket, j)) {
+      unmoved = j;
+      continue;
+    }
+    if (b->data[j].tail == 0) {
+      b->data[j] = p.slot;
+      p.slot.tail = 0;
+      return p;
+    }
+    if (b->data[j].fingerprint == p.slot.fingerprint &&
+        libfilter_taffy_is_prefix_of(b->data[j].tail, p.slot.tail)) {
+      return p;
+    }
+  }
+  if (unmoved >= 0) {
+    if (!libfilter_taffy_cuckoo_grow_reserve(g)) {
+      libfilter_taffy_cuckoo_stash_add(&here->sides[s], p, here->log_side_size);
+      p.slot.tail = 0;
+      return p;
+    }
+    libfilter_taffy_cuckoo_grow_take(here, g, s, p.bucket, unmoved);
+    b->data[unmoved] = p.slot;
+    p.slot.tail = 0;
+    return p;
+  }
+  const int j = libfilter_pcg_random_get(&here->rng);
+  libfilter_taffy_cuckoo_path result = p;
+  result.slot = b->data[j];
+  b->data[j] = p.slot;
+  return result;
+}
+
+// libfilter_taffy_cuckoo_insert_side_path_ttl from the left side, using
+// libfilter_taffy_cuckoo_grow_side_insert
+static void libfilter_taffy_cuckoo_grow_insert(libfilter_taffy_cuckoo* here,
+                                               libfilter_taffy_cuckoo_grower* g,
+                                               libfilter_taffy_cuckoo_path p) {
+  int ttl = here->policy.ttl;
+  while (true) {
+    for (int i = 0; i < 2; ++i) {
+      libfilter_taffy_cuckoo_path q = p;
+      p = libfilter_taffy_cuckoo_grow_side_insert(here, g, i, p);
+      if (p.slot.tail == 0) {
+        ++here->occupied;
+        return;
+      }
+      if (libfilter_taffy_cuckoo_path_equal(p, q)) return;
+      if (ttl <= 0) {
+        libfilter_taffy_cuckoo_stash_add(&here->sides[i], p, here->log_side_size);
+        ++here->occupied;
+        return;
+      }
+      --ttl;
+      const uint64_t tail = p.slot.tail;
+      p = libfilter_taffy_cuckoo_to_path(
+          libfilter_taffy_cuckoo_from_path_no_tail(p, &here->sides[i].f,
+                                                   here->log_side_size),
+          &here->sides[1 - i].f, here->log_side_size);
+      p.slot.tail = tail;
+    }
+  }
+}
+
+static void libfilter_taffy_cuckoo_grow_drain(libfilter_taffy_cuckoo* here,
+                                              libfilter_taffy_cuckoo_grower* g) {
+  while (g->pending_size > 0) {
+    libfilter_taffy_cuckoo_grow_insert(here, g, g->pending[--g->pending_size]);
+  }
+}
+
+// Upsizes with no upsize in progress, reallocating the buckets rather than building a
+// new filter. The unmoved entries are taken out of the table one at a time and inserted
+// in the new coordinates. An entry in the old coordinates is never kicked or mistaken
+// for one in the new coordinates. Returns false, leaving the filter as it was, if the
+// memory for the larger buckets can't be had.
+static bool libfilter_taffy_cuckoo_upsize_in_place(libfilter_taffy_cuckoo* here) {
+  const uint64_t start = libfilter_taffy_cuckoo_stats_nanos();
+  libfilter_taffy_cuckoo_grower g;
+  g.old = *here;
+  // Room for the stashes, each entry of which can become two, and for one entry taken
+  // out of the table. This is all allocated before anything changes.
+  g.pending_size = 0;
+  g.pending_capacity = 2 * (here->sides[0].stash_size + here->sides[1].stash_size) + 16;
+  g.pending = (libfilter_taffy_cuckoo_path*)malloc(g.pending_capacity *
+                                                   sizeof(libfilter_taffy_cuckoo_path));
+  const uint64_t n = 1ul << here->log_side_size;
+  const uint64_t bytes = n * sizeof(libfilter_taffy_cuckoo_bucket);
+  for (int s = 0; s < 2; ++s) {
+    g.unmoved[s] = (uint64_t*)calloc(
+        1, libfilter_overflow_bytes(here->log_side_size + libfilter_log_slots));
+  }
+  void* data[2] = {here->sides[0].data, here->sides[1].data};
+  if (g.pending == NULL || g.unmoved[0] == NULL || g.unmoved[1] == NULL ||
+      !libfilter_huge_grow_both(data, bytes, 2 * bytes)) {
+    here->sides[0].data = (libfilter_taffy_cuckoo_bucket*)data[0];
+    free(g.unmoved[0]);
+    free(g.unmoved[1]);
+    free(g.pending);
+    return false;
+  }
+  for (int s = 0; s < 2; ++s) {
+    here->sides[s].data = (libfilter_taffy_cuckoo_bucket*)data[s];
+    memset(&here->sides[s].data[n], 0, bytes);
   }
+  for (int s = 0; s < 2; ++s) {
+    const libfilter_taffy_cuckoo_bucket* buckets = here->sides[s].data;
+    for (uint64_t i = 0; i < n; ++i) {
+      for (int j = 0; j < libfilter_slots; ++j) {
+        const uint64_t bit = i * libfilter_slots + j;
+        g.unmoved[s][bit / 64] |= (uint64_t)(buckets[i].data[j].tail != 0) << (bit % 64);
+      }
+    }
+  }
+  ++here->log_side_size;
+  here->occupied = 0;
+  // The stashes are indexed by bucket, so they are rebuilt from scratch
+  for (int s = 0; s < 2; ++s) {
+    libfilter_taffy_cuckoo_side* side = &here->sides[s];
+    for (size_t i = 0; i < side->stash_capacity; ++i) {
+      if (side->stash[i].slot.tail == 0) continue;
+      UpsizeEmit(&g.old, side->stash[i].slot, side->stash[i].bucket, s, here,
+                 libfilter_taffy_cuckoo_emit_pending, &g);
+    }
+    memset(side->stash, 0, side->stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    side->stash_size = 0;
+    libfilter_huge_free(side->overflow,
+                        libfilter_overflow_bytes(here->log_side_size - 1));
+    side->overflow = NULL;
+  }
+  libfilter_taffy_cuckoo_grow_drain(here, &g);
+  for (int s = 0; s < 2; ++s) {
+    for (uint64_t i = 0; i < n; ++i) {
+      for (int j = 0; j < libfilter_slots; ++j) {
+        if (!libfilter_taffy_cuckoo_grow_unmoved(&g, s, i, j)) continue;
+        libfilter_taffy_cuckoo_grow_take(here, &g, s, i, j);
+        libfilter_taffy_cuckoo_grow_drain(here, &g);
+      }
+    }
+  }
+  free(g.unmoved[0]);
+  free(g.unmoved[1]);
+  free(g.pending);
+  libfilter_taffy_cuckoo_stats_upsize(here, 1, start);
+  return true;
 }
 
 void libfilter_taffy_cuckoo_upsize(libfilter_taffy_cuckoo* here) {
+  // Only one upsize can be in progress at a time. This is only expensive if inserts
+  // fill the larger table before migration completes.
+  libfilter_taffy_cuckoo_finish_upsize(here);
+  if (here->migrate_per_insert == 0) {
+    if (here->in_place_upsize && !here->borrowed) {
+      libfilter_taffy_cuckoo_upsize_in_place(here);
+    } else {
+      libfilter_taffy_cuckoo_upsize_now(here, here->upsize_threads);
+    }
+    return;
+  }
+  const uint64_t start = libfilter_taffy_cuckoo_stats_nanos();
   libfilter_taffy_cuckoo t =
       libfilter_taffy_cuckoo_create(1 + here->log_side_size, here->entropy);
+  t.migrate_per_insert = here->migrate_per_insert;
+  t.upsize_threads = here->upsize_threads;
+  t.bfs_insert = here->bfs_insert;
+  t.in_place_upsize = here->in_place_upsize;
+  t.policy = here->policy;
+  t.stats = here->stats;
+  libfilter_taffy_cuckoo* old =
+      (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+  *old = *here;
+  *here = t;
+  here->migrating_from = old;
+  here->migrate_cursor = 0;
+  // The stashes are small, so move them now. Then only buckets need migrating.
+  for (int s = 0; s < 2; ++s) {
+    libfilter_taffy_cuckoo_side* side = &old->sides[s];
+    for (size_t i = 0; i < side->stash_capacity; ++i) {
+      if (side->stash[i].slot.tail == 0) continue;
+      UpsizeHelper(old, side->stash[i].slot, side->stash[i].bucket, s, here);
+    }
+    memset(side->stash, 0, side->stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    side->stash_size = 0;
+  }
+  libfilter_taffy_cuckoo_stats_upsize(here, 1, start);
+}
 
+void libfilter_taffy_cuckoo_downsize(libfilter_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo_finish_upsize(here);
+  if (here->log_side_size <= 1) return;
+  libfilter_taffy_cuckoo t =
+      libfilter_taffy_cuckoo_create(here->log_side_size - 1, here->entropy);
+  t.migrate_per_insert = here->migrate_per_insert;
+  t.upsize_threads = here->upsize_threads;
+  t.bfs_insert = here->bfs_insert;
+  t.in_place_upsize = here->in_place_upsize;
+  t.policy = here->policy;
+  t.stats = here->stats;
   for (int s = 0; s < 2; ++s) {
-    for (size_t i = 0; i < here->sides[s].stash_size; ++i) {
-      UpsizeHelper(here, here->sides[s].stash[i].slot, here->sides[s].stash[i].bucket, s,
-                   &t);
+    for (size_t i = 0; i < here->sides[s].stash_capacity; ++i) {
+      if (here->sides[s].stash[i].slot.tail == 0) continue;
+      DownsizeEmit(here, here->sides[s].stash[i].slot, here->sides[s].stash[i].bucket, s,
+                   &t, libfilter_taffy_cuckoo_emit_insert, &t);
     }
-    for (unsigned i = 0; i < (1u << here->log_side_size); ++i) {
+    for (uint64_t i = 0; i < (1ul << here->log_side_size); ++i) {
       for (int j = 0; j < libfilter_slots; ++j) {
-        libfilter_taffy_cuckoo_slot sl = here->sides[s].data[i].data[j];
-        UpsizeHelper(here, sl, i, s, &t);
+        DownsizeEmit(here, here->sides[s].data[i].data[j], i, s, &t,
+                     libfilter_taffy_cuckoo_emit_insert, &t);
       }
     }
   }
-  // using std::swap;
   libfilter_taffy_cuckoo_swap(here, &t);
   libfilter_taffy_cuckoo_destruct(&t);
 }
 
-static void libfilter_taffy_cuckoo_union_help(libfilter_taffy_cuckoo* here,
-                                              const libfilter_taffy_cuckoo* that,
-                                              int side, libfilter_taffy_cuckoo_path p) {
-  uint64_t hashed = libfilter_taffy_cuckoo_from_path_no_tail(p, &that->sides[side].f,
-                                                             that->log_side_size);
-  // hashed is high that->log_side_size + libfilter_taffy_cuckoo_head_size, in high bits
-  // of 64-bit word
-  int tail_size = libfilter_taffy_cuckoo_tail_size - __builtin_ctz(p.slot.tail);
-  if (that->log_side_size == here->log_side_size) {
-    libfilter_taffy_cuckoo_path q =
-        libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
-    q.slot.tail = p.slot.tail;
-    libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
-    q.slot.tail = 0;  // dummy line just to break on
-  } else if (that->log_side_size + tail_size >= here->log_side_size) {
-    uint64_t orin3 = (((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
-                      << (64 - that->log_side_size - libfilter_taffy_cuckoo_head_size -
-                          libfilter_taffy_cuckoo_tail_size - 1));
-    assert((hashed & orin3) == 0);
-    hashed |= orin3;
-    libfilter_taffy_cuckoo_path q =
-        libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
-    q.slot.tail = (p.slot.tail << (here->log_side_size - that->log_side_size));
-    libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
-  } else {
-    // p.tail & (p.tail - 1) removes the final 1 marker. The resulting length is
-    // 0, 1, 2, 3, 4, or 5. It is also tail_size, but is packed in high bits of a
-    // section with size libfilter_taffy_cuckoo_tail_size + 1.
-    uint64_t orin2 = (((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
-                      << (64 - that->log_side_size - libfilter_taffy_cuckoo_head_size -
-                          libfilter_taffy_cuckoo_tail_size - 1));
-    assert(0 == (orin2 & hashed));
-    hashed |= orin2;
-    // The total size is now that->log_side_size + libfilter_taffy_cuckoo_head_size +
-    // tail_size
-    //
-    // To fill up the required log_size_size + libfilter_taffy_cuckoo_head_size, we need
-    // values of width up to log_size_size + libfilter_taffy_cuckoo_head_size -
-    // (that->log_side_size + libfilter_taffy_cuckoo_head_size + tail_size)
-    for (uint64_t i = 0;
-         i < (1u << (here->log_side_size - that->log_side_size - tail_size)); ++i) {
-      // To append these, need to shift up to that->log_side_size +
-      // libfilter_taffy_cuckoo_head_size + tail_size
-      uint64_t orin =
-          (i << (64 - here->log_side_size - libfilter_taffy_cuckoo_head_size));
-      assert(0 == (orin & hashed));
-      uint64_t tmphashed = (hashed | orin);
-      libfilter_taffy_cuckoo_path q = libfilter_taffy_cuckoo_to_path(
-          tmphashed, &here->sides[0].f, here->log_side_size);
-      q.slot.tail = (1u << libfilter_taffy_cuckoo_tail_size);
-      libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
+// Deletes entry i of the stash, moving later entries in the same run back if that
+// shortens their probe sequences, so that every entry can still be reached from its
+// bucket with no empty entry in the way
+static void libfilter_taffy_cuckoo_stash_remove(libfilter_taffy_cuckoo_side* here,
+                                                size_t i) {
+  const size_t mask = here->stash_capacity - 1;
+  for (size_t j = (i + 1) & mask; here->stash[j].slot.tail != 0; j = (j + 1) & mask) {
+    const size_t home = here->stash[j].bucket & mask;
+    // i is cyclically in [home, j), so j can move back to it
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      here->stash[i] = here->stash[j];
+      i = j;
     }
   }
+  memset(&here->stash[i], 0, sizeof(here->stash[i]));
+  --here->stash_size;
 }
 
-static void libfilter_taffy_cuckoo_union_one(libfilter_taffy_cuckoo* here,
-                                             const libfilter_taffy_cuckoo* that) {
-  assert(that->log_side_size <= here->log_side_size);
-  libfilter_taffy_cuckoo_path p;
-  for (int side = 0; side < 2; ++side) {
-    for (size_t i = 0; i < that->sides[side].stash_size; ++i) {
-      libfilter_taffy_cuckoo_union_help(here, that, side, that->sides[side].stash[i]);
+// Removes an entry for k from the sides of here, not migrating_from
+static bool libfilter_taffy_cuckoo_remove_hash_sides(libfilter_taffy_cuckoo* here,
+                                                     uint64_t k) {
+  // The matching entry with the longest tail: either a slot, or, if slot is NULL, entry
+  // stash_index in the stash of side stash_side.
+  libfilter_taffy_cuckoo_slot* slot = NULL;
+  int stash_side = -1;
+  size_t stash_index = 0;
+  int longest = -1;
+  for (int s = 0; s < 2; ++s) {
+    libfilter_taffy_cuckoo_side* side = &here->sides[s];
+    libfilter_taffy_cuckoo_path p =
+        libfilter_taffy_cuckoo_to_path(k, &side->f, here->log_side_size);
+    libfilter_taffy_cuckoo_bucket* b = &side->data[p.bucket];
+    for (int j = 0; j < libfilter_slots; ++j) {
+      if (b->data[j].tail == 0 || b->data[j].fingerprint != p.slot.fingerprint ||
+          !libfilter_taffy_is_prefix_of(b->data[j].tail, p.slot.tail)) {
+        continue;
+      }
+      const int length =
+          libfilter_taffy_cuckoo_tail_size - __builtin_ctz(b->data[j].tail);
+      if (length > longest) {
+        longest = length;
+        slot = &b->data[j];
+      }
     }
-    for (uint64_t bucket = 0; bucket < (1ul << that->log_side_size); ++bucket) {
-      p.bucket = bucket;
-      for (int slot = 0; slot < libfilter_slots; ++slot) {
-        if (that->sides[side].data[bucket].data[slot].tail == 0) continue;
-        p.slot.fingerprint = that->sides[side].data[bucket].data[slot].fingerprint;
-        p.slot.tail = that->sides[side].data[bucket].data[slot].tail;
-        libfilter_taffy_cuckoo_union_help(here, that, side, p);
+    if (side->overflow == NULL || !libfilter_overflow_get(side->overflow, p.bucket)) {
+      continue;
+    }
+    const size_t mask = side->stash_capacity - 1;
+    for (size_t i = p.bucket & mask; side->stash[i].slot.tail != 0; i = (i + 1) & mask) {
+      const libfilter_taffy_cuckoo_slot x = side->stash[i].slot;
+      if (side->stash[i].bucket != p.bucket || x.fingerprint != p.slot.fingerprint ||
+          !libfilter_taffy_is_prefix_of(x.tail, p.slot.tail)) {
         continue;
       }
+      const int length = libfilter_taffy_cuckoo_tail_size - __builtin_ctz(x.tail);
+      if (length > longest) {
+        longest = length;
+        slot = NULL;
+        stash_side = s;
+        stash_index = i;
+      }
     }
   }
+  if (longest < 0) return false;
+  if (slot != NULL) {
+    slot->tail = 0;
+  } else {
+    libfilter_taffy_cuckoo_stash_remove(&here->sides[stash_side], stash_index);
+  }
+  --here->occupied;
+  return true;
 }
 
-libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo* x,
-                                                    const libfilter_taffy_cuckoo* y) {
-  if (x->occupied > y->occupied) {
-    libfilter_taffy_cuckoo result;
-    libfilter_taffy_cuckoo_clone(x, &result);
-    libfilter_taffy_cuckoo_union_one(&result, y);
-    return result;
+bool libfilter_taffy_cuckoo_remove_hash(libfilter_taffy_cuckoo* here, uint64_t k) {
+  // As in libfilter_taffy_cuckoo_add_hash, so that a filter that is only being emptied
+  // still finishes its upsize and can then downsize
+  if (here->migrating_from != NULL) {
+    libfilter_taffy_cuckoo_migrate(here, here->migrate_per_insert);
   }
-  libfilter_taffy_cuckoo result;
-  libfilter_taffy_cuckoo_clone(y, &result);
-  libfilter_taffy_cuckoo_union_one(&result, x);
-  return result;
+  if (!libfilter_taffy_cuckoo_remove_hash_sides(here, k)) {
+    // Mid-upsize, the entry might not have been migrated yet
+    return here->migrating_from != NULL &&
+           libfilter_taffy_cuckoo_remove_hash_sides(here->migrating_from, k);
+  }
+  // Well below the 45% load that an upsize leaves, so removes and adds near the
+  // threshold don't keep resizing the filter
+  if (here->migrating_from == NULL &&
+      here->occupied < libfilter_taffy_cuckoo_capacity(here) / 4) {
+    libfilter_taffy_cuckoo_downsize(here);
+  }
+  return true;
+}
+
+void libfilter_taffy_cuckoo_upsize_parallel(libfilter_taffy_cuckoo* here, int threads) {
+  libfilter_taffy_cuckoo_finish_upsize(here);
+  libfilter_taffy_cuckoo_upsize_now(here, threads);
+}
+
+void libfilter_taffy_cuckoo_set_upsize_threads(libfilter_taffy_cuckoo* here,
+                                               int threads) {
+  here->upsize_threads = threads;
+}
+
+void libfilter_taffy_cuckoo_set_bfs_insert(libfilter_taffy_cuckoo* here, bool bfs) {
+  here->bfs_insert = bfs;
+}
+
+void libfilter_taffy_cuckoo_set_in_place_upsize(libfilter_taffy_cuckoo* here,
+                                                bool in_place) {
+  here->in_place_upsize = in_place;
+}
+
+void libfilter_taffy_cuckoo_set_policy(libfilter_taffy_cuckoo* here,
+                                       libfilter_taffy_cuckoo_policy policy) {
+  // Inserts must grow the filter when it is too full, or they would never end
+  if (policy.growth_steps < 1) policy.growth_steps = 1;
+  // and no amount of growth gets the load under a max_load of 0. Written so that NaN is
+  // clamped too.
+  if (!(policy.max_load >= 0.01)) policy.max_load = 0.01;
+  if (policy.max_load > 1.0) policy.max_load = 1.0;
+  here->policy = policy;
+}
+
+// A bucket reached in the breadth-first search for an empty slot. It is reached by
+// evicting slot "slot" of the bucket of node "parent", which held "moved" when it was
+// read, or it is one of the two buckets of the path being inserted, in which case parent
+// is -1.
+typedef struct {
+  uint64_t bucket;
+  int side;
+  int parent;
+  int slot;
+  int depth;
+  libfilter_taffy_cuckoo_slot moved;
+} libfilter_taffy_cuckoo_bfs_node;
+
+// The most buckets the search reads, and the longest chain of evictions it considers.
+// These are about what libcuckoo uses.
+enum { kTaffyCuckooBfsNodes = 256, kTaffyCuckooBfsDepth = 5 };
+
+// Reads a bucket with a single 8-byte load, so that it is never seen half-written by a
+// libfilter_concurrent_taffy_cuckoo writer
+static INLINE libfilter_taffy_cuckoo_bucket libfilter_taffy_cuckoo_bucket_load(
+    const libfilter_taffy_cuckoo_bucket* b) {
+  const uint64_t w = __atomic_load_n((const uint64_t*)b, __ATOMIC_RELAXED);
+  libfilter_taffy_cuckoo_bucket result;
+  memcpy(&result, &w, sizeof(result));
+  return result;
+}
+
+static INLINE void libfilter_taffy_cuckoo_bucket_store(libfilter_taffy_cuckoo_bucket* b,
+                                                       libfilter_taffy_cuckoo_bucket x) {
+  uint64_t w;
+  memcpy(&w, &x, sizeof(w));
+  __atomic_store_n((uint64_t*)b, w, __ATOMIC_RELAXED);
+}
+
+// Returns the index of an empty slot in b, or -1 if there is none
+static INLINE int libfilter_taffy_cuckoo_empty_slot(const libfilter_taffy_cuckoo_bucket* b) {
+  for (int i = 0; i < libfilter_slots; ++i) {
+    if (b->data[i].tail == 0) return i;
+  }
+  return -1;
+}
+
+// The path on side 1 - s for the same value as p on side s
+static INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_other_side(
+    const libfilter_taffy_cuckoo* here, int s, libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_path result = libfilter_taffy_cuckoo_to_path(
+      libfilter_taffy_cuckoo_from_path_no_tail(p, &here->sides[s].f, here->log_side_size),
+      &here->sides[1 - s].f, here->log_side_size);
+  result.slot.tail = p.slot.tail;
+  return result;
+}
+
+// True if bucket on side is node i or one of its ancestors, so evicting into it would
+// disturb the chain being built
+static INLINE bool libfilter_taffy_cuckoo_bfs_on_chain(
+    const libfilter_taffy_cuckoo_bfs_node* nodes, int i, int side, uint64_t bucket) {
+  for (; i >= 0; i = nodes[i].parent) {
+    if (nodes[i].side == side && nodes[i].bucket == bucket) return true;
+  }
+  return false;
+}
+
+// Searches breadth-first from the two roots already in nodes for a chain of evictions
+// that ends in an empty slot. Returns the last node of the chain and sets *empty to the
+// empty slot in its bucket, or returns -1 if there is no such chain. Only reads here.
+static int libfilter_taffy_cuckoo_bfs_search(const libfilter_taffy_cuckoo* here,
+                                             libfilter_taffy_cuckoo_bfs_node* nodes,
+                                             int* empty) {
+  int size = 2;
+  for (int i = 0; i < size; ++i) {
+    libfilter_taffy_cuckoo_bfs_node n = nodes[i];
+    if (n.depth == kTaffyCuckooBfsDepth) continue;
+    const libfilter_taffy_cuckoo_bucket b =
+        libfilter_taffy_cuckoo_bucket_load(&here->sides[n.side].data[n.bucket]);
+    for (int j = 0; j < libfilter_slots && size < kTaffyCuckooBfsNodes; ++j) {
+      if (b.data[j].tail == 0) continue;
+      libfilter_taffy_cuckoo_path q = {b.data[j], n.bucket};
+      q = libfilter_taffy_cuckoo_other_side(here, n.side, q);
+      if (libfilter_taffy_cuckoo_bfs_on_chain(nodes, i, 1 - n.side, q.bucket)) continue;
+      libfilter_taffy_cuckoo_bfs_node child = {q.bucket, 1 - n.side, i,
+                                               j,        n.depth + 1, b.data[j]};
+      nodes[size] = child;
+      const libfilter_taffy_cuckoo_bucket c =
+          libfilter_taffy_cuckoo_bucket_load(&here->sides[child.side].data[q.bucket]);
+      *empty = libfilter_taffy_cuckoo_empty_slot(&c);
+      if (*empty >= 0) return size;
+      ++size;
+    }
+  }
+  return -1;
+}
+
+bool libfilter_taffy_cuckoo_insert_side_path_bfs(libfilter_taffy_cuckoo* here, int s,
+                                                 libfilter_taffy_cuckoo_path p) {
+  assert(p.slot.tail != 0);
+  // First, as in libfilter_taffy_cuckoo_side_insert, look for an empty slot or a match
+  // in each bucket. The path on the other side is only needed if the first is full.
+  libfilter_taffy_cuckoo_path roots[2] = {p, p};
+  for (int i = 0; i < 2; ++i) {
+    if (i == 1) roots[1] = libfilter_taffy_cuckoo_other_side(here, s, p);
+    libfilter_taffy_cuckoo_bucket* b = &here->sides[s ^ i].data[roots[i].bucket];
+    for (int j = 0; j < libfilter_slots; ++j) {
+      if (b->data[j].tail == 0) {
+        b->data[j] = roots[i].slot;
+        ++here->occupied;
+        libfilter_taffy_cuckoo_stats_chain(&here->stats, 0);
+        return true;
+      }
+      if (b->data[j].fingerprint == roots[i].slot.fingerprint &&
+          libfilter_taffy_is_prefix_of(b->data[j].tail, roots[i].slot.tail)) {
+        libfilter_taffy_cuckoo_stats_chain(&here->stats, 0);
+        return true;
+      }
+    }
+  }
+  libfilter_taffy_cuckoo_bfs_node nodes[kTaffyCuckooBfsNodes] = {
+      {roots[0].bucket, s, -1, -1, 0, {0, 0}},
+      {roots[1].bucket, 1 - s, -1, -1, 0, {0, 0}}};
+  int empty = -1;
+  const int found = libfilter_taffy_cuckoo_bfs_search(here, nodes, &empty);
+  if (found < 0) {
+    return libfilter_taffy_cuckoo_insert_side_path_ttl(here, s, p, here->policy.ttl);
+  }
+  // Move the slots along the chain, starting from the end, so that each move is into a
+  // slot that was just vacated.
+  int i = found;
+  for (; nodes[i].parent >= 0; i = nodes[i].parent) {
+    const libfilter_taffy_cuckoo_bfs_node* parent = &nodes[nodes[i].parent];
+    libfilter_taffy_cuckoo_path q = {nodes[i].moved, parent->bucket};
+    q = libfilter_taffy_cuckoo_other_side(here, parent->side, q);
+    here->sides[nodes[i].side].data[nodes[i].bucket].data[empty] = q.slot;
+    empty = nodes[i].slot;
+  }
+  // i is now a root, and roots[i] is the path being inserted, on side s ^ i
+  here->sides[nodes[i].side].data[nodes[i].bucket].data[empty] = roots[i].slot;
+  ++here->occupied;
+  libfilter_taffy_cuckoo_stats_chain(&here->stats, nodes[found].depth);
+  return true;
+}
+
+// libfilter_concurrent_taffy_cuckoo. Each bucket is covered by the stripe at its index,
+// modulo the number of stripes, on both sides. Every change to a bucket is made with the
+// lock of its stripe held and is bracketed by two increments of the stripe's version.
+// Upsizes and stash changes also need a stripe lock, and inserts check that the table
+// has not been replaced after taking one.
+
+enum {
+  kConcurrentTaffyCuckooDone,
+  // The entry was added, but the table should be upsized
+  kConcurrentTaffyCuckooFull,
+  // The table changed underneath the insert, which must start over
+  kConcurrentTaffyCuckooRetry,
+  // The entry was not added, since the stash has no room for it. The table should be
+  // upsized and the insert started over.
+  kConcurrentTaffyCuckooStashFull
+};
+
+// One less than the number of stripes used by a table with the given log_side_size
+static INLINE uint64_t libfilter_concurrent_taffy_cuckoo_stripe_mask(int log_side_size) {
+  const uint64_t buckets = 1ul << log_side_size;
+  return ((buckets < libfilter_taffy_cuckoo_stripes) ? buckets
+                                                     : libfilter_taffy_cuckoo_stripes) -
+         1;
+}
+
+static void libfilter_spin_lock(uint32_t* lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    // Upsizes hold the locks for a long time, so give up the CPU rather than spin
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED)) sched_yield();
+  }
+}
+
+static void libfilter_spin_unlock(uint32_t* lock) {
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// Locks stripes i and j, lowest first, so that inserts can't deadlock
+static void libfilter_concurrent_taffy_cuckoo_lock_pair(
+    libfilter_taffy_cuckoo_stripe* stripes, uint64_t i, uint64_t j) {
+  if (i > j) {
+    const uint64_t tmp = i;
+    i = j;
+    j = tmp;
+  }
+  libfilter_spin_lock(&stripes[i].lock);
+  if (j != i) libfilter_spin_lock(&stripes[j].lock);
+}
+
+static void libfilter_concurrent_taffy_cuckoo_unlock_pair(
+    libfilter_taffy_cuckoo_stripe* stripes, uint64_t i, uint64_t j) {
+  if (j != i) libfilter_spin_unlock(&stripes[j].lock);
+  libfilter_spin_unlock(&stripes[i].lock);
+}
+
+// Marks the beginning of a change to the buckets covered by s, which must be locked.
+// Finds that read the version before libfilter_concurrent_taffy_cuckoo_end_write will
+// retry.
+static void libfilter_concurrent_taffy_cuckoo_begin_write(
+    libfilter_taffy_cuckoo_stripe* s) {
+  __atomic_store_n(&s->version, s->version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void libfilter_concurrent_taffy_cuckoo_end_write(
+    libfilter_taffy_cuckoo_stripe* s) {
+  __atomic_store_n(&s->version, s->version + 1, __ATOMIC_RELEASE);
+}
+
+static void libfilter_concurrent_taffy_cuckoo_add_occupied(
+    libfilter_taffy_cuckoo_stripe* s, int64_t n) {
+  __atomic_store_n(&s->occupied, s->occupied + n, __ATOMIC_RELAXED);
+}
+
+// Counts a new entry in stripe i of t, which must be locked. Returns true if t is full
+// enough to upsize.
+static bool libfilter_concurrent_taffy_cuckoo_count(
+    libfilter_concurrent_taffy_cuckoo* here, const libfilter_taffy_cuckoo* t,
+    uint64_t i) {
+  libfilter_taffy_cuckoo_stripe* stripes = here->stripes;
+  const uint64_t mask = libfilter_concurrent_taffy_cuckoo_stripe_mask(t->log_side_size);
+  libfilter_concurrent_taffy_cuckoo_add_occupied(&stripes[i], 1);
+  const uint64_t occupied = stripes[i].occupied;
+  // The same limit as libfilter_taffy_cuckoo_add_hash, from the table's policy. Summing
+  // the stripes is slow, so it is only done now and then, once this stripe is over its
+  // share.
+  const double limit = t->policy.max_load * libfilter_taffy_cuckoo_capacity(t);
+  if (occupied <= limit / (mask + 1) || occupied % 8 != 0) return false;
+  uint64_t total = 0;
+  for (uint64_t j = 0; j <= mask; ++j) {
+    total += __atomic_load_n(&stripes[j].occupied, __ATOMIC_RELAXED);
+  }
+  return total > limit;
+}
+
+static bool libfilter_concurrent_taffy_cuckoo_is_current(
+    const libfilter_concurrent_taffy_cuckoo* here, const libfilter_taffy_cuckoo* t) {
+  return __atomic_load_n(&here->table, __ATOMIC_RELAXED) == t;
+}
+
+// The stash of a published table is never grown, so its entries never move and are only
+// ever filled in, never cleared. An entry is published by storing its slot, which holds
+// the tail, with release semantics after its bucket, and finds load the slot with acquire
+// semantics before the bucket.
+static INLINE libfilter_taffy_cuckoo_slot libfilter_taffy_cuckoo_slot_load(
+    const libfilter_taffy_cuckoo_slot* x) {
+  const uint16_t w = __atomic_load_n((const uint16_t*)x, __ATOMIC_ACQUIRE);
+  libfilter_taffy_cuckoo_slot result;
+  memcpy(&result, &w, sizeof(result));
+  return result;
+}
+
+static INLINE void libfilter_taffy_cuckoo_slot_store(libfilter_taffy_cuckoo_slot* x,
+                                                     libfilter_taffy_cuckoo_slot y) {
+  uint16_t w;
+  memcpy(&w, &y, sizeof(w));
+  __atomic_store_n((uint16_t*)x, w, __ATOMIC_RELEASE);
+}
+
+// libfilter_taffy_cuckoo_stash_add, for a side that finds might be reading. There must be
+// room for p without growing the stash.
+static void libfilter_concurrent_taffy_cuckoo_stash_add(libfilter_taffy_cuckoo_side* here,
+                                                        libfilter_taffy_cuckoo_path p,
+                                                        int log_side_size) {
+  // Finds read the overflow bitmap without the stash lock
+  if (here->overflow == NULL) {
+    uint64_t* overflow =
+        (uint64_t*)libfilter_huge_calloc(libfilter_overflow_bytes(log_side_size));
+    __atomic_store_n(&here->overflow, overflow, __ATOMIC_RELEASE);
+  }
+  const size_t mask = here->stash_capacity - 1;
+  size_t i = p.bucket & mask;
+  while (here->stash[i].slot.tail != 0) i = (i + 1) & mask;
+  __atomic_store_n(&here->stash[i].bucket, p.bucket, __ATOMIC_RELAXED);
+  libfilter_taffy_cuckoo_slot_store(&here->stash[i].slot, p.slot);
+  ++here->stash_size;
+  libfilter_overflow_set(here->overflow, p.bucket);
+}
+
+// libfilter_taffy_cuckoo_stash_find, for a side that inserts might be changing
+static bool libfilter_concurrent_taffy_cuckoo_stash_find(
+    const libfilter_taffy_cuckoo_side* here, libfilter_taffy_cuckoo_path p) {
+  const uint64_t* overflow = __atomic_load_n(&here->overflow, __ATOMIC_ACQUIRE);
+  if (overflow == NULL ||
+      !((__atomic_load_n(&overflow[p.bucket / 64], __ATOMIC_RELAXED) >> (p.bucket % 64)) &
+        1)) {
+    return false;
+  }
+  const size_t mask = here->stash_capacity - 1;
+  for (size_t i = p.bucket & mask;; i = (i + 1) & mask) {
+    const libfilter_taffy_cuckoo_slot sl =
+        libfilter_taffy_cuckoo_slot_load(&here->stash[i].slot);
+    if (sl.tail == 0) return false;
+    if (p.bucket == __atomic_load_n(&here->stash[i].bucket, __ATOMIC_RELAXED) &&
+        p.slot.fingerprint == sl.fingerprint &&
+        libfilter_taffy_is_prefix_of(sl.tail, p.slot.tail)) {
+      return true;
+    }
+  }
+}
+
+// Puts p, a path on side 0 of t, in the stash, when there is no room for it in the
+// buckets
+static int libfilter_concurrent_taffy_cuckoo_stash(
+    libfilter_concurrent_taffy_cuckoo* here, libfilter_taffy_cuckoo* t,
+    libfilter_taffy_cuckoo_path p) {
+  const uint64_t i =
+      p.bucket & libfilter_concurrent_taffy_cuckoo_stripe_mask(t->log_side_size);
+  libfilter_spin_lock(&here->stripes[i].lock);
+  if (!libfilter_concurrent_taffy_cuckoo_is_current(here, t)) {
+    libfilter_spin_unlock(&here->stripes[i].lock);
+    return kConcurrentTaffyCuckooRetry;
+  }
+  libfilter_spin_lock(&here->stash_lock);
+  libfilter_taffy_cuckoo_side* side = &t->sides[0];
+  // Growing the stash would move its entries out from under finds, so upsize instead,
+  // as libfilter_taffy_cuckoo_stash_add would grow it
+  if (2 * (side->stash_size + 1) > side->stash_capacity) {
+    libfilter_spin_unlock(&here->stash_lock);
+    libfilter_spin_unlock(&here->stripes[i].lock);
+    return kConcurrentTaffyCuckooStashFull;
+  }
+  libfilter_concurrent_taffy_cuckoo_stash_add(side, p, t->log_side_size);
+  libfilter_spin_unlock(&here->stash_lock);
+  libfilter_concurrent_taffy_cuckoo_count(here, t, i);
+  libfilter_spin_unlock(&here->stripes[i].lock);
+  return kConcurrentTaffyCuckooFull;
+}
+
+// Inserts k into t, which was here->table when the insert started. As in libcuckoo, the
+// search for a chain of evictions is done without locks. Then the chain is moved one
+// eviction at a time, with only the two buckets involved locked, checking each time that
+// no other insert has changed them since they were read.
+static int libfilter_concurrent_taffy_cuckoo_insert(libfilter_concurrent_taffy_cuckoo* here,
+                                                    libfilter_taffy_cuckoo* t, uint64_t k) {
+  libfilter_taffy_cuckoo_stripe* stripes = here->stripes;
+  const uint64_t mask = libfilter_concurrent_taffy_cuckoo_stripe_mask(t->log_side_size);
+  libfilter_taffy_cuckoo_path roots[2];
+  uint64_t r[2];
+  for (int s = 0; s < 2; ++s) {
+    roots[s] = libfilter_taffy_cuckoo_to_path(k, &t->sides[s].f, t->log_side_size);
+    r[s] = roots[s].bucket & mask;
+  }
+  libfilter_concurrent_taffy_cuckoo_lock_pair(stripes, r[0], r[1]);
+  if (!libfilter_concurrent_taffy_cuckoo_is_current(here, t)) {
+    libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, r[0], r[1]);
+    return kConcurrentTaffyCuckooRetry;
+  }
+  for (int s = 0; s < 2; ++s) {
+    libfilter_taffy_cuckoo_bucket* to = &t->sides[s].data[roots[s].bucket];
+    libfilter_taffy_cuckoo_bucket b = *to;
+    for (int j = 0; j < libfilter_slots; ++j) {
+      if (b.data[j].tail == 0) {
+        b.data[j] = roots[s].slot;
+        libfilter_concurrent_taffy_cuckoo_begin_write(&stripes[r[s]]);
+        libfilter_taffy_cuckoo_bucket_store(to, b);
+        libfilter_concurrent_taffy_cuckoo_end_write(&stripes[r[s]]);
+        const bool full = libfilter_concurrent_taffy_cuckoo_count(here, t, r[s]);
+        libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, r[0], r[1]);
+        return full ? kConcurrentTaffyCuckooFull : kConcurrentTaffyCuckooDone;
+      }
+      if (b.data[j].fingerprint == roots[s].slot.fingerprint &&
+          libfilter_taffy_is_prefix_of(b.data[j].tail, roots[s].slot.tail)) {
+        libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, r[0], r[1]);
+        return kConcurrentTaffyCuckooDone;
+      }
+    }
+  }
+  libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, r[0], r[1]);
+
+  libfilter_taffy_cuckoo_bfs_node nodes[kTaffyCuckooBfsNodes] = {
+      {roots[0].bucket, 0, -1, -1, 0, {0, 0}}, {roots[1].bucket, 1, -1, -1, 0, {0, 0}}};
+  int empty = -1;
+  int i = libfilter_taffy_cuckoo_bfs_search(t, nodes, &empty);
+  if (i < 0) return libfilter_concurrent_taffy_cuckoo_stash(here, t, roots[0]);
+  for (; nodes[i].parent >= 0; i = nodes[i].parent) {
+    const libfilter_taffy_cuckoo_bfs_node* parent = &nodes[nodes[i].parent];
+    const uint64_t from_stripe = parent->bucket & mask, to_stripe = nodes[i].bucket & mask;
+    libfilter_concurrent_taffy_cuckoo_lock_pair(stripes, from_stripe, to_stripe);
+    libfilter_taffy_cuckoo_bucket* from = &t->sides[parent->side].data[parent->bucket];
+    libfilter_taffy_cuckoo_bucket* to = &t->sides[nodes[i].side].data[nodes[i].bucket];
+    libfilter_taffy_cuckoo_bucket x = *from, y = *to;
+    const libfilter_taffy_cuckoo_slot moved = x.data[nodes[i].slot];
+    if (!libfilter_concurrent_taffy_cuckoo_is_current(here, t) ||
+        moved.tail != nodes[i].moved.tail ||
+        moved.fingerprint != nodes[i].moved.fingerprint || y.data[empty].tail != 0) {
+      // The moves already made left every entry in one of its buckets, so there is
+      // nothing to undo
+      libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, from_stripe, to_stripe);
+      return kConcurrentTaffyCuckooRetry;
+    }
+    libfilter_taffy_cuckoo_path q = {moved, parent->bucket};
+    y.data[empty] = libfilter_taffy_cuckoo_other_side(t, parent->side, q).slot;
+    x.data[nodes[i].slot].tail = 0;
+    // Both buckets change at once, as far as finds can tell, since they check the
+    // versions of both stripes.
+    libfilter_concurrent_taffy_cuckoo_begin_write(&stripes[from_stripe]);
+    if (to_stripe != from_stripe) {
+      libfilter_concurrent_taffy_cuckoo_begin_write(&stripes[to_stripe]);
+    }
+    libfilter_taffy_cuckoo_bucket_store(to, y);
+    libfilter_taffy_cuckoo_bucket_store(from, x);
+    if (to_stripe != from_stripe) {
+      libfilter_concurrent_taffy_cuckoo_end_write(&stripes[to_stripe]);
+      libfilter_concurrent_taffy_cuckoo_add_occupied(&stripes[from_stripe], -1);
+      libfilter_concurrent_taffy_cuckoo_add_occupied(&stripes[to_stripe], 1);
+    }
+    libfilter_concurrent_taffy_cuckoo_end_write(&stripes[from_stripe]);
+    libfilter_concurrent_taffy_cuckoo_unlock_pair(stripes, from_stripe, to_stripe);
+    empty = nodes[i].slot;
+  }
+  // i is now a root, and roots[i] is the path being inserted, on side i
+  libfilter_spin_lock(&stripes[r[i]].lock);
+  libfilter_taffy_cuckoo_bucket* to = &t->sides[i].data[roots[i].bucket];
+  libfilter_taffy_cuckoo_bucket y = *to;
+  if (!libfilter_concurrent_taffy_cuckoo_is_current(here, t) || y.data[empty].tail != 0) {
+    libfilter_spin_unlock(&stripes[r[i]].lock);
+    return kConcurrentTaffyCuckooRetry;
+  }
+  y.data[empty] = roots[i].slot;
+  libfilter_concurrent_taffy_cuckoo_begin_write(&stripes[r[i]]);
+  libfilter_taffy_cuckoo_bucket_store(to, y);
+  libfilter_concurrent_taffy_cuckoo_end_write(&stripes[r[i]]);
+  const bool full = libfilter_concurrent_taffy_cuckoo_count(here, t, r[i]);
+  libfilter_spin_unlock(&stripes[r[i]].lock);
+  return full ? kConcurrentTaffyCuckooFull : kConcurrentTaffyCuckooDone;
+}
+
+// Replaces t with a table twice its size, unless another insert already has
+static void libfilter_concurrent_taffy_cuckoo_upsize(libfilter_concurrent_taffy_cuckoo* here,
+                                                     libfilter_taffy_cuckoo* t) {
+  libfilter_taffy_cuckoo_stripe* stripes = here->stripes;
+  const uint64_t mask = libfilter_concurrent_taffy_cuckoo_stripe_mask(t->log_side_size);
+  for (uint64_t i = 0; i <= mask; ++i) libfilter_spin_lock(&stripes[i].lock);
+  if (libfilter_concurrent_taffy_cuckoo_is_current(here, t)) {
+    libfilter_taffy_cuckoo* u =
+        (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+    *u = libfilter_taffy_cuckoo_upsized(t, t->upsize_threads);
+    // Count the entries in u by stripe. The stripes past mask are not locked, but no
+    // insert can use them until u is published.
+    const uint64_t u_mask = libfilter_concurrent_taffy_cuckoo_stripe_mask(u->log_side_size);
+    for (uint64_t i = 0; i <= u_mask; ++i) {
+      __atomic_store_n(&stripes[i].occupied, 0, __ATOMIC_RELAXED);
+    }
+    for (int s = 0; s < 2; ++s) {
+      for (uint64_t b = 0; b < (1ul << u->log_side_size); ++b) {
+        int n = 0;
+        for (int j = 0; j < libfilter_slots; ++j) n += (u->sides[s].data[b].data[j].tail != 0);
+        libfilter_concurrent_taffy_cuckoo_add_occupied(&stripes[b & u_mask], n);
+      }
+      libfilter_concurrent_taffy_cuckoo_add_occupied(&stripes[0], u->sides[s].stash_size);
+    }
+    here->retired = (libfilter_taffy_cuckoo**)realloc(
+        here->retired, (here->retired_size + 1) * sizeof(libfilter_taffy_cuckoo*));
+    here->retired[here->retired_size++] = t;
+    __atomic_store_n(&here->table, u, __ATOMIC_RELEASE);
+  }
+  for (uint64_t i = 0; i <= mask; ++i) libfilter_spin_unlock(&stripes[i].lock);
+}
+
+void libfilter_concurrent_taffy_cuckoo_init(uint64_t bytes,
+                                            libfilter_concurrent_taffy_cuckoo* here) {
+  here->table = (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+  libfilter_taffy_cuckoo_init(bytes, here->table);
+  const size_t stripe_bytes =
+      libfilter_taffy_cuckoo_stripes * sizeof(libfilter_taffy_cuckoo_stripe);
+  here->stripes = (libfilter_taffy_cuckoo_stripe*)aligned_alloc(64, stripe_bytes);
+  memset(here->stripes, 0, stripe_bytes);
+  here->stash_lock = 0;
+  here->retired = NULL;
+  here->retired_size = 0;
+}
+
+void libfilter_concurrent_taffy_cuckoo_destruct(libfilter_concurrent_taffy_cuckoo* here) {
+  if (here->table != NULL) {
+    libfilter_taffy_cuckoo_destruct(here->table);
+    free(here->table);
+  }
+  for (int i = 0; i < here->retired_size; ++i) {
+    libfilter_taffy_cuckoo_destruct(here->retired[i]);
+    free(here->retired[i]);
+  }
+  free(here->retired);
+  free(here->stripes);
+}
+
+bool libfilter_concurrent_taffy_cuckoo_add_hash(libfilter_concurrent_taffy_cuckoo* here,
+                                                uint64_t k) {
+  while (true) {
+    libfilter_taffy_cuckoo* t = __atomic_load_n(&here->table, __ATOMIC_ACQUIRE);
+    const int result = libfilter_concurrent_taffy_cuckoo_insert(here, t, k);
+    if (result == kConcurrentTaffyCuckooRetry) continue;
+    if (result == kConcurrentTaffyCuckooStashFull) {
+      libfilter_concurrent_taffy_cuckoo_upsize(here, t);
+      continue;
+    }
+    if (result == kConcurrentTaffyCuckooFull) {
+      libfilter_concurrent_taffy_cuckoo_upsize(here, t);
+    }
+    return true;
+  }
+}
+
+bool libfilter_concurrent_taffy_cuckoo_find_hash(
+    const libfilter_concurrent_taffy_cuckoo* here, uint64_t k) {
+  const libfilter_taffy_cuckoo* t = __atomic_load_n(&here->table, __ATOMIC_ACQUIRE);
+  const uint64_t mask = libfilter_concurrent_taffy_cuckoo_stripe_mask(t->log_side_size);
+  libfilter_taffy_cuckoo_path p[2];
+  const libfilter_taffy_cuckoo_stripe* stripes[2];
+  for (int s = 0; s < 2; ++s) {
+    p[s] = libfilter_taffy_cuckoo_to_path(k, &t->sides[s].f, t->log_side_size);
+    stripes[s] = &here->stripes[p[s].bucket & mask];
+  }
+  // An entry is moved from one of its buckets to the other while both of their stripes
+  // have odd versions, so both buckets are read between the same two reads of the
+  // versions. Otherwise, the entry could be missed in both.
+  libfilter_taffy_cuckoo_bucket b[2];
+  while (true) {
+    const uint32_t v0 = __atomic_load_n(&stripes[0]->version, __ATOMIC_ACQUIRE);
+    const uint32_t v1 = __atomic_load_n(&stripes[1]->version, __ATOMIC_ACQUIRE);
+    if ((v0 | v1) & 1) {
+      sched_yield();
+      continue;
+    }
+    for (int s = 0; s < 2; ++s) {
+      b[s] = libfilter_taffy_cuckoo_bucket_load(&t->sides[s].data[p[s].bucket]);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (v0 == __atomic_load_n(&stripes[0]->version, __ATOMIC_RELAXED) &&
+        v1 == __atomic_load_n(&stripes[1]->version, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  for (int s = 0; s < 2; ++s) {
+    if (libfilter_taffy_cuckoo_bucket_find(&b[s], p[s].slot)) return true;
+  }
+  // Entries never leave the stash of a table, so it can be checked after the buckets
+  for (int s = 0; s < 2; ++s) {
+    if (libfilter_concurrent_taffy_cuckoo_stash_find(&t->sides[s], p[s])) return true;
+  }
+  return false;
+}
+
+uint64_t libfilter_concurrent_taffy_cuckoo_size_in_bytes(
+    const libfilter_concurrent_taffy_cuckoo* here) {
+  uint64_t result = libfilter_taffy_cuckoo_size_in_bytes(here->table) +
+                    libfilter_taffy_cuckoo_stripes * sizeof(libfilter_taffy_cuckoo_stripe);
+  for (int i = 0; i < here->retired_size; ++i) {
+    result += libfilter_taffy_cuckoo_size_in_bytes(here->retired[i]);
+  }
+  return result;
+}
+
+void libfilter_concurrent_taffy_cuckoo_set_upsize_threads(
+    libfilter_concurrent_taffy_cuckoo* here, int threads) {
+  libfilter_taffy_cuckoo_set_upsize_threads(here->table, threads);
+}
+
+// Emits the paths on the left side of here that p, on side "side" of that, becomes
+static INLINE void libfilter_taffy_cuckoo_union_emit(
+    const libfilter_taffy_cuckoo* here, const libfilter_taffy_cuckoo* that, int side,
+    libfilter_taffy_cuckoo_path p, libfilter_taffy_cuckoo_emit emit, void* context) {
+  uint64_t hashed = libfilter_taffy_cuckoo_from_path_no_tail(p, &that->sides[side].f,
+                                                             that->log_side_size);
+  // hashed is high that->log_side_size + libfilter_taffy_cuckoo_head_size, in high bits
+  // of 64-bit word
+  int tail_size = libfilter_taffy_cuckoo_tail_size - __builtin_ctz(p.slot.tail);
+  if (that->log_side_size == here->log_side_size) {
+    libfilter_taffy_cuckoo_path q =
+        libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
+    q.slot.tail = p.slot.tail;
+    emit(context, q);
+  } else if (that->log_side_size + tail_size >= here->log_side_size) {
+    uint64_t orin3 = (((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
+                      << (64 - that->log_side_size - libfilter_taffy_cuckoo_head_size -
+                          libfilter_taffy_cuckoo_tail_size - 1));
+    assert((hashed & orin3) == 0);
+    hashed |= orin3;
+    libfilter_taffy_cuckoo_path q =
+        libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
+    q.slot.tail = (p.slot.tail << (here->log_side_size - that->log_side_size));
+    emit(context, q);
+  } else {
+    // p.tail & (p.tail - 1) removes the final 1 marker. The resulting length is
+    // 0, 1, 2, 3, 4, or 5. It is also tail_size, but is packed in high bits of a
+    // section with size libfilter_taffy_cuckoo_tail_size + 1.
+    uint64_t orin2 = (((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
+                      << (64 - that->log_side_size - libfilter_taffy_cuckoo_head_size -
+                          libfilter_taffy_cuckoo_tail_size - 1));
+    assert(0 == (orin2 & hashed));
+    hashed |= orin2;
+    // The total size is now that->log_side_size + libfilter_taffy_cuckoo_head_size +
+    // tail_size
+    //
+    // To fill up the required log_size_size + libfilter_taffy_cuckoo_head_size, we need
+    // values of width up to log_size_size + libfilter_taffy_cuckoo_head_size -
+    // (that->log_side_size + libfilter_taffy_cuckoo_head_size + tail_size)
+    for (uint64_t i = 0;
+         i < (1u << (here->log_side_size - that->log_side_size - tail_size)); ++i) {
+      // To append these, need to shift up to that->log_side_size +
+      // libfilter_taffy_cuckoo_head_size + tail_size
+      uint64_t orin =
+          (i << (64 - here->log_side_size - libfilter_taffy_cuckoo_head_size));
+      assert(0 == (orin & hashed));
+      uint64_t tmphashed = (hashed | orin);
+      libfilter_taffy_cuckoo_path q = libfilter_taffy_cuckoo_to_path(
+          tmphashed, &here->sides[0].f, here->log_side_size);
+      q.slot.tail = (1u << libfilter_taffy_cuckoo_tail_size);
+      emit(context, q);
+    }
+  }
+}
+
+// Makes room in here for that's entries, with the same max_load as
+// libfilter_taffy_cuckoo_add_hash, since union_one never upsizes
+static void libfilter_taffy_cuckoo_union_reserve(libfilter_taffy_cuckoo* here,
+                                                 const libfilter_taffy_cuckoo* that,
+                                                 int threads) {
+  const uint64_t incoming =
+      that->occupied +
+      ((that->migrating_from == NULL) ? 0 : that->migrating_from->occupied);
+  while (here->occupied + incoming >
+         here->policy.max_load * libfilter_taffy_cuckoo_capacity(here)) {
+    libfilter_taffy_cuckoo_upsize_parallel(here, threads);
+  }
+}
+
+static void libfilter_taffy_cuckoo_union_one(libfilter_taffy_cuckoo* here,
+                                             const libfilter_taffy_cuckoo* that,
+                                             int threads) {
+  assert(that->log_side_size <= here->log_side_size);
+  if (that->migrating_from != NULL) {
+    libfilter_taffy_cuckoo_union_one(here, that->migrating_from, threads);
+  }
+  if (threads > 1) {
+    libfilter_taffy_cuckoo_move_parallel(here, that, false, threads);
+    return;
+  }
+  libfilter_taffy_cuckoo_path p;
+  for (int side = 0; side < 2; ++side) {
+    for (size_t i = 0; i < that->sides[side].stash_capacity; ++i) {
+      if (that->sides[side].stash[i].slot.tail == 0) continue;
+      libfilter_taffy_cuckoo_union_emit(here, that, side, that->sides[side].stash[i],
+                                        libfilter_taffy_cuckoo_emit_insert, here);
+    }
+    for (uint64_t bucket = 0; bucket < (1ul << that->log_side_size); ++bucket) {
+      p.bucket = bucket;
+      for (int slot = 0; slot < libfilter_slots; ++slot) {
+        if (that->sides[side].data[bucket].data[slot].tail == 0) continue;
+        p.slot.fingerprint = that->sides[side].data[bucket].data[slot].fingerprint;
+        p.slot.tail = that->sides[side].data[bucket].data[slot].tail;
+        libfilter_taffy_cuckoo_union_emit(here, that, side, p,
+                                          libfilter_taffy_cuckoo_emit_insert, here);
+        continue;
+      }
+    }
+  }
+}
+
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_parallel(
+    const libfilter_taffy_cuckoo* x, const libfilter_taffy_cuckoo* y, int threads) {
+  // Mid-upsize, occupied only counts the larger table, so compare sizes first
+  if (x->log_side_size > y->log_side_size ||
+      (x->log_side_size == y->log_side_size && x->occupied > y->occupied)) {
+    libfilter_taffy_cuckoo result;
+    libfilter_taffy_cuckoo_clone(x, &result);
+    libfilter_taffy_cuckoo_union_reserve(&result, y, threads);
+    libfilter_taffy_cuckoo_union_one(&result, y, threads);
+    return result;
+  }
+  libfilter_taffy_cuckoo result;
+  libfilter_taffy_cuckoo_clone(y, &result);
+  libfilter_taffy_cuckoo_union_reserve(&result, x, threads);
+  libfilter_taffy_cuckoo_union_one(&result, x, threads);
+  return result;
+}
+
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo* x,
+                                                    const libfilter_taffy_cuckoo* y) {
+  return libfilter_taffy_cuckoo_union_parallel(x, y, 1);
+}
+
+// Counts the entries of here, and of the table it is migrating from, by how many bits of
+// their hashes they record past the bucket index bits of a side with log_side_size 0.
+// An entry with b such bits becomes 2^(L - b) entries in a union with log_side_size L
+// when b < L, and one entry otherwise.
+static void libfilter_taffy_cuckoo_tally_bits(const libfilter_taffy_cuckoo* here,
+                                              uint64_t by_bits[64]) {
+  if (here->migrating_from != NULL) {
+    libfilter_taffy_cuckoo_tally_bits(here->migrating_from, by_bits);
+  }
+  for (int side = 0; side < 2; ++side) {
+    for (size_t i = 0; i < here->sides[side].stash_capacity; ++i) {
+      const uint64_t tail = here->sides[side].stash[i].slot.tail;
+      if (tail == 0) continue;
+      ++by_bits[here->log_side_size + libfilter_taffy_cuckoo_tail_size -
+                __builtin_ctz(tail)];
+    }
+    for (uint64_t bucket = 0; bucket < (1ul << here->log_side_size); ++bucket) {
+      for (int slot = 0; slot < libfilter_slots; ++slot) {
+        const uint64_t tail = here->sides[side].data[bucket].data[slot].tail;
+        if (tail == 0) continue;
+        ++by_bits[here->log_side_size + libfilter_taffy_cuckoo_tail_size -
+                  __builtin_ctz(tail)];
+      }
+    }
+  }
+}
+
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_many_parallel(
+    const libfilter_taffy_cuckoo* const* filters, size_t n, int threads) {
+  if (n == 0) return libfilter_taffy_cuckoo_create_with_bytes(0);
+  // Size the result for all of the entries at once, with the same limit as
+  // libfilter_taffy_cuckoo_add_hash. Entries whose tails are too short for the size of
+  // the result are copied into every bucket they could belong to, so count those copies
+  // too.
+  uint64_t by_bits[64] = {0};
+  int log_side_size = 1, most_bits = 1;
+  for (size_t i = 0; i < n; ++i) {
+    if (filters[i]->log_side_size > log_side_size) {
+      log_side_size = filters[i]->log_side_size;
+    }
+    libfilter_taffy_cuckoo_tally_bits(filters[i], by_bits);
+  }
+  for (int b = 0; b < 64; ++b) {
+    if (by_bits[b] > 0) most_bits = b;
+  }
+  // Past most_bits, every entry is copied twice as many times at each doubling, so the
+  // load stops falling. Any extra entries then go to the stashes.
+  for (; log_side_size < most_bits; ++log_side_size) {
+    double copies = 0;
+    for (int b = 0; b < 64; ++b) {
+      copies += (b < log_side_size) ? by_bits[b] * (double)(1ul << (log_side_size - b))
+                                    : by_bits[b];
+    }
+    const uint64_t capacity = 2 * libfilter_slots * (1ul << log_side_size);
+    if (copies <= filters[0]->policy.max_load * capacity) break;
+  }
+  libfilter_taffy_cuckoo result =
+      libfilter_taffy_cuckoo_create(log_side_size, filters[0]->entropy);
+  result.policy = filters[0]->policy;
+  for (size_t i = 0; i < n; ++i) {
+    libfilter_taffy_cuckoo_union_one(&result, filters[i], threads);
+  }
+  result.migrate_per_insert = filters[0]->migrate_per_insert;
+  result.upsize_threads = filters[0]->upsize_threads;
+  result.bfs_insert = filters[0]->bfs_insert;
+  result.in_place_upsize = filters[0]->in_place_upsize;
+  return result;
+}
+
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union_many(
+    const libfilter_taffy_cuckoo* const* filters, size_t n) {
+  return libfilter_taffy_cuckoo_union_many_parallel(filters, n, 1);
+}
+
+libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_union_many_freeze(
+    const libfilter_taffy_cuckoo* const* filters, size_t n,
+    libfilter_frozen_taffy_cuckoo_layout layout) {
+  libfilter_taffy_cuckoo u = libfilter_taffy_cuckoo_union_many(filters, n);
+  libfilter_frozen_taffy_cuckoo result = libfilter_taffy_cuckoo_freeze_layout(&u, layout);
+  libfilter_taffy_cuckoo_destruct(&u);
+  return result;
+}
+
+typedef struct {
+  // The filter with the larger log_side_size. The entries of the other are emitted in
+  // its coordinates.
+  const libfilter_taffy_cuckoo* big;
+  libfilter_taffy_cuckoo* result;
+} libfilter_taffy_cuckoo_intersector;
+
+// r and e are on side s of big, with the same bucket and fingerprint, so they match the
+// same keys except for their tails. If one tail is a prefix of the other, the keys both
+// match are the ones the longer tail matches.
+static void libfilter_taffy_cuckoo_intersect_keep(libfilter_taffy_cuckoo_intersector* ctx,
+                                                  int s, libfilter_taffy_cuckoo_path r,
+                                                  libfilter_taffy_cuckoo_slot e) {
+  if (libfilter_taffy_is_prefix_of(r.slot.tail, e.tail)) {
+    r.slot.tail = e.tail;
+  } else if (!libfilter_taffy_is_prefix_of(e.tail, r.slot.tail)) {
+    return;
+  }
+  libfilter_taffy_cuckoo* result = ctx->result;
+  while (result->occupied >
+             result->policy.max_load * libfilter_taffy_cuckoo_capacity(result) ||
+         result->occupied + 4 >= libfilter_taffy_cuckoo_capacity(result)) {
+    libfilter_taffy_cuckoo_upsize(result);
+  }
+  libfilter_taffy_cuckoo_union_emit(result, ctx->big, s, r,
+                                    libfilter_taffy_cuckoo_emit_insert, result);
+}
+
+// Receives q, an entry of the smaller filter translated to the left side of big, and
+// keeps its intersection with each entry of big that has the same bucket and fingerprint
+static void libfilter_taffy_cuckoo_intersect_emit(void* context,
+                                                  libfilter_taffy_cuckoo_path q) {
+  libfilter_taffy_cuckoo_intersector* ctx = (libfilter_taffy_cuckoo_intersector*)context;
+  const libfilter_taffy_cuckoo* big = ctx->big;
+  const uint64_t hashed =
+      libfilter_taffy_cuckoo_from_path_no_tail(q, &big->sides[0].f, big->log_side_size);
+  for (int s = 0; s < 2; ++s) {
+    const libfilter_taffy_cuckoo_side* side = &big->sides[s];
+    libfilter_taffy_cuckoo_path r = q;
+    if (s == 1) {
+      r = libfilter_taffy_cuckoo_to_path(hashed, &side->f, big->log_side_size);
+      r.slot.tail = q.slot.tail;
+    }
+    const libfilter_taffy_cuckoo_bucket* b = &side->data[r.bucket];
+    for (int j = 0; j < libfilter_slots; ++j) {
+      if (b->data[j].tail == 0 || b->data[j].fingerprint != r.slot.fingerprint) continue;
+      libfilter_taffy_cuckoo_intersect_keep(ctx, s, r, b->data[j]);
+    }
+    if (side->overflow == NULL || !libfilter_overflow_get(side->overflow, r.bucket)) {
+      continue;
+    }
+    const size_t mask = side->stash_capacity - 1;
+    for (size_t i = r.bucket & mask; side->stash[i].slot.tail != 0; i = (i + 1) & mask) {
+      if (side->stash[i].bucket != r.bucket ||
+          side->stash[i].slot.fingerprint != r.slot.fingerprint) {
+        continue;
+      }
+      libfilter_taffy_cuckoo_intersect_keep(ctx, s, r, side->stash[i].slot);
+    }
+  }
+}
+
+// Intersects here, which has no upsize in progress, with big, which has at least as
+// many buckets per side
+static libfilter_taffy_cuckoo libfilter_taffy_cuckoo_intersect_help(
+    const libfilter_taffy_cuckoo* here, const libfilter_taffy_cuckoo* big) {
+  libfilter_taffy_cuckoo result =
+      libfilter_taffy_cuckoo_create(big->log_side_size, big->entropy);
+  result.policy = big->policy;
+  libfilter_taffy_cuckoo_intersector ctx = {big, &result};
+  libfilter_taffy_cuckoo_path p;
+  for (int side = 0; side < 2; ++side) {
+    for (size_t i = 0; i < here->sides[side].stash_capacity; ++i) {
+      if (here->sides[side].stash[i].slot.tail == 0) continue;
+      libfilter_taffy_cuckoo_union_emit(big, here, side, here->sides[side].stash[i],
+                                        libfilter_taffy_cuckoo_intersect_emit, &ctx);
+    }
+    for (uint64_t bucket = 0; bucket < (1ul << here->log_side_size); ++bucket) {
+      p.bucket = bucket;
+      for (int slot = 0; slot < libfilter_slots; ++slot) {
+        if (here->sides[side].data[bucket].data[slot].tail == 0) continue;
+        p.slot = here->sides[side].data[bucket].data[slot];
+        libfilter_taffy_cuckoo_union_emit(big, here, side, p,
+                                          libfilter_taffy_cuckoo_intersect_emit, &ctx);
+      }
+    }
+  }
+  // As after removes, there is no need to keep the result larger than its entries need
+  while (result.log_side_size > 1 &&
+         result.occupied < libfilter_taffy_cuckoo_capacity(&result) / 4) {
+    libfilter_taffy_cuckoo_downsize(&result);
+  }
+  result.migrate_per_insert = big->migrate_per_insert;
+  result.upsize_threads = big->upsize_threads;
+  result.bfs_insert = big->bfs_insert;
+  result.in_place_upsize = big->in_place_upsize;
+  return result;
+}
+
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_intersect(const libfilter_taffy_cuckoo* x,
+                                                        const libfilter_taffy_cuckoo* y) {
+  if (x->migrating_from != NULL || y->migrating_from != NULL) {
+    libfilter_taffy_cuckoo xx, yy;
+    libfilter_taffy_cuckoo_clone_finished(x, &xx);
+    libfilter_taffy_cuckoo_clone_finished(y, &yy);
+    libfilter_taffy_cuckoo result = libfilter_taffy_cuckoo_intersect(&xx, &yy);
+    libfilter_taffy_cuckoo_destruct(&xx);
+    libfilter_taffy_cuckoo_destruct(&yy);
+    return result;
+  }
+  if (x->log_side_size > y->log_side_size) {
+    return libfilter_taffy_cuckoo_intersect_help(y, x);
+  }
+  return libfilter_taffy_cuckoo_intersect_help(x, y);
+}
+
+// Sets the bucket range of the cursor's chunk of side 0 of its table
+static void libfilter_taffy_cuckoo_cursor_start(libfilter_taffy_cuckoo_cursor* cursor) {
+  const uint64_t buckets = 1ul << cursor->table->log_side_size;
+  cursor->side = 0;
+  cursor->begin = buckets * cursor->chunk / cursor->chunks;
+  cursor->end = buckets * (cursor->chunk + 1) / cursor->chunks;
+  cursor->bucket = cursor->begin;
+  cursor->slot = 0;
+  cursor->stash_index = 0;
+}
+
+libfilter_taffy_cuckoo_cursor libfilter_taffy_cuckoo_cursor_create(
+    const libfilter_taffy_cuckoo* here, int chunk, int chunks) {
+  assert(0 <= chunk && chunk < chunks);
+  libfilter_taffy_cuckoo_cursor result;
+  result.here = here;
+  result.table = (here->migrating_from == NULL) ? here : here->migrating_from;
+  result.chunk = chunk;
+  result.chunks = chunks;
+  libfilter_taffy_cuckoo_cursor_start(&result);
+  return result;
+}
+
+size_t libfilter_taffy_cuckoo_cursor_next(libfilter_taffy_cuckoo_cursor* cursor,
+                                          libfilter_taffy_cuckoo_entry* out, size_t n) {
+  size_t result = 0;
+  while (result < n && cursor->table != NULL) {
+    const libfilter_taffy_cuckoo* t = cursor->table;
+    const libfilter_taffy_cuckoo_side* side = &t->sides[cursor->side];
+    libfilter_taffy_cuckoo_path p;
+    if (cursor->bucket < cursor->end) {
+      p.bucket = cursor->bucket;
+      p.slot = side->data[cursor->bucket].data[cursor->slot];
+      if (++cursor->slot == libfilter_slots) {
+        cursor->slot = 0;
+        ++cursor->bucket;
+      }
+    } else if (cursor->stash_index < side->stash_capacity) {
+      p = side->stash[cursor->stash_index++];
+      // Stashed entries belong to the chunk with their bucket
+      if (p.bucket < cursor->begin || p.bucket >= cursor->end) continue;
+    } else {
+      if (cursor->side == 0) {
+        cursor->side = 1;
+        cursor->bucket = cursor->begin;
+        cursor->stash_index = 0;
+      } else if (t != cursor->here) {
+        cursor->table = cursor->here;
+        libfilter_taffy_cuckoo_cursor_start(cursor);
+      } else {
+        cursor->table = NULL;
+      }
+      continue;
+    }
+    if (p.slot.tail == 0) continue;
+    // As in libfilter_taffy_cuckoo_union_emit, the tail, minus its end marker, goes just
+    // below the bucket and fingerprint bits
+    const int tail_size = libfilter_taffy_cuckoo_tail_size - __builtin_ctz(p.slot.tail);
+    uint64_t hashed =
+        libfilter_taffy_cuckoo_from_path_no_tail(p, &side->f, t->log_side_size);
+    hashed |= ((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
+              << (64 - t->log_side_size - libfilter_taffy_cuckoo_head_size -
+                  libfilter_taffy_cuckoo_tail_size - 1);
+    out[result].hash = hashed;
+    out[result].bits = t->log_side_size + libfilter_taffy_cuckoo_head_size + tail_size;
+    ++result;
+  }
+  return result;
+}
+
+static int libfilter_taffy_cuckoo_compare_u64(const void* x, const void* y) {
+  const uint64_t a = *(const uint64_t*)x, b = *(const uint64_t*)y;
+  return (a > b) - (a < b);
+}
+
+libfilter_static_taffy_cuckoo libfilter_taffy_cuckoo_to_static(
+    const libfilter_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo_entry out[256];
+  size_t n;
+  uint64_t by_bits[65] = {0};
+  int least_bits = 64, most_bits = 1;
+  libfilter_taffy_cuckoo_cursor cursor = libfilter_taffy_cuckoo_cursor_create(here, 0, 1);
+  while ((n = libfilter_taffy_cuckoo_cursor_next(&cursor, out, 256)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      ++by_bits[out[i].bits];
+      if (out[i].bits < least_bits) least_bits = out[i].bits;
+      if (out[i].bits > most_bits) most_bits = out[i].bits;
+    }
+  }
+  // Longer prefixes match fewer keys that were never added, but entries with shorter
+  // tails are copied more times. Past most_bits, each extra bit doubles the copies and
+  // changes nothing else.
+  libfilter_static_taffy_cuckoo result;
+  result.prefix_bits = least_bits;
+  double best = INFINITY;
+  uint64_t copies = 0;
+  for (int bits = least_bits; bits <= most_bits; ++bits) {
+    double estimate = 0;
+    for (int b = 0; b <= 64; ++b) {
+      estimate += (b < bits) ? by_bits[b] * (double)(1ul << (bits - b)) : by_bits[b];
+    }
+    const double covered = ldexp(estimate, -bits);
+    const double product = estimate * (covered + (1 - covered) / 256);
+    if (product < best) {
+      best = product;
+      result.prefix_bits = bits;
+      copies = estimate;
+    }
+  }
+
+  uint64_t* prefixes = (uint64_t*)malloc((copies + 1) * sizeof(uint64_t));
+  uint64_t size = 0;
+  const int bits = result.prefix_bits;
+  cursor = libfilter_taffy_cuckoo_cursor_create(here, 0, 1);
+  while ((n = libfilter_taffy_cuckoo_cursor_next(&cursor, out, 256)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t prefix = out[i].hash >> (64 - bits);
+      if (out[i].bits >= bits) {
+        prefixes[size++] = prefix;
+        continue;
+      }
+      // The low bits - out[i].bits bits of prefix are zero
+      for (uint64_t j = 0; j < (1ul << (bits - out[i].bits)); ++j) {
+        prefixes[size++] = prefix | j;
+      }
+    }
+  }
+  assert(size == copies);
+  qsort(prefixes, size, sizeof(uint64_t), libfilter_taffy_cuckoo_compare_u64);
+  uint64_t distinct = 0;
+  for (uint64_t i = 0; i < size; ++i) {
+    if (distinct > 0 && prefixes[distinct - 1] == prefixes[i]) continue;
+    prefixes[distinct++] = prefixes[i];
+  }
+  for (uint64_t i = 0; i < distinct; ++i) {
+    prefixes[i] = libfilter_static_taffy_cuckoo_mix(prefixes[i]);
+  }
+  result.prefixes = distinct;
+  const double covered = ldexp(distinct, -bits);
+  result.fpp = (distinct == 0) ? 0 : covered + (1 - covered) / 256;
+  if (distinct > 0) result.table = libfilter_static_construct(distinct, prefixes);
+  free(prefixes);
+  return result;
+}
+
+void libfilter_static_taffy_cuckoo_destruct(libfilter_static_taffy_cuckoo* here) {
+  if (here->prefixes > 0) libfilter_static_destruct(here->table);
+  here->prefixes = 0;
+}
+
+size_t libfilter_static_taffy_cuckoo_size_in_bytes(
+    const libfilter_static_taffy_cuckoo* here) {
+  return sizeof(*here) + ((here->prefixes > 0) ? here->table.length_ : 0);
+}
+
+// Parallel upsize and union split the source buckets into one range per thread. Each
+// thread puts the entries from its range directly into their buckets in the destination,
+// on either side, using a compare-and-swap on the whole 8-byte bucket. Entries that don't
+// fit in either bucket need cuckoo moves, which can't be done concurrently. There are few
+// of them, so they are saved and inserted by one thread at the end. If there is no memory
+// to save them in, the rest of the thread's range is moved by one thread at the end, too.
+
+typedef struct {
+  libfilter_taffy_cuckoo* dest;
+  const libfilter_taffy_cuckoo* source;
+  bool upsize;  // otherwise, union
+  // The source buckets to move, counting side 0 and then side 1. begin is advanced as
+  // each one is finished.
+  uint64_t begin, end;
+  bool stashes;  // whether to move the source stashes, too
+  // Set when leftover can't grow. The bucket being moved then is moved again serially,
+  // which may add some of its entries twice.
+  bool failed;
+  bool serial;  // insert directly into dest, as libfilter_taffy_cuckoo_upsized does
+  uint64_t added;
+  size_t leftover_size, leftover_capacity;
+  libfilter_taffy_cuckoo_path* leftover;  // paths for side 1 of dest
+} libfilter_taffy_cuckoo_worker;
+
+// Puts p in its bucket in side if it is already there or there is an empty slot, just as
+// libfilter_taffy_cuckoo_side_insert would without kicking anything out. Safe to call
+// concurrently on the same side.
+static bool libfilter_taffy_cuckoo_side_place_atomic(libfilter_taffy_cuckoo_side* side,
+                                                     libfilter_taffy_cuckoo_path p,
+                                                     uint64_t* added) {
+  uint64_t* word = (uint64_t*)&side->data[p.bucket];
+  uint64_t expected = __atomic_load_n(word, __ATOMIC_RELAXED);
+  while (true) {
+    libfilter_taffy_cuckoo_bucket b;
+    memcpy(&b, &expected, sizeof(b));
+    int empty = -1;
+    for (int i = 0; i < libfilter_slots; ++i) {
+      if (b.data[i].tail == 0) {
+        empty = i;
+        break;
+      }
+      if (b.data[i].fingerprint == p.slot.fingerprint &&
+          libfilter_taffy_is_prefix_of(b.data[i].tail, p.slot.tail)) {
+        return true;
+      }
+    }
+    if (empty < 0) return false;
+    b.data[empty] = p.slot;
+    uint64_t desired;
+    memcpy(&desired, &b, sizeof(b));
+    // On failure, expected is reloaded, and the bucket is checked again
+    if (__atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+      ++*added;
+      return true;
+    }
+  }
+}
+
+static void libfilter_taffy_cuckoo_emit_parallel(void* context,
+                                                 libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_worker* w = (libfilter_taffy_cuckoo_worker*)context;
+  libfilter_taffy_cuckoo* dest = w->dest;
+  if (libfilter_taffy_cuckoo_side_place_atomic(&dest->sides[0], p, &w->added)) return;
+  libfilter_taffy_cuckoo_path q = libfilter_taffy_cuckoo_to_path(
+      libfilter_taffy_cuckoo_from_path_no_tail(p, &dest->sides[0].f, dest->log_side_size),
+      &dest->sides[1].f, dest->log_side_size);
+  q.slot.tail = p.slot.tail;
+  if (libfilter_taffy_cuckoo_side_place_atomic(&dest->sides[1], q, &w->added)) return;
+  if (w->leftover_size == w->leftover_capacity) {
+    const size_t capacity = (w->leftover_capacity > 0) ? 2 * w->leftover_capacity : 64;
+    libfilter_taffy_cuckoo_path* leftover = (libfilter_taffy_cuckoo_path*)realloc(
+        w->leftover, capacity * sizeof(libfilter_taffy_cuckoo_path));
+    if (leftover == NULL) {
+      w->failed = true;
+      return;
+    }
+    w->leftover = leftover;
+    w->leftover_capacity = capacity;
+  }
+  w->leftover[w->leftover_size++] = q;
+}
+
+static void libfilter_taffy_cuckoo_work_one(libfilter_taffy_cuckoo_worker* w, int s,
+                                            libfilter_taffy_cuckoo_path p) {
+  if (p.slot.tail == 0) return;
+  const libfilter_taffy_cuckoo_emit emit = w->serial
+                                               ? libfilter_taffy_cuckoo_emit_insert
+                                               : libfilter_taffy_cuckoo_emit_parallel;
+  void* context = w->serial ? (void*)w->dest : (void*)w;
+  if (w->upsize) {
+    UpsizeEmit(w->source, p.slot, p.bucket, s, w->dest, emit, context);
+  } else {
+    libfilter_taffy_cuckoo_union_emit(w->dest, w->source, s, p, emit, context);
+  }
+}
+
+static void* libfilter_taffy_cuckoo_work(void* arg) {
+  libfilter_taffy_cuckoo_worker* w = (libfilter_taffy_cuckoo_worker*)arg;
+  const libfilter_taffy_cuckoo* source = w->source;
+  libfilter_taffy_cuckoo_path p;
+  for (; w->begin < w->end; ++w->begin) {
+    const int s = w->begin >> source->log_side_size;
+    p.bucket = libfilter_mask(source->log_side_size, w->begin);
+    for (int j = 0; j < libfilter_slots; ++j) {
+      p.slot = source->sides[s].data[p.bucket].data[j];
+      libfilter_taffy_cuckoo_work_one(w, s, p);
+    }
+    if (w->failed) return NULL;
+  }
+  if (w->stashes) {
+    for (int s = 0; s < 2; ++s) {
+      for (size_t i = 0; i < source->sides[s].stash_capacity; ++i) {
+        if (source->sides[s].stash[i].slot.tail == 0) continue;
+        libfilter_taffy_cuckoo_work_one(w, s, source->sides[s].stash[i]);
+      }
+    }
+    if (w->failed) return NULL;
+    w->stashes = false;
+  }
+  return NULL;
+}
+
+// Moves every entry in source (but not source->migrating_from) into dest
+static void libfilter_taffy_cuckoo_move_parallel(libfilter_taffy_cuckoo* dest,
+                                                 const libfilter_taffy_cuckoo* source,
+                                                 bool upsize, int threads) {
+  const uint64_t buckets = 2ul << source->log_side_size;
+  // Give each thread enough buckets to be worth starting
+  const uint64_t max_threads = buckets / 4096;
+  if ((uint64_t)threads > max_threads) threads = max_threads;
+  if (threads < 1) threads = 1;
+  libfilter_taffy_cuckoo_worker* workers =
+      (libfilter_taffy_cuckoo_worker*)calloc(threads, sizeof(*workers));
+  pthread_t* ids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+  bool* started = (bool*)calloc(threads, sizeof(bool));
+  if (workers == NULL || ids == NULL || started == NULL) {
+    free(workers);
+    free(ids);
+    free(started);
+    libfilter_taffy_cuckoo_worker w;
+    memset(&w, 0, sizeof(w));
+    w.dest = dest;
+    w.source = source;
+    w.upsize = upsize;
+    w.end = buckets;
+    w.stashes = true;
+    w.serial = true;
+    libfilter_taffy_cuckoo_work(&w);
+    return;
+  }
+  for (int t = 0; t < threads; ++t) {
+    workers[t].dest = dest;
+    workers[t].source = source;
+    workers[t].upsize = upsize;
+    workers[t].begin = buckets * t / threads;
+    workers[t].end = buckets * (t + 1) / threads;
+    workers[t].stashes = (t == 0);
+  }
+  for (int t = 1; t < threads; ++t) {
+    started[t] =
+        (0 == pthread_create(&ids[t], NULL, libfilter_taffy_cuckoo_work, &workers[t]));
+    // If no thread is available, this thread does the work instead
+    if (!started[t]) libfilter_taffy_cuckoo_work(&workers[t]);
+  }
+  libfilter_taffy_cuckoo_work(&workers[0]);
+  for (int t = 1; t < threads; ++t) {
+    if (started[t]) pthread_join(ids[t], NULL);
+  }
+  for (int t = 0; t < threads; ++t) {
+    dest->occupied += workers[t].added;
+    for (size_t i = 0; i < workers[t].leftover_size; ++i) {
+      libfilter_taffy_cuckoo_insert_side_path(dest, 1, workers[t].leftover[i]);
+    }
+    free(workers[t].leftover);
+    if (workers[t].failed) {
+      workers[t].failed = false;
+      workers[t].serial = true;
+      libfilter_taffy_cuckoo_work(&workers[t]);
+    }
+  }
+  free(started);
+  free(ids);
+  free(workers);
+}
+
+// Serialization. All multi-byte integers are little-endian. The taffy cuckoo layout is
+//
+//   0: magic (4 bytes)          4: version (2)             6: flags, must be 0 (2)
+//   8: head size (1)            9: tail size (1)          10: log slots (1)
+//  11: unused (1)              12: log_side_size (4)      16: occupied (8)
+//  24: entropy (8 x 8)         88: rng state (8)          96: rng inc (8)
+// 104: rng current (4)        108: rng remaining bits (4) 112: rng bit width (4)
+// 116: unused (4)             120: stash sizes (2 x 8)
+// 136: stash entries for side 0 then side 1, each 16 bytes: bucket (8), slot (2),
+//      unused (6)
+//
+// followed by the buckets of side 0 and then side 1, each slot being 2 bytes: the
+// fingerprint in the low libfilter_taffy_cuckoo_head_size bits and the tail above it.
+// Since the buckets start at a multiple of 8 bytes, they can be used in place.
+
+static const uint32_t kTaffyCuckooMagic = 0x4f4b4354;        // "TCKO"
+static const uint32_t kFrozenTaffyCuckooMagic = 0x464b4354;  // "TCKF"
+static const uint16_t kTaffyCuckooVersion = 1;
+static const uint16_t kFrozenTaffyCuckooVersion = 1;
+static const uint64_t kTaffyCuckooHeaderBytes = 136;
+static const uint64_t kTaffyCuckooStashEntryBytes = 16;
+static const uint64_t kFrozenTaffyCuckooHeaderBytes = 112;
+
+static void libfilter_store_le(uint64_t x, int bytes, char* to) {
+  for (int k = 0; k < bytes; ++k) to[k] = x >> (8 * k);
+}
+
+static uint64_t libfilter_load_le(int bytes, const char* from) {
+  uint64_t result = 0;
+  for (int k = 0; k < bytes; ++k) {
+    result |= ((uint64_t)(unsigned char)from[k]) << (8 * k);
+  }
+  return result;
+}
+
+// Writes the first 12 bytes of the header, which are shared by both formats.
+static void libfilter_taffy_cuckoo_store_preamble(uint32_t magic, uint16_t version,
+                                                  int log_side_size,
+                                                  char* to) {
+  libfilter_store_le(magic, 4, &to[0]);
+  libfilter_store_le(version, 2, &to[4]);
+  libfilter_store_le(0, 2, &to[6]);
+  libfilter_store_le(libfilter_taffy_cuckoo_head_size, 1, &to[8]);
+  libfilter_store_le(libfilter_taffy_cuckoo_tail_size, 1, &to[9]);
+  libfilter_store_le(libfilter_log_slots, 1, &to[10]);
+  libfilter_store_le(0, 1, &to[11]);
+  libfilter_store_le(log_side_size, 4, &to[12]);
+}
+
+// Returns log_side_size, or < 0 if the preamble does not match this build.
+static int libfilter_taffy_cuckoo_load_preamble(uint32_t magic, uint16_t version,
+                                                uint64_t size_in_bytes,
+                                                const char* from) {
+  if (size_in_bytes < 16) return -1;
+  if (libfilter_load_le(4, &from[0]) != magic) return -1;
+  if (libfilter_load_le(2, &from[4]) != version) return -1;
+  if (libfilter_load_le(2, &from[6]) != 0) return -1;
+  if (libfilter_load_le(1, &from[8]) != libfilter_taffy_cuckoo_head_size) return -1;
+  if (libfilter_load_le(1, &from[9]) != libfilter_taffy_cuckoo_tail_size) return -1;
+  if (libfilter_load_le(1, &from[10]) != libfilter_log_slots) return -1;
+  const uint64_t log_side_size = libfilter_load_le(4, &from[12]);
+  // Leave room for the whole path, tail included, in a 64-bit hash value
+  if (log_side_size < 1 ||
+      log_side_size >= 64 - libfilter_taffy_cuckoo_head_size -
+                           libfilter_taffy_cuckoo_tail_size) {
+    return -1;
+  }
+  return log_side_size;
+}
+
+INLINE uint64_t libfilter_taffy_cuckoo_slot_to_word(libfilter_taffy_cuckoo_slot s) {
+  return s.fingerprint | ((uint64_t)s.tail << libfilter_taffy_cuckoo_head_size);
+}
+
+INLINE libfilter_taffy_cuckoo_slot libfilter_taffy_cuckoo_word_to_slot(uint64_t w) {
+  libfilter_taffy_cuckoo_slot result;
+  result.fingerprint = w;
+  result.tail = w >> libfilter_taffy_cuckoo_head_size;
+  return result;
+}
+
+// Mid-upsize, a filter is serialized as if the upsize had completed. The migration is
+// deterministic, so serialized_size and serialize agree.
+uint64_t libfilter_taffy_cuckoo_serialized_size(const libfilter_taffy_cuckoo* here) {
+  if (here->migrating_from != NULL) {
+    libfilter_taffy_cuckoo finished;
+    libfilter_taffy_cuckoo_clone_finished(here, &finished);
+    const uint64_t result = libfilter_taffy_cuckoo_serialized_size(&finished);
+    libfilter_taffy_cuckoo_destruct(&finished);
+    return result;
+  }
+  return kTaffyCuckooHeaderBytes +
+         kTaffyCuckooStashEntryBytes *
+             (here->sides[0].stash_size + here->sides[1].stash_size) +
+         2 * (sizeof(libfilter_taffy_cuckoo_bucket) << here->log_side_size);
+}
+
+void libfilter_taffy_cuckoo_serialize(const libfilter_taffy_cuckoo* here, char* to) {
+  if (here->migrating_from != NULL) {
+    libfilter_taffy_cuckoo finished;
+    libfilter_taffy_cuckoo_clone_finished(here, &finished);
+    libfilter_taffy_cuckoo_serialize(&finished, to);
+    libfilter_taffy_cuckoo_destruct(&finished);
+    return;
+  }
+  libfilter_taffy_cuckoo_store_preamble(kTaffyCuckooMagic, kTaffyCuckooVersion,
+                                        here->log_side_size, to);
+  libfilter_store_le(here->occupied, 8, &to[16]);
+  for (int i = 0; i < 8; ++i) libfilter_store_le(here->entropy[i], 8, &to[24 + 8 * i]);
+  libfilter_store_le(here->rng.state, 8, &to[88]);
+  libfilter_store_le(here->rng.inc, 8, &to[96]);
+  libfilter_store_le(here->rng.current, 4, &to[104]);
+  libfilter_store_le(here->rng.remaining_bits, 4, &to[108]);
+  libfilter_store_le(here->rng.bit_width, 4, &to[112]);
+  libfilter_store_le(0, 4, &to[116]);
+  to += 120;
+  for (int s = 0; s < 2; ++s) {
+    libfilter_store_le(here->sides[s].stash_size, 8, to);
+    to += 8;
+  }
+  for (int s = 0; s < 2; ++s) {
+    for (size_t i = 0; i < here->sides[s].stash_capacity; ++i) {
+      if (here->sides[s].stash[i].slot.tail == 0) continue;
+      libfilter_store_le(here->sides[s].stash[i].bucket, 8, to);
+      libfilter_store_le(
+          libfilter_taffy_cuckoo_slot_to_word(here->sides[s].stash[i].slot), 2, &to[8]);
+      libfilter_store_le(0, 6, &to[10]);
+      to += kTaffyCuckooStashEntryBytes;
+    }
+  }
+  const uint64_t side_bytes = sizeof(libfilter_taffy_cuckoo_bucket)
+                              << here->log_side_size;
+  for (int s = 0; s < 2; ++s) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(to, here->sides[s].data, side_bytes);
+#else
+    for (uint64_t i = 0; i < (1ul << here->log_side_size); ++i) {
+      for (int j = 0; j < libfilter_slots; ++j) {
+        libfilter_store_le(
+            libfilter_taffy_cuckoo_slot_to_word(here->sides[s].data[i].data[j]),
+            sizeof(libfilter_taffy_cuckoo_slot),
+            &to[sizeof(libfilter_taffy_cuckoo_bucket) * i +
+                sizeof(libfilter_taffy_cuckoo_slot) * j]);
+      }
+    }
+#endif
+    to += side_bytes;
+  }
+}
+
+// If adopt, the buckets of "to" point into "from", which the caller has made sure is
+// writable.
+static int libfilter_taffy_cuckoo_deserialize_help(uint64_t size_in_bytes,
+                                                   const char* from, bool adopt,
+                                                   libfilter_taffy_cuckoo* to) {
+  // Leave "to" safe to destruct, even on error
+  memset(to, 0, sizeof(*to));
+  const int log_side_size =
+      libfilter_taffy_cuckoo_load_preamble(kTaffyCuckooMagic, kTaffyCuckooVersion,
+                                           size_in_bytes, from);
+  if (log_side_size < 0) return -1;
+  if (size_in_bytes < kTaffyCuckooHeaderBytes) return -1;
+  const uint64_t side_bytes = sizeof(libfilter_taffy_cuckoo_bucket) << log_side_size;
+  uint64_t stash_sizes[2];
+  uint64_t expected = kTaffyCuckooHeaderBytes;
+  for (int s = 0; s < 2; ++s) {
+    stash_sizes[s] = libfilter_load_le(8, &from[120 + 8 * s]);
+    // Avoids overflow in computing the expected size
+    if (stash_sizes[s] > size_in_bytes / kTaffyCuckooStashEntryBytes) return -1;
+    expected += kTaffyCuckooStashEntryBytes * stash_sizes[s];
+  }
+  if (side_bytes > size_in_bytes || expected + 2 * side_bytes != size_in_bytes) {
+    return -1;
+  }
+
+  to->log_side_size = log_side_size;
+  to->occupied = libfilter_load_le(8, &from[16]);
+  for (int i = 0; i < 8; ++i) to->entropy[i] = libfilter_load_le(8, &from[24 + 8 * i]);
+  to->rng.state = libfilter_load_le(8, &from[88]);
+  to->rng.inc = libfilter_load_le(8, &from[96]);
+  to->rng.current = libfilter_load_le(4, &from[104]);
+  to->rng.remaining_bits = (int32_t)libfilter_load_le(4, &from[108]);
+  to->rng.bit_width = (int32_t)libfilter_load_le(4, &from[112]);
+  // Inserts use the rng to pick a slot in a bucket, so any other width would have them
+  // write past the end of it
+  if (to->rng.bit_width != libfilter_log_slots || to->rng.remaining_bits < 0 ||
+      to->rng.remaining_bits > 32) {
+    return -1;
+  }
+  to->borrowed = adopt;
+  to->policy = libfilter_taffy_cuckoo_default_policy();
+  from += kTaffyCuckooHeaderBytes;
+  for (int s = 0; s < 2; ++s) {
+    libfilter_taffy_cuckoo_side* side = &to->sides[s];
+    side->f = libfilter_feistel_create(&to->entropy[4 * s]);
+    side->stash_size = 0;
+    side->stash_capacity = 4;
+    side->stash = (libfilter_taffy_cuckoo_path*)libfilter_huge_calloc(
+        side->stash_capacity * sizeof(libfilter_taffy_cuckoo_path));
+    for (size_t i = 0; i < stash_sizes[s]; ++i) {
+      libfilter_taffy_cuckoo_path p;
+      p.bucket = libfilter_load_le(8, from);
+      p.slot = libfilter_taffy_cuckoo_word_to_slot(libfilter_load_le(2, &from[8]));
+      from += kTaffyCuckooStashEntryBytes;
+      if (p.slot.tail == 0 || p.bucket >= (1ul << log_side_size)) return -1;
+      libfilter_taffy_cuckoo_stash_add(side, p, log_side_size);
+    }
+  }
+  for (int s = 0; s < 2; ++s) {
+    if (adopt) {
+      to->sides[s].data = (libfilter_taffy_cuckoo_bucket*)from;
+    } else {
+      to->sides[s].data = (libfilter_taffy_cuckoo_bucket*)libfilter_huge_calloc(side_bytes);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      memcpy(to->sides[s].data, from, side_bytes);
+#else
+      for (uint64_t i = 0; i < (1ul << log_side_size); ++i) {
+        for (int j = 0; j < libfilter_slots; ++j) {
+          to->sides[s].data[i].data[j] =
+              libfilter_taffy_cuckoo_word_to_slot(libfilter_load_le(
+                  sizeof(libfilter_taffy_cuckoo_slot),
+                  &from[sizeof(libfilter_taffy_cuckoo_bucket) * i +
+                        sizeof(libfilter_taffy_cuckoo_slot) * j]));
+        }
+      }
+#endif
+    }
+    from += side_bytes;
+  }
+  return 0;
+}
+
+int libfilter_taffy_cuckoo_deserialize(uint64_t size_in_bytes, const char* from,
+                                       libfilter_taffy_cuckoo* to) {
+  return libfilter_taffy_cuckoo_deserialize_help(size_in_bytes, from, false, to);
+}
+
+int libfilter_taffy_cuckoo_deserialize_adopt(uint64_t size_in_bytes, char* from,
+                                             libfilter_taffy_cuckoo* to) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // The buckets are read and written in place as uint64_t, some of them atomically
+  if ((uintptr_t)from % sizeof(uint64_t) != 0) {
+    memset(to, 0, sizeof(*to));
+    return -1;
+  }
+  return libfilter_taffy_cuckoo_deserialize_help(size_in_bytes, from, true, to);
+#else
+  memset(to, 0, sizeof(*to));
+  return -1;
+#endif
+}
+
+// The frozen layout shares the first 16 bytes (with a different magic number and
+// version), then:
+//
+//  16: feistel keys for side 0 then side 1 (2 x 4 x 8)
+//  80: stash sizes (2 x 8)
+//  96: stash capacities (2 x 8)
+// 112: for side 0 then side 1, the stash hash table (8 bytes per entry, as in memory),
+//      followed by the overflow bitmap if the stash is not empty
+//
+// followed by the buckets of side 0 and then side 1, each packed into 5 bytes.
+
+// The bytes of the stash and overflow bitmap of side i in the frozen layout
+static uint64_t libfilter_frozen_taffy_cuckoo_stash_bytes(
+    const libfilter_frozen_taffy_cuckoo* here, int i) {
+  return sizeof(uint64_t) * here->stash_capacity_[i] +
+         ((here->stash_size_[i] == 0) ? 0
+                                      : libfilter_overflow_bytes(here->log_side_size_));
+}
+
+uint64_t libfilter_frozen_taffy_cuckoo_serialized_size(
+    const libfilter_frozen_taffy_cuckoo* here) {
+  return kFrozenTaffyCuckooHeaderBytes +
+         libfilter_frozen_taffy_cuckoo_stash_bytes(here, 0) +
+         libfilter_frozen_taffy_cuckoo_stash_bytes(here, 1) +
+         2 * (sizeof(libfilter_frozen_taffy_cuckoo_bucket) << here->log_side_size_);
+}
+
+void libfilter_frozen_taffy_cuckoo_serialize(const libfilter_frozen_taffy_cuckoo* here,
+                                             char* to) {
+  libfilter_taffy_cuckoo_store_preamble(kFrozenTaffyCuckooMagic, kFrozenTaffyCuckooVersion,
+                                        here->log_side_size_, to);
+  to += 16;
+  for (int s = 0; s < 2; ++s) {
+    for (int i = 0; i < 2; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        libfilter_store_le(here->hash_[s].keys[i][j], 8, to);
+        to += 8;
+      }
+    }
+  }
+  for (int s = 0; s < 2; ++s) {
+    libfilter_store_le(here->stash_size_[s], 8, to);
+    to += 8;
+  }
+  for (int s = 0; s < 2; ++s) {
+    libfilter_store_le(here->stash_capacity_[s], 8, to);
+    to += 8;
+  }
+  for (int s = 0; s < 2; ++s) {
+    for (size_t i = 0; i < here->stash_capacity_[s]; ++i) {
+      libfilter_store_le(here->stash_[s][i], 8, to);
+      to += 8;
+    }
+    if (here->stash_size_[s] == 0) continue;
+    for (uint64_t i = 0; i < libfilter_overflow_bytes(here->log_side_size_) / 8; ++i) {
+      libfilter_store_le(here->overflow_[s][i], 8, to);
+      to += 8;
+    }
+  }
+  const uint64_t side_bytes = sizeof(libfilter_frozen_taffy_cuckoo_bucket)
+                              << here->log_side_size_;
+  for (int s = 0; s < 2; ++s) {
+    // The buckets are always serialized packed
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (here->layout_ == libfilter_frozen_taffy_cuckoo_packed) {
+      memcpy(to, here->data_[s], side_bytes);
+      to += side_bytes;
+      continue;
+    }
+#endif
+    for (uint64_t i = 0; i < (1ul << here->log_side_size_); ++i) {
+      const libfilter_frozen_taffy_cuckoo_bucket* b =
+          libfilter_frozen_taffy_cuckoo_bucket_at(here, s, i);
+      libfilter_store_le(
+          (uint64_t)b->zero | ((uint64_t)b->one << libfilter_taffy_cuckoo_head_size) |
+              ((uint64_t)b->two << (2 * libfilter_taffy_cuckoo_head_size)) |
+              ((uint64_t)b->three << (3 * libfilter_taffy_cuckoo_head_size)),
+                         sizeof(*b), &to[sizeof(*b) * i]);
+    }
+    to += side_bytes;
+  }
+}
+
+// Reads n 8-byte words, in place if adopt
+static uint64_t* libfilter_load_words(const char* from, uint64_t n, bool adopt) {
+  if (adopt) return (uint64_t*)from;
+  uint64_t* result = (uint64_t*)libfilter_huge_calloc(n * sizeof(uint64_t));
+  for (uint64_t i = 0; i < n; ++i) result[i] = libfilter_load_le(8, &from[8 * i]);
+  return result;
+}
+
+static int libfilter_frozen_taffy_cuckoo_deserialize_help(
+    uint64_t size_in_bytes, const char* from, bool adopt,
+    libfilter_frozen_taffy_cuckoo* to) {
+  // Leave "to" safe to destruct, even on error
+  memset(to, 0, sizeof(*to));
+  const int log_side_size =
+      libfilter_taffy_cuckoo_load_preamble(kFrozenTaffyCuckooMagic, kFrozenTaffyCuckooVersion,
+                                           size_in_bytes, from);
+  if (log_side_size < 0) return -1;
+  if (size_in_bytes < kFrozenTaffyCuckooHeaderBytes) return -1;
+  const uint64_t side_bytes = sizeof(libfilter_frozen_taffy_cuckoo_bucket)
+                              << log_side_size;
+  to->log_side_size_ = log_side_size;
+  uint64_t expected = kFrozenTaffyCuckooHeaderBytes;
+  for (int s = 0; s < 2; ++s) {
+    to->stash_size_[s] = libfilter_load_le(8, &from[80 + 8 * s]);
+    to->stash_capacity_[s] = libfilter_load_le(8, &from[96 + 8 * s]);
+    const uint64_t capacity = to->stash_capacity_[s];
+    // Every probe sequence must end at an empty entry. Also avoids overflow in computing
+    // the expected size.
+    if (capacity > size_in_bytes / sizeof(uint64_t)) return -1;
+    if ((capacity & (capacity - 1)) != 0 || 2 * to->stash_size_[s] > capacity) return -1;
+    if ((to->stash_size_[s] == 0) != (capacity == 0)) return -1;
+    expected += libfilter_frozen_taffy_cuckoo_stash_bytes(to, s);
+  }
+  if (side_bytes > size_in_bytes || expected + 2 * side_bytes != size_in_bytes) {
+    return -1;
+  }
+
+  to->borrowed_ = adopt;
+  const char* keys = &from[16];
+  for (int s = 0; s < 2; ++s) {
+    for (int i = 0; i < 2; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        to->hash_[s].keys[i][j] = libfilter_load_le(8, keys);
+        keys += 8;
+      }
+    }
+  }
+  from += kFrozenTaffyCuckooHeaderBytes;
+  for (int s = 0; s < 2; ++s) {
+    if (to->stash_size_[s] == 0) continue;
+    to->stash_[s] = libfilter_load_words(from, to->stash_capacity_[s], adopt);
+    from += sizeof(uint64_t) * to->stash_capacity_[s];
+    to->overflow_[s] = libfilter_load_words(
+        from, libfilter_overflow_bytes(log_side_size) / sizeof(uint64_t), adopt);
+    from += libfilter_overflow_bytes(log_side_size);
+    uint64_t used = 0;
+    for (size_t i = 0; i < to->stash_capacity_[s]; ++i) {
+      used += (to->stash_[s][i] != UINT64_MAX);
+    }
+    if (used != to->stash_size_[s]) return -1;
+  }
+  for (int s = 0; s < 2; ++s) {
+    if (adopt) {
+      to->data_[s] = (libfilter_frozen_taffy_cuckoo_bucket*)from;
+    } else {
+      to->data_[s] =
+          (libfilter_frozen_taffy_cuckoo_bucket*)libfilter_huge_calloc(side_bytes);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      memcpy(to->data_[s], from, side_bytes);
+#else
+      for (uint64_t i = 0; i < (1ul << log_side_size); ++i) {
+        libfilter_frozen_taffy_cuckoo_bucket* b = &to->data_[s][i];
+        const uint64_t w = libfilter_load_le(sizeof(*b), &from[sizeof(*b) * i]);
+        b->zero = w;
+        b->one = w >> libfilter_taffy_cuckoo_head_size;
+        b->two = w >> (2 * libfilter_taffy_cuckoo_head_size);
+        b->three = w >> (3 * libfilter_taffy_cuckoo_head_size);
+      }
+#endif
+    }
+    from += side_bytes;
+  }
+  return 0;
+}
+
+int libfilter_frozen_taffy_cuckoo_deserialize(uint64_t size_in_bytes, const char* from,
+                                              libfilter_frozen_taffy_cuckoo* to) {
+  return libfilter_frozen_taffy_cuckoo_deserialize_help(size_in_bytes, from, false, to);
+}
+
+int libfilter_frozen_taffy_cuckoo_deserialize_adopt(uint64_t size_in_bytes,
+                                                    const char* from,
+                                                    libfilter_frozen_taffy_cuckoo* to) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // The stashes and overflow bitmaps are read in place as uint64_t
+  if ((uintptr_t)from % sizeof(uint64_t) != 0) {
+    memset(to, 0, sizeof(*to));
+    return -1;
+  }
+  return libfilter_frozen_taffy_cuckoo_deserialize_help(size_in_bytes, from, true, to);
+#else
+  memset(to, 0, sizeof(*to));
+  return -1;
+#endif
 }
@@ -0,0 +1,175 @@
+// This is a benchmark of how insert and find throughput in a shared taffy cuckoo filter
+// scale with the number of threads. The results are printed to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// filter_name, threads, ndv, bytes, sample_type, payload
+//
+// The sample_type can be "inserts_per_second" or "finds_per_second". Each is the total
+// over all threads. The inserts start from an empty filter, so they include upsizes.
+
+#include <chrono>        // for duration, steady_clock
+#include <cstdint>       // for uint64_t
+#include <iostream>      // for operator<<, basic_ostream, endl, istr...
+#include <mutex>         // for lock_guard
+#include <shared_mutex>  // for shared_timed_mutex, shared_lock
+#include <sstream>       // for basic_istringstream
+#include <string>        // for string, operator<<, operator==
+#include <thread>        // for thread
+#include <vector>        // for vector, allocator
+
+#include "filter/taffy-cuckoo.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string filter_name = "", sample_type = "";
+  uint64_t threads = 0;
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double payload = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] = "filter_name,threads,ndv,bytes,sample_type,payload";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(filter_name) << ",";
+    o << threads << "," << ndv << "," << bytes << ",";
+    o << EscapedName(sample_type) << ",";
+    o << payload;
+    return o.str();
+  }
+};
+
+// The baseline: a TaffyCuckooFilter behind an external reader-writer lock.
+struct LockedTaffyCuckooShim {
+  TaffyCuckooFilter payload;
+  mutable shared_timed_mutex lock;
+  static string Name() {
+    thread_local static const string result = "LockedTaffyCuckoo";
+    return result;
+  }
+  bool InsertHash(uint64_t h) {
+    lock_guard<shared_timed_mutex> guard(lock);
+    return payload.InsertHash(h);
+  }
+  bool FindHash(uint64_t h) const {
+    shared_lock<shared_timed_mutex> guard(lock);
+    return payload.FindHash(h);
+  }
+  uint64_t SizeInBytes() const { return payload.SizeInBytes(); }
+  LockedTaffyCuckooShim() : payload(TaffyCuckooFilter::CreateWithBytes(0)) {}
+};
+
+// Runs f(t, begin, end) on each of "threads" threads, with [begin, end) being that
+// thread's share of [0, n), and returns the elapsed seconds
+template <typename F>
+double Split(unsigned threads, uint64_t n, const F& f) {
+  chrono::steady_clock s;
+  vector<thread> workers;
+  const auto start = s.now();
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() { f(t, n * t / threads, n * (t + 1) / threads); });
+  }
+  for (auto& w : workers) w.join();
+  const auto finish = s.now();
+  return static_cast<chrono::duration<double>>(finish - start).count();
+}
+
+// Inserts all of to_insert, then finds everything in to_find, each split over "threads"
+// threads, then prints the statistics.
+template <typename FILTER_TYPE>
+void BenchHelp(unsigned threads, const vector<uint64_t>& to_insert,
+               const vector<uint64_t>& to_find, FILTER_TYPE& filter) {
+  Sample base;
+  base.filter_name = FILTER_TYPE::Name();
+  base.threads = threads;
+  base.ndv = to_insert.size();
+
+  double seconds = Split(threads, to_insert.size(), [&](unsigned, uint64_t begin, uint64_t end) {
+    for (uint64_t i = begin; i < end; ++i) filter.InsertHash(to_insert[i]);
+  });
+  base.bytes = filter.SizeInBytes();
+  base.sample_type = "inserts_per_second";
+  base.payload = to_insert.size() / seconds;
+  cout << base.CSV() << endl;
+
+  vector<uint64_t> found(threads);
+  seconds = Split(threads, to_find.size(), [&](unsigned t, uint64_t begin, uint64_t end) {
+    uint64_t f = 0;
+    for (uint64_t i = begin; i < end; ++i) f += filter.FindHash(to_find[i]);
+    found[t] = f;
+  });
+  base.sample_type = "finds_per_second";
+  base.payload = to_find.size() / seconds;
+  cout << base.CSV() << endl;
+  // Force the FindHash value to be calculated:
+  uint64_t total_found = 0;
+  for (auto f : found) total_found += f;
+  if (total_found > to_find.size()) cerr << "impossible" << endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+  err:
+    cerr << "one optional flag (--print_header) and two required flags: --ndv, "
+            "--threads\n";
+    return 1;
+  }
+  uint64_t ndv = 0, threads = 0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--threads")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> threads)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0 or threads == 0) goto err;
+
+  Rand r;
+  vector<uint64_t> to_insert, to_find;
+  for (uint64_t i = 0; i < ndv; ++i) to_insert.push_back(r());
+  // Half present, half (almost certainly) absent
+  for (uint64_t i = 0; i < ndv; ++i) to_find.push_back((i & 1) ? r() : to_insert[i]);
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  // Threads are doubled each round
+  for (uint64_t n = 1; n <= threads; n *= 2) {
+    {
+      auto filter = ConcurrentTaffyCuckooFilter::CreateWithBytes(0);
+      BenchHelp(n, to_insert, to_find, filter);
+    }
+    {
+      LockedTaffyCuckooShim filter;
+      BenchHelp(n, to_insert, to_find, filter);
+    }
+  }
+}
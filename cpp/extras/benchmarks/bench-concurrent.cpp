@@ -0,0 +1,201 @@
+// This is a benchmark of find throughput in a filter that is growing because another
+// thread is inserting into it at the same time. The results are printed to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// filter_name, readers, ndv, bytes, sample_type, payload
+//
+// The sample_type can be "insert_nanos", "find_nanos", or "finds_per_second".
+// "find_nanos" is the mean time per find within one reader thread, while
+// "finds_per_second" is the total over all reader threads.
+
+#include <atomic>              // for atomic
+#include <chrono>              // for nanoseconds, duration, duration_cast
+#include <cstdint>             // for uint64_t
+#include <iostream>            // for operator<<, basic_ostream, endl, istr...
+#include <mutex>               // for lock_guard
+#include <shared_mutex>        // for shared_timed_mutex, shared_lock
+#include <sstream>             // for basic_istringstream
+#include <string>              // for string, operator<<, operator==
+#include <thread>              // for thread
+#include <vector>              // for vector, allocator
+
+#include "filter/taffy-block.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string filter_name = "", sample_type = "";
+  uint64_t readers = 0;
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double payload = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] = "filter_name,readers,ndv,bytes,sample_type,payload";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(filter_name) << ",";
+    o << readers << "," << ndv << "," << bytes << ",";
+    o << EscapedName(sample_type) << ",";
+    o << payload;
+    return o.str();
+  }
+};
+
+// The baseline: a TaffyBlockFilter behind an external reader-writer lock.
+struct LockedTaffyBlockShim {
+  TaffyBlockFilter payload;
+  mutable shared_timed_mutex lock;
+  static string Name() {
+    thread_local static const string result = "LockedTaffyBlock";
+    return result;
+  }
+  bool InsertHash(uint64_t h) {
+    lock_guard<shared_timed_mutex> guard(lock);
+    return payload.InsertHash(h);
+  }
+  bool FindHash(uint64_t h) const {
+    shared_lock<shared_timed_mutex> guard(lock);
+    return payload.FindHash(h);
+  }
+  uint64_t SizeInBytes() const { return payload.SizeInBytes(); }
+  LockedTaffyBlockShim(uint64_t ndv, double fpp)
+      : payload(TaffyBlockFilter::CreateWithNdvFpp(ndv, fpp)) {}
+};
+
+// Inserts all of to_insert on this thread while `readers` threads look up values from
+// to_find, then prints the statistics.
+template <typename FILTER_TYPE>
+void BenchHelp(unsigned readers, const vector<uint64_t>& to_insert,
+               const vector<uint64_t>& to_find, FILTER_TYPE& filter) {
+  Sample base;
+  base.filter_name = FILTER_TYPE::Name();
+  base.readers = readers;
+  base.ndv = to_insert.size();
+
+  chrono::steady_clock s;
+  atomic<bool> done{false};
+  vector<uint64_t> finds(readers), found(readers);
+  vector<double> find_seconds(readers);
+  vector<thread> threads;
+  for (unsigned t = 0; t < readers; ++t) {
+    threads.emplace_back([&, t]() {
+      uint64_t n = 0, f = 0;
+      size_t i = (t * to_find.size()) / readers;
+      const auto start = s.now();
+      while (not done.load(memory_order_relaxed)) {
+        f += filter.FindHash(to_find[i]);
+        ++i;
+        if (i == to_find.size()) i = 0;
+        ++n;
+      }
+      const auto finish = s.now();
+      finds[t] = n;
+      found[t] = f;
+      find_seconds[t] = static_cast<chrono::duration<double>>(finish - start).count();
+    });
+  }
+
+  const auto start = s.now();
+  for (uint64_t h : to_insert) filter.InsertHash(h);
+  const auto finish = s.now();
+  done = true;
+  for (auto& t : threads) t.join();
+
+  base.bytes = filter.SizeInBytes();
+  base.sample_type = "insert_nanos";
+  base.payload =
+      1.0 * chrono::duration_cast<chrono::nanoseconds>(finish - start).count() /
+      to_insert.size();
+  cout << base.CSV() << endl;
+
+  if (readers == 0) return;
+  uint64_t total_finds = 0, total_found = 0;
+  double per_find = 0, per_second = 0;
+  for (unsigned t = 0; t < readers; ++t) {
+    total_finds += finds[t];
+    total_found += found[t];
+    per_find += find_seconds[t] * 1000 * 1000 * 1000 / finds[t] / readers;
+    per_second += finds[t] / find_seconds[t];
+  }
+  base.sample_type = "find_nanos";
+  base.payload = per_find;
+  cout << base.CSV() << endl;
+  base.sample_type = "finds_per_second";
+  base.payload = per_second;
+  cout << base.CSV() << endl;
+  // Force the FindHash value to be calculated:
+  if (total_found > total_finds) cerr << "impossible" << endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 7) {
+  err:
+    cerr << "one optional flag (--print_header) and three required flags: --ndv, "
+            "--readers, --fpp\n";
+    return 1;
+  }
+  uint64_t ndv = 0, readers = 0;
+  double fpp = 0.0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--readers")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> readers)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--fpp")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> fpp)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0 or readers == 0 or fpp == 0) goto err;
+
+  Rand r;
+  vector<uint64_t> to_insert, to_find;
+  for (uint64_t i = 0; i < ndv; ++i) to_insert.push_back(r());
+  for (uint64_t i = 0; i < 1000 * 1000; ++i) to_find.push_back(r());
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  // Readers are doubled each round, starting from 0 to get the uncontended insert time.
+  for (uint64_t n = 0; n <= readers; n = (n == 0) ? 1 : 2 * n) {
+    {
+      // Start small so that the filter upsizes while it is being read.
+      auto filter = ConcurrentTaffyBlockFilter::CreateWithNdvFpp(32, fpp);
+      BenchHelp(n, to_insert, to_find, filter);
+    }
+    {
+      LockedTaffyBlockShim filter(32, fpp);
+      BenchHelp(n, to_insert, to_find, filter);
+    }
+  }
+}
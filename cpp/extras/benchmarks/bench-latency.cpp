@@ -0,0 +1,132 @@
+// This is a benchmark of the latency of individual inserts into growable filters,
+// including the inserts that cause a filter to upsize. The results are printed to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// filter_name, ndv, bytes, sample_type, payload
+//
+// The sample_type is either a quantile of insert latency, like "p999_nanos", or a line of
+// the histogram of insert latencies, like "le_1024_nanos", in which case the payload is
+// the number of inserts that took at most 1024 and more than 512 nanoseconds.
+
+#include <algorithm>  // for sort
+#include <chrono>     // for nanoseconds, duration, duration_cast
+#include <cstdint>    // for uint64_t
+#include <iostream>   // for operator<<, basic_ostream, endl, istr...
+#include <sstream>    // for basic_istringstream
+#include <string>     // for string, operator<<, operator==
+#include <vector>     // for vector, allocator
+
+#include "filter/taffy-cuckoo.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string filter_name = "", sample_type = "";
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double payload = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] = "filter_name,ndv,bytes,sample_type,payload";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(filter_name) << ",";
+    o << ndv << "," << bytes << ",";
+    o << EscapedName(sample_type) << ",";
+    o << payload;
+    return o.str();
+  }
+};
+
+template <typename FILTER_TYPE>
+void BenchHelp(const vector<uint64_t>& to_insert) {
+  Sample base;
+  base.filter_name = FILTER_TYPE::Name();
+  base.ndv = to_insert.size();
+
+  auto filter = FILTER_TYPE::CreateWithBytes(0);
+  chrono::steady_clock s;
+  vector<uint64_t> nanos;
+  nanos.reserve(to_insert.size());
+  for (uint64_t h : to_insert) {
+    const auto start = s.now();
+    filter.InsertHash(h);
+    const auto finish = s.now();
+    nanos.push_back(chrono::duration_cast<chrono::nanoseconds>(finish - start).count());
+  }
+  base.bytes = filter.SizeInBytes();
+
+  sort(nanos.begin(), nanos.end());
+  const struct {
+    const char* name;
+    double quantile;
+  } kQuantiles[] = {{"p50_nanos", 0.5},      {"p90_nanos", 0.9},
+                    {"p99_nanos", 0.99},     {"p999_nanos", 0.999},
+                    {"p9999_nanos", 0.9999}, {"max_nanos", 1.0}};
+  for (const auto& q : kQuantiles) {
+    base.sample_type = q.name;
+    base.payload = nanos[static_cast<size_t>(q.quantile * (nanos.size() - 1))];
+    cout << base.CSV() << endl;
+  }
+
+  // Powers of two, since the upsizes are orders of magnitude slower than most inserts
+  size_t i = 0;
+  for (uint64_t limit = 1; i < nanos.size(); limit *= 2) {
+    uint64_t count = 0;
+    for (; i < nanos.size() and nanos[i] <= limit; ++i) ++count;
+    if (count == 0) continue;
+    base.sample_type = "le_" + to_string(limit) + "_nanos";
+    base.payload = count;
+    cout << base.CSV() << endl;
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+  err:
+    cerr << "one optional flag (--print_header) and one required flag: --ndv\n";
+    return 1;
+  }
+  uint64_t ndv = 0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0) goto err;
+
+  Rand r;
+  vector<uint64_t> to_insert;
+  for (uint64_t i = 0; i < ndv; ++i) to_insert.push_back(r());
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  BenchHelp<TaffyCuckooFilter>(to_insert);
+  BenchHelp<IncrementalTaffyCuckooFilter>(to_insert);
+  BenchHelp<InPlaceTaffyCuckooFilter>(to_insert);
+}
@@ -0,0 +1,131 @@
+// This is a benchmark of the peak memory used by growable filters, which is reached
+// during their upsizes. The results are printed to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// filter_name, ndv, bytes, sample_type, payload
+//
+// The sample_type can be "insert_nanos", "start_rss_bytes", or "peak_rss_bytes". Each
+// filter is built in its own process, starting from the smallest size, so the peak
+// resident set size of that process is the peak for that filter, plus start_rss_bytes.
+
+#include <sys/resource.h>  // for getrusage, rusage
+#include <sys/wait.h>      // for waitpid
+#include <unistd.h>        // for fork, _exit
+
+#include <chrono>    // for nanoseconds, duration, duration_cast
+#include <cstdint>   // for uint64_t
+#include <iostream>  // for operator<<, basic_ostream, endl, istr...
+#include <sstream>   // for basic_istringstream
+#include <string>    // for string, operator<<, operator==
+
+#include "filter/taffy-cuckoo.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string filter_name = "", sample_type = "";
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double payload = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] = "filter_name,ndv,bytes,sample_type,payload";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(filter_name) << ",";
+    o << ndv << "," << bytes << ",";
+    o << EscapedName(sample_type) << ",";
+    o << payload;
+    return o.str();
+  }
+};
+
+// The peak resident set size of this process so far
+uint64_t PeakRssBytes() {
+  rusage u;
+  getrusage(RUSAGE_SELF, &u);
+  // ru_maxrss is in kilobytes on Linux
+  return 1024 * static_cast<uint64_t>(u.ru_maxrss);
+}
+
+// Inserts ndv keys in a child process, so that the peak resident set size is that of
+// this filter alone. The keys are generated as they are inserted, so they take no space.
+template <typename FILTER_TYPE>
+void BenchHelp(uint64_t ndv) {
+  cout.flush();
+  const pid_t child = fork();
+  if (child != 0) {
+    waitpid(child, nullptr, 0);
+    return;
+  }
+  Sample base;
+  base.filter_name = FILTER_TYPE::Name();
+  base.ndv = ndv;
+  const uint64_t start_rss = PeakRssBytes();
+
+  Rand r;
+  auto filter = FILTER_TYPE::CreateWithBytes(0);
+  chrono::steady_clock s;
+  const auto start = s.now();
+  for (uint64_t i = 0; i < ndv; ++i) filter.InsertHash(r());
+  const auto finish = s.now();
+  base.bytes = filter.SizeInBytes();
+
+  base.sample_type = "insert_nanos";
+  base.payload =
+      1.0 * chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / ndv;
+  cout << base.CSV() << endl;
+  base.sample_type = "start_rss_bytes";
+  base.payload = start_rss;
+  cout << base.CSV() << endl;
+  base.sample_type = "peak_rss_bytes";
+  base.payload = PeakRssBytes();
+  cout << base.CSV() << endl;
+  _exit(0);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+  err:
+    cerr << "one optional flag (--print_header) and one required flag: --ndv\n";
+    return 1;
+  }
+  uint64_t ndv = 0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0) goto err;
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  BenchHelp<TaffyCuckooFilter>(ndv);
+  BenchHelp<InPlaceTaffyCuckooFilter>(ndv);
+  BenchHelp<IncrementalTaffyCuckooFilter>(ndv);
+}
@@ -0,0 +1,121 @@
+// This is a benchmark of how upsizing and union of taffy cuckoo filters scale with the
+// number of threads. The results are printed to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// operation, threads, ndv, bytes, seconds
+//
+// The operation is either "upsize", which doubles a filter holding ndv items, or "union",
+// which unions two filters each holding ndv items.
+
+#include <chrono>    // for duration, steady_clock
+#include <cstdint>   // for uint64_t
+#include <iostream>  // for operator<<, basic_ostream, endl, istr...
+#include <sstream>   // for basic_istringstream
+#include <string>    // for string, operator<<, operator==
+#include <vector>    // for vector, allocator
+
+#include "filter/taffy-cuckoo.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string operation = "";
+  uint64_t threads = 0;
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double seconds = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] = "operation,threads,ndv,bytes,seconds";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(operation) << ",";
+    o << threads << "," << ndv << "," << bytes << ",";
+    o << seconds;
+    return o.str();
+  }
+};
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+  err:
+    cerr << "one optional flag (--print_header) and two required flags: --ndv, "
+            "--threads\n";
+    return 1;
+  }
+  uint64_t ndv = 0, threads = 0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--threads")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> threads)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0 or threads == 0) goto err;
+
+  Rand r;
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  auto y = TaffyCuckooFilter::CreateWithBytes(0);
+  x.SetUpsizeThreads(threads);
+  y.SetUpsizeThreads(threads);
+  for (uint64_t i = 0; i < ndv; ++i) {
+    x.InsertHash(r());
+    y.InsertHash(r());
+  }
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  chrono::steady_clock s;
+  for (uint64_t n = 1; n <= threads; n *= 2) {
+    Sample result;
+    result.threads = n;
+    result.ndv = ndv;
+    {
+      TaffyCuckooFilter z = x;
+      const auto start = s.now();
+      libfilter_taffy_cuckoo_upsize_parallel(&z.b, n);
+      const auto finish = s.now();
+      result.operation = "upsize";
+      result.bytes = z.SizeInBytes();
+      result.seconds = static_cast<chrono::duration<double>>(finish - start).count();
+      cout << result.CSV() << endl;
+    }
+    {
+      const auto start = s.now();
+      auto z = Union(x, y, n);
+      const auto finish = s.now();
+      result.operation = "union";
+      result.bytes = z.SizeInBytes();
+      result.seconds = static_cast<chrono::duration<double>>(finish - start).count();
+      cout << result.CSV() << endl;
+    }
+  }
+}
@@ -0,0 +1,149 @@
+// This is a benchmark of the trade-off between insert time, space, and false positive
+// probability that the growth policy of a taffy cuckoo filter makes. It builds a filter
+// of each type for each policy in a sweep and prints the results to stdout.
+//
+// The output is CSV. Each line has the form
+//
+// filter_name, max_load, ttl, max_stash, growth_steps, ndv, bytes, sample_type, payload
+//
+// The sample_type can be "insert_nanos" or "fpp". See libfilter_taffy_cuckoo_policy for
+// the meaning of the policy columns.
+
+#include <chrono>    // for nanoseconds, duration, duration_cast
+#include <cstdint>   // for uint64_t
+#include <iostream>  // for operator<<, basic_ostream, endl, istr...
+#include <sstream>   // for basic_istringstream
+#include <string>    // for string, operator<<, operator==
+
+#include "filter/minimal-taffy-cuckoo.hpp"
+#include "filter/taffy-cuckoo.hpp"
+#include "util.hpp"  // for Rand
+
+using namespace filter;
+
+using namespace std;
+
+struct Sample {
+  string filter_name = "", sample_type = "";
+  libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+  uint64_t ndv = 0;
+  uint64_t bytes = 0;
+  double payload = 0.0;
+
+  static const char* kHeader() {
+    static const char result[] =
+        "filter_name,max_load,ttl,max_stash,growth_steps,ndv,bytes,sample_type,payload";
+    return result;
+  };
+
+  // Escape quotation marks in strings
+  static string EscapedName(const string& x) {
+    string result = "\"";
+    for (char c : x) {
+      result += c;
+      if (c == '"') result += "\"";
+    }
+    result += "\"";
+    return result;
+  }
+
+  string CSV() const {
+    ostringstream o;
+    o << EscapedName(filter_name) << ",";
+    o << policy.max_load << "," << policy.ttl << "," << policy.max_stash << ","
+      << policy.growth_steps << ",";
+    o << ndv << "," << bytes << ",";
+    o << EscapedName(sample_type) << ",";
+    o << payload;
+    return o.str();
+  }
+};
+
+// The keys looked up to measure the fpp, none of which were inserted
+static const uint64_t kFppKeys = 1000 * 1000;
+
+template <typename FILTER_TYPE>
+void BenchHelp(uint64_t ndv, const libfilter_taffy_cuckoo_policy& policy) {
+  Sample base;
+  base.filter_name = FILTER_TYPE::Name();
+  base.policy = policy;
+  base.ndv = ndv;
+
+  Rand r;
+  auto filter = FILTER_TYPE::CreateWithBytes(0, policy);
+  chrono::steady_clock s;
+  const auto start = s.now();
+  for (uint64_t i = 0; i < ndv; ++i) filter.InsertHash(r());
+  const auto finish = s.now();
+  base.bytes = filter.SizeInBytes();
+
+  base.sample_type = "insert_nanos";
+  base.payload =
+      1.0 * chrono::duration_cast<chrono::nanoseconds>(finish - start).count() / ndv;
+  cout << base.CSV() << endl;
+
+  // r continues past the inserted keys, so these are distinct from them
+  uint64_t found = 0;
+  for (uint64_t i = 0; i < kFppKeys; ++i) found += filter.FindHash(r());
+  base.sample_type = "fpp";
+  base.payload = 1.0 * found / kFppKeys;
+  cout << base.CSV() << endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+  err:
+    cerr << "one optional flag (--print_header) and one required flag: --ndv\n";
+    return 1;
+  }
+  uint64_t ndv = 0;
+  bool print_header = false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i] == string("--ndv")) {
+      ++i;
+      auto s = istringstream(argv[i]);
+      if (not(s >> ndv)) goto err;
+      if (not s.eof()) goto err;
+    } else if (argv[i] == string("--print_header")) {
+      print_header = true;
+    } else {
+      goto err;
+    }
+  }
+  if (ndv == 0) goto err;
+
+  if (print_header) cout << Sample::kHeader() << endl;
+  // Each dimension is swept with the others at their defaults
+  libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+  for (double max_load : {0.80, 0.85, 0.90, 0.94}) {
+    policy.max_load = max_load;
+    BenchHelp<TaffyCuckooFilter>(ndv, policy);
+  }
+  policy = libfilter_taffy_cuckoo_default_policy();
+  for (int ttl : {8, 16, 64, 128}) {
+    policy.ttl = ttl;
+    BenchHelp<TaffyCuckooFilter>(ndv, policy);
+  }
+  policy = libfilter_taffy_cuckoo_default_policy();
+  for (size_t max_stash : {2, 32}) {
+    policy.max_stash = max_stash;
+    BenchHelp<TaffyCuckooFilter>(ndv, policy);
+  }
+  policy = libfilter_taffy_cuckoo_default_policy();
+  policy.growth_steps = 2;
+  BenchHelp<TaffyCuckooFilter>(ndv, policy);
+
+  policy = libfilter_minimal_taffy_cuckoo_default_policy();
+  for (double max_load : {0.80, 0.85, 0.90, 0.94}) {
+    policy.max_load = max_load;
+    BenchHelp<MinimalTaffyCuckooFilter>(ndv, policy);
+  }
+  policy = libfilter_minimal_taffy_cuckoo_default_policy();
+  for (int ttl : {32, 64, 256}) {
+    policy.ttl = ttl;
+    BenchHelp<MinimalTaffyCuckooFilter>(ndv, policy);
+  }
+  policy = libfilter_minimal_taffy_cuckoo_default_policy();
+  policy.growth_steps = 4;
+  BenchHelp<MinimalTaffyCuckooFilter>(ndv, policy);
+}
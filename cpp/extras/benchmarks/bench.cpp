@@ -5,7 +5,8 @@
 //
 // filter_name, ndv, bytes, sample_type, payload
 //
-// The sample_type can be "insert_nanos", "find_nanos", or "fpp".
+// The sample_type can be "insert_nanos", "find_nanos", or "fpp". Filters with batched
+// lookups also report "find_missing_batch_nanos".
 
 #include <algorithm>
 #include <chrono>    // for nanoseconds, duration, duration_cast
@@ -22,6 +23,7 @@
 #include "filter/block.hpp"  // for BlockFilter, ScalarBlockFilter (ptr o...
 #include "filter/minimal-taffy-cuckoo.hpp"
 #include "filter/taffy-block.hpp"
+#include "filter/taffy-cuckoo-t.hpp"
 #include "filter/taffy-cuckoo.hpp"
 #if defined(__x86_64)
 #include "filter/taffy-vector-quotient.hpp"
@@ -43,6 +45,10 @@ using namespace std;
 // focus on the find cost only.
 //
 // "to_ins_base" is the same, but for the present elements.
+//
+// "find_missing_batch_nanos" is find_missing_nanos, but with the absent elements looked
+// up in batches of kBatchSize. It is only reported by filters with a FindHashBatch
+// method, and includes the same baseline cost as to_fin_base.
 struct Sample {
   string filter_name = "", sample_type = "";
   uint64_t ndv_start = 0;
@@ -117,6 +123,78 @@ struct Cuckoo32Shim {
   static Cuckoo32Shim CreateWithNdvFpp(uint64_t, double) { return Cuckoo32Shim(0); }
 };
 
+// A frozen taffy cuckoo filter, which cannot be inserted into. Inserts go to an unfrozen
+// filter, which is refrozen by SizeInBytes, since BenchHelp calls that after each round
+// of inserts and before any finds. Thus insert_nanos is the same as TaffyCuckoo's.
+template <libfilter_frozen_taffy_cuckoo_layout LAYOUT>
+struct FrozenTaffyCuckooShim {
+  TaffyCuckooFilter payload;
+  FrozenTaffyCuckoo frozen;
+  static string Name() {
+    thread_local static const string result =
+        (LAYOUT == libfilter_frozen_taffy_cuckoo_aligned ? "Aligned" : "") +
+        string(FrozenTaffyCuckoo::Name());
+    return result;
+  }
+  bool InsertHash(uint64_t h) { return payload.InsertHash(h); }
+  uint64_t SizeInBytes() {
+    frozen = payload.Freeze(LAYOUT);
+    return frozen.SizeInBytes();
+  }
+  bool FindHash(uint64_t h) const { return frozen.FindHash(h); }
+  explicit FrozenTaffyCuckooShim(uint64_t bytes)
+      : payload(TaffyCuckooFilter::CreateWithBytes(bytes)), frozen(payload.Freeze(LAYOUT)) {}
+  static FrozenTaffyCuckooShim CreateWithBytes(uint64_t bytes) {
+    return FrozenTaffyCuckooShim(bytes);
+  }
+};
+
+// A taffy cuckoo filter converted to a static filter, rebuilt by SizeInBytes just as
+// FrozenTaffyCuckooShim is refrozen
+struct StaticTaffyCuckooShim {
+  TaffyCuckooFilter payload;
+  StaticTaffyCuckoo frozen;
+  static string Name() { return StaticTaffyCuckoo::Name(); }
+  bool InsertHash(uint64_t h) { return payload.InsertHash(h); }
+  uint64_t SizeInBytes() {
+    frozen = payload.ToStatic();
+    return frozen.SizeInBytes();
+  }
+  bool FindHash(uint64_t h) const { return frozen.FindHash(h); }
+  explicit StaticTaffyCuckooShim(uint64_t bytes)
+      : payload(TaffyCuckooFilter::CreateWithBytes(bytes)), frozen(payload.ToStatic()) {}
+  static StaticTaffyCuckooShim CreateWithBytes(uint64_t bytes) {
+    return StaticTaffyCuckooShim(bytes);
+  }
+};
+
+static const size_t kBatchSize = 1024;
+
+// Returns false if the filter has no batched lookup
+template <typename FILTER_TYPE>
+bool FindBatch(const FILTER_TYPE&, const uint64_t*, size_t, bool*) {
+  return false;
+}
+
+bool FindBatch(const TaffyCuckooFilter& filter, const uint64_t* hashes, size_t n,
+               bool* results) {
+  filter.FindHashBatch(hashes, n, results);
+  return true;
+}
+
+bool FindBatch(const MinimalTaffyCuckooFilter& filter, const uint64_t* hashes, size_t n,
+               bool* results) {
+  filter.FindHashBatch(hashes, n, results);
+  return true;
+}
+
+template <libfilter_frozen_taffy_cuckoo_layout LAYOUT>
+bool FindBatch(const FrozenTaffyCuckooShim<LAYOUT>& filter, const uint64_t* hashes,
+               size_t n, bool* results) {
+  filter.frozen.FindHashBatch(hashes, n, results);
+  return true;
+}
+
 // Does the actual benchmarking work. Repeats `reps` times, samples grow by
 // `growth_factor`.
 //
@@ -191,6 +269,29 @@ vector<Sample> BenchHelp(uint64_t reps, double growth_factor, vector<uint64_t>&
         for (unsigned i = 0; i < 1000 * 1000; ++i) {
           found_monotonic += filter.FindHash(to_find[i]);
         }
+
+        uint64_t batch[kBatchSize];
+        bool batch_found[kBatchSize];
+        uint64_t batch_finds = 0;
+        const auto batch_start = s.now();
+        while (batch_finds < 1000 * 1000) {
+          for (unsigned j = 0; j < kBatchSize; ++j) {
+            batch[j] = to_find[r() % static_cast<uint64_t>(next)];
+          }
+          if (not FindBatch(filter, batch, kBatchSize, batch_found)) break;
+          for (unsigned j = 0; j < kBatchSize; ++j) found += batch_found[j];
+          batch_finds += kBatchSize;
+        }
+        const auto batch_finish = s.now();
+        if (batch_finds > 0) {
+          find_time = static_cast<std::chrono::duration<double>>(batch_finish - batch_start);
+          base.sample_type = "find_missing_batch_nanos";
+          base.payload = 1.0 *
+                         chrono::duration_cast<chrono::nanoseconds>(find_time).count() /
+                         batch_finds;
+          result.push_back(base);
+          cout << base.CSV() << endl;
+        }
       }
 
       base.sample_type = "fpp";
@@ -329,6 +430,14 @@ int main(int argc, char** argv) {
     BenchWithNdvFpp<CuckooShim<12>>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
     BenchWithBytes<MinimalTaffyCuckooFilter>(reps, bytes, 1.05, to_insert, to_find);
     BenchWithBytes<TaffyCuckooFilter>(reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<TaffyCuckooFilterT<16, 5, 3>>(reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<TaffyCuckooFilterT<24, 7, 2>>(reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<FrozenTaffyCuckooShim<libfilter_frozen_taffy_cuckoo_packed>>(
+        reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<FrozenTaffyCuckooShim<libfilter_frozen_taffy_cuckoo_aligned>>(
+        reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<StaticTaffyCuckooShim>(reps, bytes, 1.05, to_insert, to_find);
+    BenchWithBytes<BfsTaffyCuckooFilter>(reps, bytes, 1.05, to_insert, to_find);
     BenchGrowWithNdvFpp<TaffyBlockFilter>(reps, 1.05, to_insert, to_find, ndv, taffy_fpp);
     BenchWithNdvFpp<BlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
   }
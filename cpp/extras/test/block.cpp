@@ -1,12 +1,18 @@
 #include <jni.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>  // for uint64_t
+#include <cstring>  // for memcmp, memset
 #include <memory>
+#include <thread>
+#include <type_traits>  // for is_same
 #include <unordered_set>
 #include <vector>  // for allocator, vector
 
 #include "filter/minimal-taffy-cuckoo.hpp"
 #include "filter/taffy-block.hpp"
+#include "filter/taffy-cuckoo-t.hpp"
 #include "filter/taffy-cuckoo.hpp"
 #include "gtest/gtest.h"
 #include "util.hpp"  // for Rand
@@ -31,16 +37,43 @@ class BytesTest : public ::testing::Test {};
 template <typename F>
 class NdvFppTest : public ::testing::Test {};
 
+template <typename F>
+class BatchTest : public ::testing::Test {};
+
+template <typename F>
+class RemoveTest : public ::testing::Test {};
+
+template <typename F>
+class StatsTest : public ::testing::Test {};
+
+template <typename F>
+class PolicyTest : public ::testing::Test {};
+
 using BlockTypes = ::testing::Types<BlockFilter, ScalarBlockFilter>;
-using CreatedWithBytes = ::testing::Types<TaffyCuckooFilter, MinimalTaffyCuckooFilter,
-                                          BlockFilter, ScalarBlockFilter>;
-using CreatedWithNdvFpp = ::testing::Types<TaffyBlockFilter>;
-using UnionTypes = ::testing::Types<TaffyCuckooFilter>;
+using CreatedWithBytes =
+    ::testing::Types<TaffyCuckooFilter, IncrementalTaffyCuckooFilter,
+                     BfsTaffyCuckooFilter, InPlaceTaffyCuckooFilter,
+                     MinimalTaffyCuckooFilter, TaffyCuckooFilterT<10, 5, 2>,
+                     TaffyCuckooFilterT<16, 5, 3>, TaffyCuckooFilterT<24, 7, 2>,
+                     BlockFilter, ScalarBlockFilter>;
+using CreatedWithNdvFpp = ::testing::Types<TaffyBlockFilter, ConcurrentTaffyBlockFilter>;
+using UnionTypes = ::testing::Types<TaffyCuckooFilter, IncrementalTaffyCuckooFilter,
+                                    BfsTaffyCuckooFilter, InPlaceTaffyCuckooFilter>;
+using BatchTypes = ::testing::Types<TaffyCuckooFilter, IncrementalTaffyCuckooFilter,
+                                    BfsTaffyCuckooFilter, InPlaceTaffyCuckooFilter,
+                                    MinimalTaffyCuckooFilter>;
+using StatsTypes = ::testing::Types<TaffyCuckooFilter, IncrementalTaffyCuckooFilter,
+                                    BfsTaffyCuckooFilter, InPlaceTaffyCuckooFilter,
+                                    MinimalTaffyCuckooFilter>;
 
 TYPED_TEST_SUITE(BlockTest, BlockTypes);
 TYPED_TEST_SUITE(BytesTest, CreatedWithBytes);
 TYPED_TEST_SUITE(NdvFppTest, CreatedWithNdvFpp);
 TYPED_TEST_SUITE(UnionTest, UnionTypes);
+TYPED_TEST_SUITE(BatchTest, BatchTypes);
+TYPED_TEST_SUITE(RemoveTest, UnionTypes);
+TYPED_TEST_SUITE(StatsTest, StatsTypes);
+TYPED_TEST_SUITE(PolicyTest, UnionTypes);
 // TODO: test hidden methods in libfilter.so
 
 // TODO: test more methods, including copy
@@ -105,6 +138,133 @@ TYPED_TEST(UnionTest, UnionFpp) {
   }
 }
 
+// Test that a k-way union matches exactly the keys that some input matches
+TYPED_TEST(UnionTest, UnionMany) {
+  Rand r;
+  vector<TypeParam> xs;
+  vector<uint64_t> keys, missing;
+  for (unsigned i = 0; i < 8; ++i) {
+    xs.push_back(TypeParam::CreateWithBytes(0));
+    for (unsigned j = 0; j < 2000 + 1000 * i; ++j) {
+      keys.push_back(r());
+      xs.back().InsertHash(keys.back());
+    }
+  }
+  for (unsigned i = 0; i < 100 * 1000; ++i) missing.push_back(r());
+  vector<const TaffyCuckooFilter*> ptrs;
+  for (const auto& x : xs) ptrs.push_back(&x);
+  auto z = Union(ptrs);
+  auto frozen = UnionFreeze(ptrs);
+  for (auto k : keys) {
+    EXPECT_TRUE(z.FindHash(k));
+    EXPECT_TRUE(frozen.FindHash(k));
+  }
+  for (auto v : missing) {
+    bool any = false;
+    for (const auto& x : xs) any = any || x.FindHash(v);
+    EXPECT_EQ(any, z.FindHash(v));
+  }
+  EXPECT_FALSE(Union(vector<const TaffyCuckooFilter*>{}).FindHash(keys[0]));
+}
+
+// Test that intersections keep the keys in both filters and few of the others
+TYPED_TEST(UnionTest, IntersectDoes) {
+  for (unsigned xndv = 1; xndv < 100 * 1000; xndv *= 7) {
+    for (unsigned yndv = 1; yndv < 100 * 1000; yndv *= 7) {
+      Rand r;
+      vector<uint64_t> both, xonly;
+      auto x = TypeParam::CreateWithBytes(0);
+      auto y = TypeParam::CreateWithBytes(0);
+      const unsigned shared = min(xndv, yndv) / 2;
+      for (unsigned i = 0; i < shared; ++i) {
+        both.push_back(r());
+        x.InsertHash(both.back());
+        y.InsertHash(both.back());
+      }
+      for (unsigned i = shared; i < xndv; ++i) {
+        xonly.push_back(r());
+        x.InsertHash(xonly.back());
+      }
+      for (unsigned i = shared; i < yndv; ++i) y.InsertHash(r());
+      auto z = Intersect(x, y);
+      for (auto k : both) EXPECT_TRUE(z.FindHash(k)) << xndv << " " << yndv;
+      size_t xonly_found = 0;
+      for (auto k : xonly) xonly_found += z.FindHash(k);
+      EXPECT_LE(xonly_found, 2 + xonly.size() / 10) << xndv << " " << yndv;
+    }
+  }
+}
+
+// Test that a filter intersected with itself matches exactly what it did
+TYPED_TEST(UnionTest, IntersectSelf) {
+  Rand r;
+  auto x = TypeParam::CreateWithBytes(0);
+  for (unsigned i = 0; i < 100 * 1000; ++i) x.InsertHash(r());
+  auto z = Intersect(x, x);
+  for (unsigned i = 0; i < 1000 * 1000; ++i) {
+    const uint64_t v = r();
+    EXPECT_EQ(z.FindHash(v), x.FindHash(v)) << i;
+  }
+}
+
+// Test that every key has an entry matching it, and that chunks split up the entries
+TYPED_TEST(UnionTest, Entries) {
+  for (unsigned ndv = 1; ndv < 100 * 1000; ndv *= 7) {
+    Rand r;
+    vector<uint64_t> keys;
+    auto x = TypeParam::CreateWithBytes(0);
+    for (unsigned i = 0; i < ndv; ++i) {
+      keys.push_back(r());
+      x.InsertHash(keys.back());
+    }
+    auto all = x.Entries();
+    EXPECT_EQ(x.b.occupied + ((x.b.migrating_from == nullptr)
+                                  ? 0
+                                  : x.b.migrating_from->occupied),
+              all.size());
+    // Each entry, with its length in the low bits, which are zero in the entry
+    unordered_set<uint64_t> entries;
+    for (auto e : all) entries.insert(e.hash | e.bits);
+    for (auto k : keys) {
+      bool found = false;
+      for (int bits = 1; bits < 64 && not found; ++bits) {
+        found = entries.count(((k >> (64 - bits)) << (64 - bits)) | bits) > 0;
+      }
+      EXPECT_TRUE(found);
+    }
+    vector<uint64_t> whole, pieces;
+    for (auto e : all) whole.push_back(e.hash | e.bits);
+    for (int chunk = 0; chunk < 7; ++chunk) {
+      for (auto e : x.Entries(chunk, 7)) pieces.push_back(e.hash | e.bits);
+    }
+    sort(whole.begin(), whole.end());
+    sort(pieces.begin(), pieces.end());
+    EXPECT_EQ(whole, pieces);
+  }
+}
+
+// Test that static filters made from taffy filters have no false negatives, and about
+// the fpp they report
+TYPED_TEST(UnionTest, ToStatic) {
+  EXPECT_FALSE(TypeParam::CreateWithBytes(0).ToStatic().FindHash(0));
+  for (unsigned ndv = 1; ndv < 1000 * 1000; ndv *= 7) {
+    Rand r;
+    vector<uint64_t> keys;
+    auto x = TypeParam::CreateWithBytes(0);
+    for (unsigned i = 0; i < ndv; ++i) {
+      keys.push_back(r());
+      x.InsertHash(keys.back());
+    }
+    auto y = x.ToStatic();
+    for (auto k : keys) EXPECT_TRUE(y.FindHash(k));
+    const unsigned trials = 1000 * 1000;
+    unsigned found = 0;
+    for (unsigned i = 0; i < trials; ++i) found += y.FindHash(r());
+    EXPECT_LT(found, 1.5 * y.Fpp() * trials + 100) << ndv;
+    EXPECT_GT(found, 0.5 * y.Fpp() * trials - 100) << ndv;
+  }
+}
+
 template <typename T>
 void InsertPersistsHelp(T& x, vector<uint64_t>& hashes) {
   Rand r;
@@ -234,6 +394,482 @@ TYPED_TEST(BlockTest, EqualStayEqual) {
   }
 }
 
+// Test that finds running during inserts and upsizes never miss a completed insert
+TEST(ConcurrentTaffyBlockTest, FindWhileInserting) {
+  const uint64_t ndv = 1 << 20;
+  auto x = ConcurrentTaffyBlockFilter::CreateWithNdvFpp(32, 0.01);
+  vector<uint64_t> hashes(ndv);
+  Rand r;
+  for (auto& h : hashes) h = r();
+  atomic<uint64_t> inserted{0}, missing{0};
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      Rand s;
+      uint64_t n;
+      while ((n = inserted.load(memory_order_acquire)) < ndv) {
+        if (n == 0) continue;
+        if (not x.FindHash(hashes[s() % n])) ++missing;
+      }
+    });
+  }
+  for (uint64_t i = 0; i < ndv; ++i) {
+    x.InsertHash(hashes[i]);
+    inserted.store(i + 1, memory_order_release);
+  }
+  for (auto& t : readers) t.join();
+  EXPECT_EQ(0u, missing.load());
+}
+
+// Test that keys are found as soon as they are inserted, while several threads insert and
+// upsize at once, and that they are all there at the end
+TEST(ConcurrentTaffyCuckooTest, FindWhileInserting) {
+  const int writers = 4;
+  const uint64_t ndv = 1 << 18;
+  auto x = ConcurrentTaffyCuckooFilter::CreateWithBytes(0);
+  x.SetUpsizeThreads(2);
+  vector<vector<uint64_t>> hashes(writers, vector<uint64_t>(ndv));
+  Rand r;
+  for (auto& v : hashes) {
+    for (auto& h : v) h = r();
+  }
+  vector<atomic<uint64_t>> inserted(writers);
+  atomic<int> done{0};
+  atomic<uint64_t> missing{0};
+  vector<thread> threads;
+  for (int t = 0; t < writers; ++t) {
+    inserted[t].store(0);
+    threads.emplace_back([&, t]() {
+      for (uint64_t i = 0; i < ndv; ++i) {
+        x.InsertHash(hashes[t][i]);
+        inserted[t].store(i + 1, memory_order_release);
+      }
+      ++done;
+    });
+  }
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&]() {
+      Rand s;
+      while (done.load() < writers) {
+        const int w = s() % writers;
+        const uint64_t n = inserted[w].load(memory_order_acquire);
+        if (n == 0) continue;
+        if (not x.FindHash(hashes[w][s() % n])) ++missing;
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(0u, missing.load());
+  for (const auto& v : hashes) {
+    for (auto h : v) EXPECT_TRUE(x.FindHash(h));
+  }
+}
+
+// Test that copies, frozen copies, and serialized copies made in the middle of an
+// incremental upsize contain everything
+TEST(IncrementalUpsizeTest, MidUpsizeCopies) {
+  Rand r;
+  vector<uint64_t> keys;
+  auto x = IncrementalTaffyCuckooFilter::CreateWithBytes(0);
+  unsigned checked = 0;
+  while (checked < 12) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+    if (x.b.migrating_from == nullptr) continue;
+    ++checked;
+    TaffyCuckooFilter y = x;
+    auto z = x.Freeze();
+    vector<char> serialized(x.SerializedSize());
+    x.Serialize(serialized.data());
+    auto w = TaffyCuckooFilter::Deserialize(serialized.size(), serialized.data());
+    EXPECT_EQ(nullptr, w.b.migrating_from);
+    for (auto k : keys) {
+      EXPECT_TRUE(x.FindHash(k));
+      EXPECT_TRUE(y.FindHash(k));
+      EXPECT_TRUE(z.FindHash(k));
+      EXPECT_TRUE(w.FindHash(k));
+    }
+    // Skip ahead to the next upsize
+    while (x.b.migrating_from != nullptr) {
+      keys.push_back(r());
+      x.InsertHash(keys.back());
+    }
+  }
+}
+
+// Test that the levels of each side stay in one region, in order, and that copies made
+// between upsizes, including across a wrap of the cursor, keep all the keys
+TEST(MinimalTaffyCuckooTest, ContiguousLevelsCopy) {
+  Rand r;
+  vector<uint64_t> keys;
+  auto x = MinimalTaffyCuckooFilter::CreateWithBytes(0);
+  const uint64_t first_log_side_size = x.data.log_side_size;
+  uint64_t last_cursor = x.data.cursor;
+  while (x.data.log_side_size < first_log_side_size + 2) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+    if (x.data.cursor == last_cursor) continue;
+    last_cursor = x.data.cursor;
+    for (int s = 0; s < 2; ++s) {
+      for (uint64_t i = 1; i < libfilter_minimal_taffy_cuckoo_levels; ++i) {
+        const uint64_t before = (1ul + (i - 1 < x.data.cursor)) << x.data.log_side_size;
+        EXPECT_EQ(x.data.sides[s].levels[i - 1].data + before,
+                  x.data.sides[s].levels[i].data);
+      }
+    }
+    MinimalTaffyCuckooFilter y = x;
+    EXPECT_EQ(x.SizeInBytes(), y.SizeInBytes());
+    for (auto k : keys) {
+      EXPECT_TRUE(x.FindHash(k));
+      EXPECT_TRUE(y.FindHash(k));
+    }
+  }
+}
+
+// Test that batched inserts, which interleave their kick chains, keep every key,
+// including duplicates within a batch and batches that span upsizes
+TEST(MinimalTaffyCuckooTest, InsertHashBatch) {
+  Rand r;
+  vector<uint64_t> keys;
+  auto x = MinimalTaffyCuckooFilter::CreateWithBytes(0);
+  const uint64_t first_log_side_size = x.data.log_side_size;
+  for (unsigned i = 0; i < 200; ++i) {
+    const size_t start = keys.size();
+    for (unsigned j = 0; j < i % 23; ++j) {
+      keys.push_back((j % 5 == 4) ? keys[start] : r());
+    }
+    x.InsertHashBatch(keys.data() + start, keys.size() - start);
+  }
+  EXPECT_GT(x.data.log_side_size, first_log_side_size);
+  for (auto k : keys) EXPECT_TRUE(x.FindHash(k));
+}
+
+// Test that batched finds agree with FindHash, for present and absent keys, including
+// while an incremental upsize is in progress
+TYPED_TEST(BatchTest, MatchesFindHash) {
+  Rand r;
+  auto x = TypeParam::CreateWithBytes(0);
+  vector<uint64_t> present, absent;
+  for (unsigned i = 0; i < 1000; ++i) absent.push_back(r());
+  bool results[1000];
+  for (unsigned n = 1; n < 200 * 1000; n += n / 4 + 1) {
+    while (present.size() < n) {
+      present.push_back(r());
+      x.InsertHash(present.back());
+    }
+    // Odd lengths exercise the partial batch at the end
+    const size_t m = min(present.size(), static_cast<size_t>(999));
+    x.FindHashBatch(&present[present.size() - m], m, results);
+    for (size_t i = 0; i < m; ++i) EXPECT_TRUE(results[i]) << n << " " << i;
+    x.FindHashBatch(absent.data(), absent.size(), results);
+    for (size_t i = 0; i < absent.size(); ++i) {
+      EXPECT_EQ(x.FindHash(absent[i]), results[i]) << n << " " << i;
+    }
+  }
+}
+
+// Test that removed keys are gone, other than false positives, that the filter shrinks as
+// it empties, and that the keys left are still there. Keys that share an entry with a
+// removed key are removed too, but there are about as few of those as false positives.
+TYPED_TEST(RemoveTest, RemovesAndDownsizes) {
+  Rand r;
+  auto x = TypeParam::CreateWithBytes(0);
+  vector<uint64_t> keys;
+  for (unsigned i = 0; i < 200 * 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  const int full_log_side_size = x.b.log_side_size;
+  const size_t kept = keys.size() / 16;
+  size_t not_removed = 0, still_found = 0, lost = 0;
+  for (size_t i = kept; i < keys.size(); ++i) not_removed += not x.RemoveHash(keys[i]);
+  for (size_t i = kept; i < keys.size(); ++i) still_found += x.FindHash(keys[i]);
+  for (size_t i = 0; i < kept; ++i) lost += not x.FindHash(keys[i]);
+  EXPECT_LT(x.b.log_side_size, full_log_side_size);
+  EXPECT_LT(not_removed, keys.size() / 100);
+  EXPECT_LT(lost, kept / 100);
+  EXPECT_LT(still_found, keys.size() / 10);
+}
+
+// Test that downsizing, even past the point where tails run out, keeps every key
+TYPED_TEST(RemoveTest, DownsizeKeeps) {
+  Rand r;
+  auto x = TypeParam::CreateWithBytes(1 << 20);
+  vector<uint64_t> keys;
+  for (unsigned i = 0; i < 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  while (x.b.log_side_size > 9) {
+    x.Downsize();
+    for (auto k : keys) EXPECT_TRUE(x.FindHash(k)) << x.b.log_side_size;
+  }
+}
+
+// Test that the counters add up if they are compiled in, and are all zero otherwise
+TYPED_TEST(StatsTest, Counts) {
+  Rand r;
+  auto x = TypeParam::CreateWithBytes(0);
+  vector<uint64_t> keys;
+  for (unsigned i = 0; i < 100 * 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  uint64_t found = 0;
+  for (auto k : keys) found += x.FindHash(k);
+  const libfilter_taffy_cuckoo_stats s = x.Stats();
+#if defined(LIBFILTER_TAFFY_CUCKOO_STATS)
+  EXPECT_EQ(found, s.stash_hits + s.bucket_hits);
+  // Every insert ends one chain, including the inserts done by upsizes
+  uint64_t chains = 0, least_kicks = 0;
+  for (int i = 0; i < libfilter_taffy_cuckoo_chain_buckets; ++i) {
+    chains += s.kick_chains[i];
+    if (i > 0) least_kicks += s.kick_chains[i] << (i - 1);
+  }
+  EXPECT_GE(chains, keys.size());
+  EXPECT_GE(s.kicks, least_kicks);
+  EXPECT_GT(s.kicks, 0u);
+  EXPECT_GT(s.upsizes, 0u);
+  EXPECT_GT(s.upsize_nanos, 0u);
+  EXPECT_GT(s.tail_shortenings, 0u);
+  // Each insert into a minimal filter records its peak number of waiting split entries
+  uint64_t pendings = 0;
+  for (int i = 0; i < libfilter_taffy_cuckoo_chain_buckets; ++i) {
+    pendings += s.pending_depths[i];
+  }
+  if (is_same<TypeParam, MinimalTaffyCuckooFilter>::value) {
+    EXPECT_GE(pendings, keys.size());
+    EXPECT_LE(pendings, chains);
+  } else {
+    EXPECT_EQ(0u, pendings);
+  }
+#else
+  libfilter_taffy_cuckoo_stats zero;
+  memset(&zero, 0, sizeof(zero));
+  EXPECT_EQ(0, memcmp(&s, &zero, sizeof(s)));
+#endif
+}
+
+// Test that inserts keep the load under max_load, and that they fill the filter up to it
+// before upsizing
+TYPED_TEST(PolicyTest, MaxLoad) {
+  for (double max_load : {0.80, 0.94}) {
+    libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+    policy.max_load = max_load;
+    // With the default max_stash, a full stash can upsize the filter before it gets to
+    // 0.94
+    policy.max_stash = 1 << 10;
+    auto x = TypeParam::CreateWithBytes(0);
+    x.SetPolicy(policy);
+    Rand r;
+    vector<uint64_t> keys;
+    double most = 0;
+    for (unsigned i = 0; i < 200 * 1000; ++i) {
+      const uint64_t capacity = libfilter_taffy_cuckoo_capacity(&x.b);
+      // The load is checked before each insert, so one insert can go past max_load
+      EXPECT_LE(x.b.occupied, max_load * capacity + 1) << i;
+      if (x.b.log_side_size > 8) most = max(most, 1.0 * x.b.occupied / capacity);
+      keys.push_back(r());
+      x.InsertHash(keys.back());
+    }
+    EXPECT_GT(most, max_load - 0.01);
+    for (auto k : keys) EXPECT_TRUE(x.FindHash(k));
+  }
+}
+
+// Test that a max_load of 0 or less is clamped, rather than making inserts upsize forever
+TEST(GrowthPolicyTest, MaxLoadClamped) {
+  for (double max_load : {0.0, -1.0}) {
+    libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+    policy.max_load = max_load;
+    auto x = TaffyCuckooFilter::CreateWithBytes(0, policy);
+    auto y = MinimalTaffyCuckooFilter::CreateWithBytes(0, policy);
+    EXPECT_GT(x.b.policy.max_load, 0);
+    EXPECT_GT(y.data.policy.max_load, 0);
+    Rand r;
+    for (unsigned i = 0; i < 100; ++i) {
+      const uint64_t k = r();
+      EXPECT_TRUE(x.InsertHash(k));
+      EXPECT_TRUE(y.InsertHash(k));
+    }
+  }
+}
+
+// Test that each upsize grows the filter by growth_steps doublings
+TEST(GrowthPolicyTest, GrowthSteps) {
+  libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+  policy.growth_steps = 2;
+  auto x = TaffyCuckooFilter::CreateWithBytes(0, policy);
+  Rand r;
+  const int start = x.b.log_side_size;
+  for (unsigned i = 0; i < 100 * 1000; ++i) {
+    x.InsertHash(r());
+    EXPECT_EQ(0, (x.b.log_side_size - start) % 2);
+  }
+  EXPECT_GT(x.b.log_side_size, start);
+}
+
+// Test that a thawed filter matches exactly what the frozen one did, including stashed
+// entries, and that it keeps everything as it grows
+TEST(ThawTest, ThawTest) {
+  Rand r;
+  vector<uint64_t> keys, absent;
+  TaffyCuckooFilter x = TaffyCuckooFilter::CreateWithBytes(1 << 12);
+  for (unsigned i = 0; i < 10 * 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  // Push a few more in with no evictions so that some land in the stash
+  for (unsigned i = 0; i < 200; ++i) {
+    keys.push_back(r());
+    libfilter_taffy_cuckoo_insert_side_path_ttl(
+        &x.b, 0, libfilter_taffy_cuckoo_to_path(keys.back(), &x.b.sides[0].f,
+                                                x.b.log_side_size),
+        0);
+  }
+  ASSERT_GT(x.b.sides[0].stash_size, 0u);
+  for (unsigned i = 0; i < 100 * 1000; ++i) absent.push_back(r());
+  auto frozen = x.Freeze();
+  auto y = TaffyCuckooFilter::Thaw(frozen);
+  EXPECT_EQ(x.b.log_side_size, y.b.log_side_size);
+  for (auto k : keys) EXPECT_TRUE(y.FindHash(k));
+  for (auto k : absent) EXPECT_EQ(frozen.FindHash(k), y.FindHash(k));
+  for (unsigned i = 0; i < 100 * 1000; ++i) {
+    keys.push_back(r());
+    y.InsertHash(keys.back());
+  }
+  EXPECT_GT(y.b.log_side_size, x.b.log_side_size);
+  for (auto k : keys) EXPECT_TRUE(y.FindHash(k));
+}
+
+// Test that stashed entries can be removed without losing the others in the stash
+TEST(RemoveStashTest, RemovesStashed) {
+  Rand r;
+  vector<uint64_t> keys;
+  TaffyCuckooFilter x = TaffyCuckooFilter::CreateWithBytes(1 << 10);
+  // Keys that share a bucket and fingerprint on either side can share an entry, and
+  // removing one of them then rightly removes the other, so each key gets its own
+  unordered_set<uint64_t> seen[2];
+  while (x.b.occupied < 1.2 * libfilter_taffy_cuckoo_capacity(&x.b)) {
+    const uint64_t k = r();
+    libfilter_taffy_cuckoo_path p[2];
+    bool fresh = true;
+    for (int s = 0; s < 2; ++s) {
+      p[s] = libfilter_taffy_cuckoo_to_path(k, &x.b.sides[s].f, x.b.log_side_size);
+      fresh = fresh && 0 == seen[s].count((p[s].bucket << libfilter_taffy_cuckoo_head_size) |
+                                          p[s].slot.fingerprint);
+    }
+    if (not fresh) continue;
+    for (int s = 0; s < 2; ++s) {
+      seen[s].insert((p[s].bucket << libfilter_taffy_cuckoo_head_size) |
+                     p[s].slot.fingerprint);
+    }
+    keys.push_back(k);
+    libfilter_taffy_cuckoo_insert_side_path_ttl(&x.b, 0, p[0], 0);
+  }
+  const size_t stashed = x.b.sides[0].stash_size + x.b.sides[1].stash_size;
+  ASSERT_GT(stashed, 100u);
+  for (size_t i = 1; i < keys.size(); i += 2) EXPECT_TRUE(x.RemoveHash(keys[i]));
+  EXPECT_LT(x.b.sides[0].stash_size + x.b.sides[1].stash_size, stashed);
+  for (size_t i = 0; i < keys.size(); i += 2) EXPECT_TRUE(x.FindHash(keys[i]));
+}
+
+// Test that in-place upsizes, including of stashed entries and of entries whose tails
+// have run out, give a filter that matches exactly the same keys as copying upsizes
+TEST(InPlaceUpsizeTest, MatchesCopying) {
+  Rand r;
+  vector<uint64_t> keys, absent;
+  TaffyCuckooFilter x = TaffyCuckooFilter::CreateWithBytes(1 << 12);
+  // Both kinds of upsize follow the policy's ttl
+  libfilter_taffy_cuckoo_policy policy = libfilter_taffy_cuckoo_default_policy();
+  policy.ttl = 8;
+  libfilter_taffy_cuckoo_set_policy(&x.b, policy);
+  for (unsigned i = 0; i < 5 * 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  for (unsigned i = 0; i < 50; ++i) {
+    keys.push_back(r());
+    libfilter_taffy_cuckoo_insert_side_path_ttl(
+        &x.b, 0, libfilter_taffy_cuckoo_to_path(keys.back(), &x.b.sides[0].f,
+                                                x.b.log_side_size),
+        0);
+  }
+  ASSERT_GT(x.b.sides[0].stash_size, 0u);
+  for (unsigned i = 0; i < 100 * 1000; ++i) absent.push_back(r());
+  TaffyCuckooFilter y = x;
+  libfilter_taffy_cuckoo_set_in_place_upsize(&y.b, true);
+  for (int i = 0; i < 8; ++i) {
+    libfilter_taffy_cuckoo_upsize(&x.b);
+    libfilter_taffy_cuckoo_upsize(&y.b);
+    EXPECT_EQ(x.b.log_side_size, y.b.log_side_size);
+    for (auto k : keys) EXPECT_TRUE(y.FindHash(k)) << i;
+    for (auto k : absent) EXPECT_EQ(x.FindHash(k), y.FindHash(k)) << i;
+  }
+}
+
+// Test that breadth-first inserts fill the table to the upsize threshold, rather than
+// upsizing early because the stash overflowed
+TEST(BfsTest, UpsizesOnlyWhenFull) {
+  Rand r;
+  auto x = BfsTaffyCuckooFilter::CreateWithBytes(0);
+  for (unsigned i = 0; i < 1000 * 1000; ++i) {
+    const int before = x.b.log_side_size;
+    const double load = 1.0 * x.b.occupied / libfilter_taffy_cuckoo_capacity(&x.b);
+    x.InsertHash(r());
+    if (x.b.log_side_size != before && before > 8) {
+      EXPECT_GE(load, 0.899) << before;
+    }
+  }
+}
+
+// Test that wider fingerprints lower the fpp, even with larger buckets
+TEST(TaffyCuckooTTest, WiderFingerprints) {
+  Rand r;
+  auto x = TaffyCuckooFilterT<10, 5, 2>::CreateWithBytes(0);
+  auto y = TaffyCuckooFilterT<16, 5, 3>::CreateWithBytes(0);
+  auto z = TaffyCuckooFilterT<24, 7, 2>::CreateWithBytes(0);
+  for (unsigned i = 0; i < 100 * 1000; ++i) {
+    const uint64_t k = r();
+    x.InsertHash(k);
+    y.InsertHash(k);
+    z.InsertHash(k);
+  }
+  uint64_t xfp = 0, yfp = 0, zfp = 0;
+  for (unsigned i = 0; i < 1000 * 1000; ++i) {
+    const uint64_t k = r();
+    xfp += x.FindHash(k);
+    yfp += y.FindHash(k);
+    zfp += z.FindHash(k);
+  }
+  EXPECT_GT(xfp, 10 * yfp);
+  EXPECT_GT(yfp, 10 * zfp);
+  EXPECT_LT(zfp, 10);
+}
+
+// Test that upsizes and unions split over several threads keep everything
+TEST(ParallelTest, UpsizeAndUnion) {
+  Rand r;
+  vector<uint64_t> xkeys, ykeys;
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  x.SetUpsizeThreads(4);
+  auto y = TaffyCuckooFilter::CreateWithBytes(0);
+  for (size_t i = 0; i < 1000 * 1000; ++i) {
+    xkeys.push_back(r());
+    x.InsertHash(xkeys.back());
+  }
+  for (size_t i = 0; i < 100 * 1000; ++i) {
+    ykeys.push_back(r());
+    y.InsertHash(ykeys.back());
+  }
+  for (auto k : xkeys) EXPECT_TRUE(x.FindHash(k));
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    auto z = Union(x, y, threads);
+    for (auto k : xkeys) EXPECT_TRUE(z.FindHash(k)) << threads;
+    for (auto k : ykeys) EXPECT_TRUE(z.FindHash(k)) << threads;
+  }
+}
+
 TEST(FreezeTest, FreezeTest) {
   Rand r;
   vector<uint64_t> keys;
@@ -248,6 +884,112 @@ TEST(FreezeTest, FreezeTest) {
   }
 }
 
+// Test that stashed paths are found in every form of the filter. Inserting with no
+// evictions allowed overfills the stashes.
+TEST(FreezeTest, StashedTest) {
+  Rand r;
+  vector<uint64_t> keys;
+  TaffyCuckooFilter x = TaffyCuckooFilter::CreateWithBytes(1 << 10);
+  while (x.b.occupied < 1.2 * libfilter_taffy_cuckoo_capacity(&x.b)) {
+    keys.push_back(r());
+    libfilter_taffy_cuckoo_insert_side_path_ttl(
+        &x.b, 0, libfilter_taffy_cuckoo_to_path(keys.back(), &x.b.sides[0].f,
+                                                x.b.log_side_size),
+        0);
+  }
+  ASSERT_GT(x.b.sides[0].stash_size + x.b.sides[1].stash_size, 100u);
+  TaffyCuckooFilter y = x;
+  vector<char> serialized(x.SerializedSize());
+  x.Serialize(serialized.data());
+  auto z = TaffyCuckooFilter::Deserialize(serialized.size(), serialized.data());
+  auto frozen = x.Freeze();
+  vector<uint64_t> frozen_serialized(
+      (frozen.SerializedSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  char* frozen_bytes = reinterpret_cast<char*>(frozen_serialized.data());
+  frozen.Serialize(frozen_bytes);
+  auto thawed = FrozenTaffyCuckoo::Deserialize(frozen.SerializedSize(), frozen_bytes);
+  auto adopted = FrozenTaffyCuckoo::DeserializeAdopt(frozen.SerializedSize(), frozen_bytes);
+  for (auto k : keys) {
+    EXPECT_TRUE(x.FindHash(k));
+    EXPECT_TRUE(y.FindHash(k));
+    EXPECT_TRUE(z.FindHash(k));
+    EXPECT_TRUE(frozen.FindHash(k));
+    EXPECT_TRUE(thawed.FindHash(k));
+    EXPECT_TRUE(adopted.FindHash(k));
+  }
+  // Upsizing moves the stashes back into buckets
+  for (unsigned i = 0; i < 1000; ++i) {
+    keys.push_back(r());
+    x.InsertHash(keys.back());
+  }
+  for (auto k : keys) EXPECT_TRUE(x.FindHash(k));
+}
+
+// Test that batched frozen finds agree with FindHash, for present, stashed, and absent
+// keys
+TEST(FreezeTest, BatchTest) {
+  Rand r;
+  vector<uint64_t> present, absent;
+  for (unsigned i = 0; i < 1000; ++i) absent.push_back(r());
+  bool results[1000];
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  for (unsigned n = 1; n < 200 * 1000; n += n / 4 + 1) {
+    while (present.size() < n) {
+      present.push_back(r());
+      x.InsertHash(present.back());
+    }
+    // A few with no evictions, so that some land in the stash
+    for (unsigned i = 0; i < 8; ++i) {
+      present.push_back(r());
+      libfilter_taffy_cuckoo_insert_side_path_ttl(
+          &x.b, 0, libfilter_taffy_cuckoo_to_path(present.back(), &x.b.sides[0].f,
+                                                  x.b.log_side_size),
+          0);
+    }
+    for (auto layout :
+         {libfilter_frozen_taffy_cuckoo_packed, libfilter_frozen_taffy_cuckoo_aligned}) {
+      auto frozen = x.Freeze(layout);
+      // Odd lengths exercise the partial batch at the end
+      const size_t m = min(present.size(), static_cast<size_t>(999));
+      frozen.FindHashBatch(&present[present.size() - m], m, results);
+      for (size_t i = 0; i < m; ++i) EXPECT_TRUE(results[i]) << n << " " << i;
+      frozen.FindHashBatch(absent.data(), absent.size(), results);
+      for (size_t i = 0; i < absent.size(); ++i) {
+        EXPECT_EQ(frozen.FindHash(absent[i]), results[i]) << n << " " << i;
+      }
+    }
+  }
+  EXPECT_GT(x.b.sides[0].stash_size, 0u);
+}
+
+// Test that the aligned layout finds the same keys as the packed one, serializes the same
+// way, and thaws the same way
+TEST(FreezeTest, AlignedTest) {
+  Rand r;
+  vector<uint64_t> present, absent;
+  for (unsigned i = 0; i < 100 * 1000; ++i) absent.push_back(r());
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  for (unsigned n = 1; n < 200 * 1000; n *= 2) {
+    while (present.size() < n) {
+      present.push_back(r());
+      x.InsertHash(present.back());
+    }
+    auto packed = x.Freeze();
+    auto aligned = x.Freeze(libfilter_frozen_taffy_cuckoo_aligned);
+    EXPECT_GT(aligned.SizeInBytes(), packed.SizeInBytes());
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(aligned.b.data_[0]) % 64);
+    for (auto k : present) EXPECT_TRUE(aligned.FindHash(k));
+    for (auto k : absent) EXPECT_EQ(packed.FindHash(k), aligned.FindHash(k));
+    vector<char> packed_bytes(packed.SerializedSize()),
+        aligned_bytes(aligned.SerializedSize());
+    packed.Serialize(packed_bytes.data());
+    aligned.Serialize(aligned_bytes.data());
+    EXPECT_EQ(packed_bytes, aligned_bytes);
+    auto thawed = TaffyCuckooFilter::Thaw(aligned);
+    for (auto k : present) EXPECT_TRUE(thawed.FindHash(k));
+  }
+}
+
 TEST(SerDeTest, SerDeTest) {
   Rand r;
   for (size_t size = 1; size < 1 << 20; size *= 2) {
@@ -260,6 +1002,69 @@ TEST(SerDeTest, SerDeTest) {
   }
 }
 
+TEST(SerDeTest, TaffyCuckooSerDeTest) {
+  Rand r;
+  for (size_t size = 1; size < 1 << 20; size *= 4) {
+    vector<uint64_t> keys;
+    TaffyCuckooFilter f = TaffyCuckooFilter::CreateWithBytes(0);
+    for (size_t i = 0; i < size; ++i) {
+      keys.push_back(r());
+      f.InsertHash(keys.back());
+    }
+    vector<char> serialized(f.SerializedSize());
+    f.Serialize(serialized.data());
+    auto g = TaffyCuckooFilter::Deserialize(serialized.size(), serialized.data());
+    vector<char> reserialized(g.SerializedSize());
+    g.Serialize(reserialized.data());
+    EXPECT_TRUE(serialized == reserialized) << size;
+    auto h = TaffyCuckooFilter::DeserializeAdopt(serialized.size(), serialized.data());
+    for (auto k : keys) {
+      EXPECT_TRUE(g.FindHash(k)) << size;
+      EXPECT_TRUE(h.FindHash(k)) << size;
+    }
+    // Inserting into the adopted filter causes it to upsize and let go of serialized
+    for (size_t i = 0; i < size + 100; ++i) {
+      keys.push_back(r());
+      h.InsertHash(keys.back());
+    }
+    for (auto k : keys) EXPECT_TRUE(h.FindHash(k)) << size;
+
+    auto frozen = f.Freeze();
+    vector<uint64_t> frozen_serialized(
+        (frozen.SerializedSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    char* frozen_bytes = reinterpret_cast<char*>(frozen_serialized.data());
+    frozen.Serialize(frozen_bytes);
+    auto thawed = FrozenTaffyCuckoo::Deserialize(frozen.SerializedSize(), frozen_bytes);
+    auto adopted =
+        FrozenTaffyCuckoo::DeserializeAdopt(frozen.SerializedSize(), frozen_bytes);
+    for (size_t i = 0; i < size + 1000; ++i) {
+      auto k = (i < size) ? keys[i] : r();
+      EXPECT_EQ(frozen.FindHash(k), thawed.FindHash(k)) << size;
+      EXPECT_EQ(frozen.FindHash(k), adopted.FindHash(k)) << size;
+    }
+
+    // Truncated or corrupted input is rejected
+    EXPECT_THROW(TaffyCuckooFilter::Deserialize(reserialized.size() - 1,
+                                                reserialized.data()),
+                 std::runtime_error);
+    // The rng's bit width
+    reserialized[112] ^= 1;
+    EXPECT_THROW(
+        TaffyCuckooFilter::Deserialize(reserialized.size(), reserialized.data()),
+        std::runtime_error);
+    reserialized[112] ^= 1;
+    vector<char> misaligned(serialized.size() + 1);
+    std::copy(serialized.begin(), serialized.end(), misaligned.begin() + 1);
+    EXPECT_THROW(
+        TaffyCuckooFilter::DeserializeAdopt(serialized.size(), misaligned.data() + 1),
+        std::runtime_error);
+    reserialized[4] ^= 1;
+    EXPECT_THROW(
+        TaffyCuckooFilter::Deserialize(reserialized.size(), reserialized.data()),
+        std::runtime_error);
+  }
+}
+
 TEST(SerDeTest, JavaSerDeTest) {
   JavaVM* jvm = nullptr;
   JNIEnv* env = nullptr;
@@ -42,7 +42,9 @@ struct MinimalTaffyCuckooFilter {
   }
   //MinimalTaffyCuckooFilter(libfilter_minimal_taffy_cuckoo&& b) : data(std::move(b)) {}
   ~MinimalTaffyCuckooFilter() { libfilter_minimal_taffy_cuckoo_destruct(&data); }
-  MinimalTaffyCuckooFilter(const MinimalTaffyCuckooFilter&) = delete;
+  MinimalTaffyCuckooFilter(const MinimalTaffyCuckooFilter& that) {
+    libfilter_minimal_taffy_cuckoo_clone(&that.data, &data);
+  }
   MinimalTaffyCuckooFilter(libfilter_minimal_taffy_cuckoo&& steal) : data(steal) {
     libfilter_minimal_taffy_cuckoo_null_out(&steal);
   }
@@ -53,6 +55,10 @@ struct MinimalTaffyCuckooFilter {
     return libfilter_minimal_taffy_cuckoo_size_in_bytes(&data);
   }
 
+  // All zero unless LIBFILTER_TAFFY_CUCKOO_STATS is defined. See
+  // libfilter_taffy_cuckoo_stats.
+  libfilter_taffy_cuckoo_stats Stats() const { return data.stats; }
+
   // Verifies the occupied field:
   // uint64_t Count() const { return data.Count(); }
 
@@ -83,12 +89,30 @@ struct MinimalTaffyCuckooFilter {
         libfilter_minimal_taffy_cuckoo_create_with_bytes(bytes)};
   }
 
+  static MinimalTaffyCuckooFilter CreateWithBytes(
+      uint64_t bytes, const libfilter_taffy_cuckoo_policy& policy) {
+    MinimalTaffyCuckooFilter result = CreateWithBytes(bytes);
+    result.SetPolicy(policy);
+    return result;
+  }
+
+  // See libfilter_taffy_cuckoo_policy
+  void SetPolicy(const libfilter_taffy_cuckoo_policy& policy) {
+    libfilter_minimal_taffy_cuckoo_set_policy(&data, policy);
+  }
+
   INLINE bool FindHash(uint64_t k) const {
     return libfilter_minimal_taffy_cuckoo_find_hash(&data, k);
   }
+  void FindHashBatch(const uint64_t* hashes, size_t n, bool* results) const {
+    libfilter_minimal_taffy_cuckoo_find_hash_batch(&data, hashes, n, results);
+  }
   INLINE bool InsertHash(uint64_t k) {
     return libfilter_minimal_taffy_cuckoo_add_hash(&data, k);
   }
+  bool InsertHashBatch(const uint64_t* hashes, size_t n) {
+    return libfilter_minimal_taffy_cuckoo_add_hash_batch(&data, hashes, n);
+  }
 };
 
 }  // namespace filter
@@ -50,4 +50,34 @@ struct TaffyBlockFilter {
   static const char* Name() { return "TaffyBlock"; }
 };
 
+// A TaffyBlockFilter that any number of threads may FindHash in while one thread calls
+// InsertHash, without any external locking. The TaffyBlockFilter is held rather than
+// inherited from, so that its non-atomic InsertHash cannot be reached through a base
+// reference.
+struct ConcurrentTaffyBlockFilter {
+  static ConcurrentTaffyBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    ConcurrentTaffyBlockFilter result(ndv, fpp);
+    return result;
+  }
+
+ private:
+  TaffyBlockFilter payload;
+
+  ConcurrentTaffyBlockFilter(uint64_t ndv, double fpp)
+      : payload(TaffyBlockFilter::CreateWithNdvFpp(ndv, fpp)) {}
+
+ public:
+  uint64_t SizeInBytes() const { return payload.SizeInBytes(); }
+
+  bool InsertHash(uint64_t h) {
+    return libfilter_taffy_block_concurrent_add_hash(&payload.data, h);
+  }
+
+  bool FindHash(uint64_t h) const {
+    return libfilter_taffy_block_concurrent_find_hash(&payload.data, h);
+  }
+
+  static const char* Name() { return "ConcurrentTaffyBlock"; }
+};
+
 }  // namespace filter
@@ -0,0 +1,307 @@
+// Usable under the terms in the Apache License, Version 2.0.
+//
+// A taffy cuckoo filter in which the fingerprint, tail and bucket widths are template
+// parameters, rather than the defines in filter/taffy-cuckoo.h, so filters with different
+// false positive probabilities can be used in one binary. See filter/taffy-cuckoo.h for
+// the algorithm. A find checks two buckets of 1 << LogSlots slots each, so the fpp is at
+// most about 2 * (1 << LogSlots) / (1 << HeadBits): 0.8% for the widths of
+// TaffyCuckooFilter, or 0.02% with HeadBits = 16 and LogSlots = 3.
+//
+// This has only the core of TaffyCuckooFilter: it has no frozen form, serialization,
+// incremental or parallel upsizes, or removal.
+
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "filter/util.h"
+}
+
+namespace filter {
+
+namespace detail {
+
+// Slots of kBits bits each, packed with no padding. Each slot is read and written with
+// one unaligned 8-byte load or store, so there are 8 bytes of padding at the end.
+template <int kBits, bool kWholeBytes = (kBits % 8 == 0)>
+struct PackedSlots {
+  static_assert(kBits + 7 <= 64, "slots must fit in one 8-byte load at any bit offset");
+
+  static uint64_t Bytes(uint64_t n) { return (n * kBits + 7) / 8 + sizeof(uint64_t); }
+
+  static uint64_t Get(const uint8_t* data, uint64_t i) {
+    const uint64_t bit = i * kBits;
+    uint64_t w;
+    memcpy(&w, &data[bit / 8], sizeof(w));
+    return libfilter_mask(kBits, w >> (bit % 8));
+  }
+
+  static void Set(uint8_t* data, uint64_t i, uint64_t x) {
+    const uint64_t bit = i * kBits;
+    uint64_t w;
+    memcpy(&w, &data[bit / 8], sizeof(w));
+    const uint64_t mask = ((1ul << kBits) - 1) << (bit % 8);
+    w = (w & ~mask) | (x << (bit % 8));
+    memcpy(&data[bit / 8], &w, sizeof(w));
+  }
+};
+
+// When slots are whole bytes, they are always byte-aligned, so each is read and written
+// with a load or store of exactly its size, with no shifts or padding.
+template <int kBits>
+struct PackedSlots<kBits, true> {
+  static_assert(kBits <= 64, "slots must fit in a uint64_t");
+
+  static uint64_t Bytes(uint64_t n) { return n * (kBits / 8); }
+
+  static uint64_t Get(const uint8_t* data, uint64_t i) {
+    uint64_t w = 0;
+    memcpy(&w, &data[i * (kBits / 8)], kBits / 8);
+    return w;
+  }
+
+  static void Set(uint8_t* data, uint64_t i, uint64_t x) {
+    memcpy(&data[i * (kBits / 8)], &x, kBits / 8);
+  }
+};
+
+}  // namespace detail
+
+template <int HeadBits, int TailBits, int LogSlots>
+struct TaffyCuckooFilterT {
+  static_assert(HeadBits >= 4, "fingerprints must be wide enough to spread entries");
+  static_assert(TailBits >= 1, "the tail must hold at least one bit");
+  static_assert(LogSlots >= 0 && LogSlots <= 4, "buckets must have 1 to 16 slots");
+  static_assert(HeadBits + TailBits <= 48, "the index needs some of the 64 hash bits");
+
+  static constexpr int kSlots = 1 << LogSlots;
+  // A slot is a fingerprint, then a tail with one extra bit for its end marker, encoded
+  // as in filter/taffy-cuckoo.h. Slots with tail 0 are empty.
+  static constexpr int kSlotBits = HeadBits + TailBits + 1;
+  using Slots = detail::PackedSlots<kSlotBits>;
+
+  struct Path {
+    uint64_t bucket;
+    uint64_t fingerprint;
+    uint64_t tail;
+  };
+
+  struct Side {
+    libfilter_feistel f;
+    std::vector<uint8_t> data;
+    // Paths that couldn't fit. Inserts upsize the filter before this gets long.
+    std::vector<Path> stash;
+  };
+
+  Side sides[2];
+  int log_side_size;
+  uint64_t occupied;
+  libfilter_pcg_random rng;
+  uint64_t entropy[8];
+
+  static std::string Name() {
+    thread_local static const std::string result =
+        "TaffyCuckoo<" + std::to_string(HeadBits) + "," + std::to_string(TailBits) + "," +
+        std::to_string(LogSlots) + ">";
+    return result;
+  }
+
+  static TaffyCuckooFilterT CreateWithBytes(uint64_t bytes) {
+    static const uint64_t kEntropy[8] = {
+        0x2ba7538ee1234073, 0xfcc3777539b147d6, 0x6086c563576347e7, 0x52eff34ee1764465,
+        0x8639cbf57f264867, 0x5a31ee34f0224ccb, 0x07a1cb8140744ee6, 0xf2296cf6a6524e9f};
+    double f = log(8.0 * bytes / 2 / kSlots / kSlotBits) / log(2);
+    f = (f > 1.0) ? f : 1.0;
+    return TaffyCuckooFilterT(f, kEntropy);
+  }
+
+  uint64_t Capacity() const { return 2 * kSlots * (1ul << log_side_size); }
+
+  uint64_t SizeInBytes() const {
+    return sides[0].data.size() + sides[1].data.size() +
+           sizeof(Path) * (sides[0].stash.capacity() + sides[1].stash.capacity());
+  }
+
+  bool FindHash(uint64_t k) const {
+    for (int s = 0; s < 2; ++s) {
+      const Path p = ToPath(k, sides[s].f, log_side_size);
+      if (BucketFind(sides[s], p)) return true;
+      for (const Path& q : sides[s].stash) {
+        if (q.bucket == p.bucket && q.fingerprint == p.fingerprint &&
+            IsPrefixOf(q.tail, p.tail)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool InsertHash(uint64_t k) {
+    // The same thresholds as libfilter_taffy_cuckoo_add_hash
+    while (occupied > 0.90 * Capacity() || occupied + 4 >= Capacity() ||
+           sides[0].stash.size() + sides[1].stash.size() > 8) {
+      Upsize();
+    }
+    InsertSidePathTtl(0, ToPath(k, sides[0].f, log_side_size), 32);
+    return true;
+  }
+
+  // Doubles the size of the filter
+  void Upsize() {
+    TaffyCuckooFilterT t(1 + log_side_size, entropy);
+    for (int s = 0; s < 2; ++s) {
+      for (const Path& p : sides[s].stash) UpsizeEmit(p, s, &t);
+      for (uint64_t i = 0; i < (1ul << log_side_size); ++i) {
+        for (int j = 0; j < kSlots; ++j) {
+          Path p;
+          if (GetSlot(sides[s], i, j, &p)) UpsizeEmit(p, s, &t);
+        }
+      }
+    }
+    *this = std::move(t);
+  }
+
+ protected:
+  TaffyCuckooFilterT(int log_side_size, const uint64_t entropy[8])
+      : log_side_size(log_side_size),
+        occupied(0),
+        rng(libfilter_pcg_random_create(LogSlots)) {
+    memcpy(this->entropy, entropy, sizeof(this->entropy));
+    for (int s = 0; s < 2; ++s) {
+      sides[s].f = libfilter_feistel_create(&entropy[4 * s]);
+      sides[s].data.assign(Slots::Bytes(kSlots << log_side_size), 0);
+    }
+  }
+
+  // As in libfilter_taffy_is_prefix_of, but for tails of any width: true if the
+  // sequence x encodes can be extended to the one y encodes.
+  static bool IsPrefixOf(uint64_t x, uint64_t y) {
+    const int c = __builtin_ctzll(x);
+    return c >= __builtin_ctzll(y) && ((x ^ y) >> c >> 1) == 0;
+  }
+
+  // As libfilter_taffy_cuckoo_to_path
+  static Path ToPath(uint64_t raw, const libfilter_feistel& f, int log_side_size) {
+    const uint64_t pre_hash_index_and_fp = raw >> (64 - log_side_size - HeadBits);
+    const uint64_t hashed_index_and_fp =
+        libfilter_feistel_permute_forward(&f, log_side_size + HeadBits, pre_hash_index_and_fp);
+    Path p;
+    p.bucket = hashed_index_and_fp >> HeadBits;
+    p.fingerprint = libfilter_mask(HeadBits, hashed_index_and_fp);
+    const uint64_t raw_tail =
+        libfilter_mask(TailBits, raw >> (64 - log_side_size - HeadBits - TailBits));
+    p.tail = raw_tail * 2 + 1;
+    return p;
+  }
+
+  // As libfilter_taffy_cuckoo_from_path_no_tail
+  static uint64_t FromPathNoTail(const Path& p, const libfilter_feistel& f,
+                                 int log_side_size) {
+    const uint64_t hashed_index_and_fp = (p.bucket << HeadBits) | p.fingerprint;
+    const uint64_t pre_hashed_index_and_fp =
+        libfilter_feistel_permute_backward(&f, log_side_size + HeadBits, hashed_index_and_fp);
+    return pre_hashed_index_and_fp << (64 - log_side_size - HeadBits);
+  }
+
+  // Returns false if slot j of bucket i is empty
+  static bool GetSlot(const Side& side, uint64_t i, int j, Path* p) {
+    const uint64_t w = Slots::Get(side.data.data(), i * kSlots + j);
+    p->bucket = i;
+    p->fingerprint = libfilter_mask(HeadBits, w);
+    p->tail = w >> HeadBits;
+    return p->tail != 0;
+  }
+
+  static void SetSlot(Side* side, const Path& p, int j) {
+    Slots::Set(side->data.data(), p.bucket * kSlots + j,
+               p.fingerprint | (p.tail << HeadBits));
+  }
+
+  static bool BucketFind(const Side& side, const Path& p) {
+    for (int j = 0; j < kSlots; ++j) {
+      Path q;
+      if (GetSlot(side, p.bucket, j, &q) && q.fingerprint == p.fingerprint &&
+          IsPrefixOf(q.tail, p.tail)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // As libfilter_taffy_cuckoo_side_insert: returns a path with tail 0 if p went in an
+  // empty slot, p if it was already present, or else the path that p displaced.
+  Path SideInsert(Side* side, Path p) {
+    for (int j = 0; j < kSlots; ++j) {
+      Path q;
+      if (!GetSlot(*side, p.bucket, j, &q)) {
+        SetSlot(side, p, j);
+        p.tail = 0;
+        return p;
+      }
+      if (q.fingerprint == p.fingerprint && IsPrefixOf(q.tail, p.tail)) return p;
+    }
+    const int j = libfilter_pcg_random_get(&rng);
+    Path result;
+    GetSlot(*side, p.bucket, j, &result);
+    SetSlot(side, p, j);
+    return result;
+  }
+
+  // As libfilter_taffy_cuckoo_insert_side_path_ttl
+  bool InsertSidePathTtl(int s, Path p, int ttl) {
+    Side* both[2] = {&sides[s], &sides[1 - s]};
+    while (true) {
+      for (int i = 0; i < 2; ++i) {
+        const Path q = p;
+        p = SideInsert(both[i], p);
+        if (p.tail == 0) {
+          ++occupied;
+          return true;
+        }
+        if (p.bucket == q.bucket && p.fingerprint == q.fingerprint && p.tail == q.tail) {
+          return true;
+        }
+        if (ttl <= 0) {
+          both[i]->stash.push_back(p);
+          ++occupied;
+          return false;
+        }
+        --ttl;
+        const uint64_t tail = p.tail;
+        p = ToPath(FromPathNoTail(p, both[i]->f, log_side_size), both[1 - i]->f,
+                   log_side_size);
+        p.tail = tail;
+      }
+    }
+  }
+
+  // As UpsizeEmit in taffy-cuckoo.c: inserts into t, which is twice the size of this,
+  // the one or two paths that p on side s becomes.
+  void UpsizeEmit(const Path& p, int s, TaffyCuckooFilterT* t) const {
+    uint64_t q = FromPathNoTail(p, sides[s].f, log_side_size);
+    const uint64_t next_bit = 1ul << (64 - log_side_size - HeadBits - 1);
+    if (p.tail == 1ul << TailBits) {
+      // No tail bits left, so p matches keys with either value of the next bit
+      for (int bit = 0; bit < 2; ++bit) {
+        Path r = ToPath(q | (bit * next_bit), t->sides[0].f, t->log_side_size);
+        r.tail = p.tail;
+        t->InsertSidePathTtl(0, r, 32);
+      }
+      return;
+    }
+    // Move the first bit of the tail into the index
+    if (p.tail >> TailBits) q |= next_bit;
+    Path r = ToPath(q, t->sides[0].f, t->log_side_size);
+    r.tail = libfilter_mask(TailBits + 1, p.tail << 1);
+    t->InsertSidePathTtl(0, r, 32);
+  }
+};
+
+}  // namespace filter
@@ -7,8 +7,6 @@
 //
 // See "How to Approximate A Set Without Knowing Its Size In Advance", by
 // Rasmus Pagh, Gil Segev, and Udi Wieder
-//
-// TODO: Intersection, iteration, Freeze/Thaw, serialize/deserialize
 
 #pragma once
 
@@ -18,7 +16,9 @@ extern "C" {
 
 #include <cstdint>
 #include <new>
+#include <stdexcept>
 #include <utility>
+#include <vector>
 
 namespace filter {
 
@@ -28,9 +28,37 @@ struct FrozenTaffyCuckoo {
     return libfilter_frozen_taffy_cuckoo_find_hash(&b, x);
   }
 
+  void FindHashBatch(const uint64_t* hashes, size_t n, bool* results) const {
+    libfilter_frozen_taffy_cuckoo_find_hash_batch(&b, hashes, n, results);
+  }
+
   size_t SizeInBytes() const { return libfilter_frozen_taffy_cuckoo_size_in_bytes(&b); }
   // bool InsertHash(uint64_t hash);
 
+  uint64_t SerializedSize() const {
+    return libfilter_frozen_taffy_cuckoo_serialized_size(&b);
+  }
+  void Serialize(char* to) const { libfilter_frozen_taffy_cuckoo_serialize(&b, to); }
+
+  static FrozenTaffyCuckoo Deserialize(uint64_t size_in_bytes, const char* from) {
+    libfilter_frozen_taffy_cuckoo result;
+    if (0 != libfilter_frozen_taffy_cuckoo_deserialize(size_in_bytes, from, &result)) {
+      libfilter_frozen_taffy_cuckoo_destruct(&result);
+      throw std::runtime_error("libfilter_frozen_taffy_cuckoo_deserialize");
+    }
+    return FrozenTaffyCuckoo{std::move(result)};
+  }
+
+  // The result reads from "from" in place, so "from" must outlive it.
+  static FrozenTaffyCuckoo DeserializeAdopt(uint64_t size_in_bytes, const char* from) {
+    libfilter_frozen_taffy_cuckoo result;
+    if (0 !=
+        libfilter_frozen_taffy_cuckoo_deserialize_adopt(size_in_bytes, from, &result)) {
+      throw std::runtime_error("libfilter_frozen_taffy_cuckoo_deserialize_adopt");
+    }
+    return FrozenTaffyCuckoo{std::move(result)};
+  }
+
   INLINE static const char* Name() {
     thread_local const constexpr char result[] = "FrozenTaffyCuckoo";
     return result;
@@ -49,6 +77,7 @@ struct FrozenTaffyCuckoo {
     for (int i = 0; i < 2; ++i) {
       that.b.data_[i] = NULL;
       that.b.stash_[i] = NULL;
+      that.b.overflow_[i] = NULL;
     }
   }
   FrozenTaffyCuckoo(libfilter_frozen_taffy_cuckoo&& that) {
@@ -56,10 +85,43 @@ struct FrozenTaffyCuckoo {
     for (int i = 0; i < 2; ++i) {
       that.data_[i] = NULL;
       that.stash_[i] = NULL;
+      that.overflow_[i] = NULL;
     }
   }
 };
 
+// See libfilter_static_taffy_cuckoo
+struct StaticTaffyCuckoo {
+  libfilter_static_taffy_cuckoo b;
+  bool FindHash(uint64_t x) const {
+    return libfilter_static_taffy_cuckoo_find_hash(&b, x);
+  }
+  size_t SizeInBytes() const { return libfilter_static_taffy_cuckoo_size_in_bytes(&b); }
+  double Fpp() const { return b.fpp; }
+
+  INLINE static const char* Name() {
+    thread_local const constexpr char result[] = "StaticTaffyCuckoo";
+    return result;
+  }
+
+  ~StaticTaffyCuckoo() { libfilter_static_taffy_cuckoo_destruct(&b); }
+  StaticTaffyCuckoo(const StaticTaffyCuckoo&) = delete;
+  StaticTaffyCuckoo& operator=(const StaticTaffyCuckoo&) = delete;
+  StaticTaffyCuckoo& operator=(StaticTaffyCuckoo&& that) {
+    this->~StaticTaffyCuckoo();
+    new (this) StaticTaffyCuckoo(std::move(that));
+    return *this;
+  }
+  StaticTaffyCuckoo(StaticTaffyCuckoo&& that) {
+    b = that.b;
+    that.b.prefixes = 0;
+  }
+  StaticTaffyCuckoo(libfilter_static_taffy_cuckoo&& that) {
+    b = that;
+    that.prefixes = 0;
+  }
+};
+
 struct TaffyCuckooFilter {
   TaffyCuckooFilter(const TaffyCuckooFilter& that) {
     libfilter_taffy_cuckoo_clone(&that.b, &b);
@@ -79,7 +141,9 @@ struct TaffyCuckooFilter {
     for (int i = 0; i < 2; ++i) {
       that.b.sides[i].data = NULL;
       that.b.sides[i].stash = NULL;
+      that.b.sides[i].overflow = NULL;
     }
+    that.b.migrating_from = NULL;
   }
 
   TaffyCuckooFilter(libfilter_taffy_cuckoo&& that) {
@@ -87,7 +151,9 @@ struct TaffyCuckooFilter {
     for (int i = 0; i < 2; ++i) {
       that.sides[i].data = NULL;
       that.sides[i].stash = NULL;
+      that.sides[i].overflow = NULL;
     }
+    that.migrating_from = NULL;
   }
 
   libfilter_taffy_cuckoo b;
@@ -97,6 +163,13 @@ struct TaffyCuckooFilter {
     return TaffyCuckooFilter{libfilter_taffy_cuckoo_create_with_bytes(bytes)};
   }
 
+  static TaffyCuckooFilter CreateWithBytes(size_t bytes,
+                                           const libfilter_taffy_cuckoo_policy& policy) {
+    TaffyCuckooFilter result = CreateWithBytes(bytes);
+    result.SetPolicy(policy);
+    return result;
+  }
+
   static const char* Name() {
     thread_local const constexpr char result[] = "TaffyCuckoo";
     return result;
@@ -104,15 +177,218 @@ struct TaffyCuckooFilter {
 
   bool InsertHash(uint64_t h) { return libfilter_taffy_cuckoo_add_hash(&b, h); }
   bool FindHash(uint64_t h) const { return libfilter_taffy_cuckoo_find_hash(&b, h); }
+  // h must have been inserted. See libfilter_taffy_cuckoo_remove_hash for the details.
+  bool RemoveHash(uint64_t h) { return libfilter_taffy_cuckoo_remove_hash(&b, h); }
+  // Halves the size of the filter, which RemoveHash also does when the filter is nearly
+  // empty
+  void Downsize() { libfilter_taffy_cuckoo_downsize(&b); }
+  // Sets results[i] to FindHash(hashes[i]) for all i < n, faster than one at a time
+  void FindHashBatch(const uint64_t* hashes, size_t n, bool* results) const {
+    libfilter_taffy_cuckoo_find_hash_batch(&b, hashes, n, results);
+  }
   size_t SizeInBytes() const { return libfilter_taffy_cuckoo_size_in_bytes(&b); }
-  FrozenTaffyCuckoo Freeze() const {
-    return FrozenTaffyCuckoo{libfilter_taffy_cuckoo_freeze(&b)};
+  // All zero unless LIBFILTER_TAFFY_CUCKOO_STATS is defined. See
+  // libfilter_taffy_cuckoo_stats.
+  libfilter_taffy_cuckoo_stats Stats() const { return b.stats; }
+
+  // The entries in chunk number "chunk" of "chunks". See libfilter_taffy_cuckoo_cursor.
+  std::vector<libfilter_taffy_cuckoo_entry> Entries(int chunk = 0, int chunks = 1) const {
+    std::vector<libfilter_taffy_cuckoo_entry> result;
+    libfilter_taffy_cuckoo_cursor cursor =
+        libfilter_taffy_cuckoo_cursor_create(&b, chunk, chunks);
+    libfilter_taffy_cuckoo_entry out[256];
+    size_t n;
+    while ((n = libfilter_taffy_cuckoo_cursor_next(&cursor, out, 256)) > 0) {
+      result.insert(result.end(), out, out + n);
+    }
+    return result;
+  }
+
+  // See libfilter_taffy_cuckoo_policy
+  void SetPolicy(const libfilter_taffy_cuckoo_policy& policy) {
+    libfilter_taffy_cuckoo_set_policy(&b, policy);
+  }
+
+  // Upsizes caused by inserts will use up to this many threads
+  void SetUpsizeThreads(int threads) {
+    libfilter_taffy_cuckoo_set_upsize_threads(&b, threads);
+  }
+
+  uint64_t SerializedSize() const { return libfilter_taffy_cuckoo_serialized_size(&b); }
+  void Serialize(char* to) const { libfilter_taffy_cuckoo_serialize(&b, to); }
+
+  static TaffyCuckooFilter Deserialize(uint64_t size_in_bytes, const char* from) {
+    libfilter_taffy_cuckoo result;
+    if (0 != libfilter_taffy_cuckoo_deserialize(size_in_bytes, from, &result)) {
+      libfilter_taffy_cuckoo_destruct(&result);
+      throw std::runtime_error("libfilter_taffy_cuckoo_deserialize");
+    }
+    return TaffyCuckooFilter{std::move(result)};
+  }
+
+  // The result reads and writes the buckets in "from" in place, so "from" must outlive
+  // it.
+  static TaffyCuckooFilter DeserializeAdopt(uint64_t size_in_bytes, char* from) {
+    libfilter_taffy_cuckoo result;
+    if (0 != libfilter_taffy_cuckoo_deserialize_adopt(size_in_bytes, from, &result)) {
+      libfilter_taffy_cuckoo_destruct(&result);
+      throw std::runtime_error("libfilter_taffy_cuckoo_deserialize_adopt");
+    }
+    return TaffyCuckooFilter{std::move(result)};
+  }
+
+  FrozenTaffyCuckoo Freeze(libfilter_frozen_taffy_cuckoo_layout layout =
+                               libfilter_frozen_taffy_cuckoo_packed) const {
+    return FrozenTaffyCuckoo{libfilter_taffy_cuckoo_freeze_layout(&b, layout)};
+  }
+  // See libfilter_taffy_cuckoo_to_static
+  StaticTaffyCuckoo ToStatic() const {
+    return StaticTaffyCuckoo{libfilter_taffy_cuckoo_to_static(&b)};
+  }
+  // The reverse of Freeze, except that the tails are gone. See
+  // libfilter_frozen_taffy_cuckoo_thaw.
+  static TaffyCuckooFilter Thaw(const FrozenTaffyCuckoo& x) {
+    return TaffyCuckooFilter{libfilter_frozen_taffy_cuckoo_thaw(&x.b)};
   }
   ~TaffyCuckooFilter() { libfilter_taffy_cuckoo_destruct(&b); }
 };
 
+// A TaffyCuckooFilter that spreads the work of each upsize over the inserts that follow
+// it, bounding the latency of any single insert.
+struct IncrementalTaffyCuckooFilter : TaffyCuckooFilter {
+  // Buckets moved to the larger table per insert. At 0.9 load, the old table is fully
+  // migrated long before the new one needs to upsize.
+  static constexpr uint64_t kMigratePerInsert = 2;
+
+  static IncrementalTaffyCuckooFilter CreateWithBytes(size_t bytes) {
+    return IncrementalTaffyCuckooFilter{libfilter_taffy_cuckoo_create_with_bytes(bytes)};
+  }
+
+  static const char* Name() {
+    thread_local const constexpr char result[] = "IncrementalTaffyCuckoo";
+    return result;
+  }
+
+ protected:
+  IncrementalTaffyCuckooFilter(libfilter_taffy_cuckoo&& that)
+      : TaffyCuckooFilter(std::move(that)) {
+    libfilter_taffy_cuckoo_set_incremental_upsize(&b, kMigratePerInsert);
+  }
+};
+
+// A TaffyCuckooFilter that inserts by breadth-first search for the shortest chain of
+// evictions, rather than by random walk
+struct BfsTaffyCuckooFilter : TaffyCuckooFilter {
+  static BfsTaffyCuckooFilter CreateWithBytes(size_t bytes) {
+    return BfsTaffyCuckooFilter{libfilter_taffy_cuckoo_create_with_bytes(bytes)};
+  }
+
+  static const char* Name() {
+    thread_local const constexpr char result[] = "BfsTaffyCuckoo";
+    return result;
+  }
+
+ protected:
+  BfsTaffyCuckooFilter(libfilter_taffy_cuckoo&& that) : TaffyCuckooFilter(std::move(that)) {
+    libfilter_taffy_cuckoo_set_bfs_insert(&b, true);
+  }
+};
+
+// A TaffyCuckooFilter that grows its buckets in place when it upsizes, rather than
+// copying them to a new filter, so it needs less memory at the peak of an upsize
+struct InPlaceTaffyCuckooFilter : TaffyCuckooFilter {
+  static InPlaceTaffyCuckooFilter CreateWithBytes(size_t bytes) {
+    return InPlaceTaffyCuckooFilter{libfilter_taffy_cuckoo_create_with_bytes(bytes)};
+  }
+
+  static const char* Name() {
+    thread_local const constexpr char result[] = "InPlaceTaffyCuckoo";
+    return result;
+  }
+
+ protected:
+  InPlaceTaffyCuckooFilter(libfilter_taffy_cuckoo&& that)
+      : TaffyCuckooFilter(std::move(that)) {
+    libfilter_taffy_cuckoo_set_in_place_upsize(&b, true);
+  }
+};
+
+// A taffy cuckoo filter that any number of threads can insert into and look up in at
+// once
+struct ConcurrentTaffyCuckooFilter {
+  libfilter_concurrent_taffy_cuckoo b;
+
+  static ConcurrentTaffyCuckooFilter CreateWithBytes(size_t bytes) {
+    ConcurrentTaffyCuckooFilter result;
+    libfilter_concurrent_taffy_cuckoo_init(bytes, &result.b);
+    return result;
+  }
+
+  static const char* Name() {
+    thread_local const constexpr char result[] = "ConcurrentTaffyCuckoo";
+    return result;
+  }
+
+  bool InsertHash(uint64_t h) { return libfilter_concurrent_taffy_cuckoo_add_hash(&b, h); }
+  bool FindHash(uint64_t h) const {
+    return libfilter_concurrent_taffy_cuckoo_find_hash(&b, h);
+  }
+  size_t SizeInBytes() const { return libfilter_concurrent_taffy_cuckoo_size_in_bytes(&b); }
+
+  // Upsizes will use up to this many threads. Not thread-safe.
+  void SetUpsizeThreads(int threads) {
+    libfilter_concurrent_taffy_cuckoo_set_upsize_threads(&b, threads);
+  }
+
+  ConcurrentTaffyCuckooFilter(const ConcurrentTaffyCuckooFilter&) = delete;
+  ConcurrentTaffyCuckooFilter& operator=(const ConcurrentTaffyCuckooFilter&) = delete;
+  ConcurrentTaffyCuckooFilter& operator=(ConcurrentTaffyCuckooFilter&& that) {
+    this->~ConcurrentTaffyCuckooFilter();
+    new (this) ConcurrentTaffyCuckooFilter(std::move(that));
+    return *this;
+  }
+  ConcurrentTaffyCuckooFilter(ConcurrentTaffyCuckooFilter&& that) {
+    b = that.b;
+    that.b.table = NULL;
+    that.b.stripes = NULL;
+    that.b.retired = NULL;
+    that.b.retired_size = 0;
+  }
+  ~ConcurrentTaffyCuckooFilter() { libfilter_concurrent_taffy_cuckoo_destruct(&b); }
+
+ protected:
+  ConcurrentTaffyCuckooFilter() {}
+};
+
 TaffyCuckooFilter Union(const TaffyCuckooFilter& x, const TaffyCuckooFilter& y) {
   return {libfilter_taffy_cuckoo_union(&x.b, &y.b)};
 }
 
+TaffyCuckooFilter Union(const TaffyCuckooFilter& x, const TaffyCuckooFilter& y,
+                        int threads) {
+  return {libfilter_taffy_cuckoo_union_parallel(&x.b, &y.b, threads)};
+}
+
+// The union of all of filters, built in one pass. See libfilter_taffy_cuckoo_union_many.
+TaffyCuckooFilter Union(const std::vector<const TaffyCuckooFilter*>& filters,
+                        int threads = 1) {
+  std::vector<const libfilter_taffy_cuckoo*> bs;
+  for (const TaffyCuckooFilter* f : filters) bs.push_back(&f->b);
+  return {libfilter_taffy_cuckoo_union_many_parallel(bs.data(), bs.size(), threads)};
+}
+
+// Union, then Freeze, without keeping the unfrozen union
+FrozenTaffyCuckoo UnionFreeze(
+    const std::vector<const TaffyCuckooFilter*>& filters,
+    libfilter_frozen_taffy_cuckoo_layout layout = libfilter_frozen_taffy_cuckoo_packed) {
+  std::vector<const libfilter_taffy_cuckoo*> bs;
+  for (const TaffyCuckooFilter* f : filters) bs.push_back(&f->b);
+  return FrozenTaffyCuckoo{
+      libfilter_taffy_cuckoo_union_many_freeze(bs.data(), bs.size(), layout)};
+}
+
+TaffyCuckooFilter Intersect(const TaffyCuckooFilter& x, const TaffyCuckooFilter& y) {
+  return {libfilter_taffy_cuckoo_intersect(&x.b, &y.b)};
+}
+
 }  // namespace filter
@@ -2,7 +2,7 @@ package libfilter
 
 // TODO: union
 
-// #cgo LDFLAGS: lib/libfilter.a
+// #cgo LDFLAGS: lib/libfilter.a -lpthread
 // #include <filter/taffy-cuckoo.h>
 import "C"
 import "runtime"
@@ -72,6 +72,7 @@ typedef struct {
   size_t stash_capacity;
   size_t stash_size;
   libfilter_taffy_cuckoo_path* stash;
+  uint64_t* overflow;
 } libfilter_taffy_cuckoo_side;
 
 typedef struct {
@@ -82,12 +83,39 @@ typedef struct {
   int remaining_bits;
 } libfilter_pcg_random;
 
+typedef struct {
+  uint64_t kicks;
+  uint64_t kick_chains[8];
+  uint64_t stash_inserts;
+  uint64_t stash_hits, bucket_hits;
+  uint64_t upsizes, upsize_nanos;
+  uint64_t tail_shortenings, tail_splits;
+  uint64_t pending_depths[8];
+  uint64_t pending_overflows;
+} libfilter_taffy_cuckoo_stats;
+
+typedef struct {
+  double max_load;
+  int ttl;
+  size_t max_stash;
+  int growth_steps;
+} libfilter_taffy_cuckoo_policy;
+
 typedef struct libfilter_taffy_cuckoo_struct {
   libfilter_taffy_cuckoo_side sides[2];
   int log_side_size;
   libfilter_pcg_random rng;
-  const uint64_t* entropy;
+  uint64_t entropy[8];
   uint64_t occupied;
+  bool borrowed;
+  uint64_t migrate_per_insert;
+  struct libfilter_taffy_cuckoo_struct* migrating_from;
+  uint64_t migrate_cursor;
+  int upsize_threads;
+  bool bfs_insert;
+  bool in_place_upsize;
+  libfilter_taffy_cuckoo_policy policy;
+  libfilter_taffy_cuckoo_stats stats;
 } libfilter_taffy_cuckoo;
 
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y);
@@ -97,6 +125,7 @@ uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here
 inline bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here, uint64_t k);
 void libfilter_taffy_cuckoo_destruct(libfilter_taffy_cuckoo* t);
 inline bool libfilter_taffy_cuckoo_add_hash(libfilter_taffy_cuckoo* here, uint64_t k);
+bool libfilter_taffy_cuckoo_remove_hash(libfilter_taffy_cuckoo* here, uint64_t k);
 /* TODO: union */
 
 typedef struct {
@@ -106,13 +135,21 @@ typedef struct {
   uint64_t three : 10;
 } libfilter_frozen_taffy_cuckoo_bucket;
 
+typedef enum {
+  libfilter_frozen_taffy_cuckoo_packed = 0,
+  libfilter_frozen_taffy_cuckoo_aligned = 1,
+} libfilter_frozen_taffy_cuckoo_layout;
+
 typedef struct libfilter_frozen_taffy_cuckoo_struct {
   libfilter_feistel hash_[2];
   int log_side_size_;
+  libfilter_frozen_taffy_cuckoo_layout layout_;
   libfilter_frozen_taffy_cuckoo_bucket* data_[2];
   uint64_t* stash_[2];
   size_t stash_capacity_[2];
   size_t stash_size_[2];
+  uint64_t* overflow_[2];
+  bool borrowed_;
 } libfilter_frozen_taffy_cuckoo;
 
 void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo*, libfilter_frozen_taffy_cuckoo*);
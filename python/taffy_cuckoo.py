@@ -12,6 +12,11 @@ class TaffyCuckoo:
     # TODO: size may increase. Increase GC pressure?
     return self
 
+  # The hash must have been added. See libfilter_taffy_cuckoo_remove_hash.
+  def __isub__(self, hash):
+    lib.libfilter_taffy_cuckoo_remove_hash(self.b, hash)
+    return self
+
   def __contains__(self, hash):
     return lib.libfilter_taffy_cuckoo_find_hash(self.b, hash)
 